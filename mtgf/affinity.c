@@ -0,0 +1,373 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <ctype.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "affinity.h"
+#include "log.h"
+
+#define AFFINITY_ROLES 4
+#define AFFINITY_NODES 64
+
+typedef struct affinity_role_t
+{
+  const char *name;
+  int threads, peak; // running now and at most at once
+  int on_cpu[CPU_SETSIZE]; // running threads allowed on each CPU
+} affinity_role_t;
+
+static int active = 0;  // a node was chosen or threads are pinned
+static int node = -1;   // the node from affinity_init, or -1
+static const char *node_from = NULL;
+static int pin_threads = 0;
+static int cpus[CPU_SETSIZE], ncpus;
+static int pinned[CPU_SETSIZE]; // running threads pinned to each CPU, by index in cpus
+static int cpu_node[CPU_SETSIZE];
+
+// Guarded by roles_mutex
+static pthread_mutex_t roles_mutex = PTHREAD_MUTEX_INITIALIZER;
+static affinity_role_t roles[AFFINITY_ROLES];
+static int nroles;
+
+// Where the calling thread was placed, undone by thread_exit
+static pthread_key_t thread_key;
+static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+static __thread cpu_set_t my_cpus;
+static __thread int my_pin = -1;
+
+// Parses a kernel CPU list such as "0-3,8-11"
+static int read_cpulist(const char *path, cpu_set_t *set)
+{
+  char buf[4096], *ptr, *end;
+  long lo, hi;
+  FILE *file;
+
+  CPU_ZERO(set);
+  if (NULL == (file = fopen(path, "r")))
+  {
+    return -1;
+  }
+  if (fgets(buf, sizeof(buf), file) == NULL)
+  {
+    buf[0] = '\0';
+  }
+  fclose(file);
+
+  for (ptr = buf; *ptr != '\0' && *ptr != '\n'; ptr = *end == ',' ? end + 1 : end)
+  {
+    lo = hi = strtol(ptr, &end, 10);
+    if (end == ptr)
+    {
+      break;
+    }
+    if (*end == '-')
+    {
+      ptr = end + 1;
+      hi = strtol(ptr, &end, 10);
+    }
+    for (long cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++)
+    {
+      CPU_SET(cpu, set);
+    }
+  }
+  return 0;
+}
+
+static void format_cpus(const cpu_set_t *set, char *buf, size_t size)
+{
+  size_t len = 0;
+  int lo;
+
+  buf[0] = '\0';
+  for (int cpu = 0; cpu < CPU_SETSIZE && len < size; cpu++)
+  {
+    if (!CPU_ISSET(cpu, set))
+    {
+      continue;
+    }
+    for (lo = cpu; cpu + 1 < CPU_SETSIZE && CPU_ISSET(cpu + 1, set); cpu++)
+      ;
+    len += snprintf(buf + len, size - len, lo == cpu ? "%s%d" : "%s%d-%d", len > 0 ? "," : "", lo, cpu);
+  }
+}
+
+static void read_topology()
+{
+  char path[64];
+  cpu_set_t set;
+
+  memset(cpu_node, -1, sizeof(cpu_node));
+  for (int n = 0; n < AFFINITY_NODES; n++)
+  {
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+    if (read_cpulist(path, &set) < 0)
+    {
+      continue;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+      if (CPU_ISSET(cpu, &set))
+      {
+        cpu_node[cpu] = n;
+      }
+    }
+  }
+}
+
+// A node number, or the node of a network interface's device
+static int parse_node(const char *spec)
+{
+  char path[128];
+  FILE *file;
+  int n = -1;
+
+  if (isdigit((unsigned char)spec[0]))
+  {
+    return atoi(spec);
+  }
+
+  snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", spec);
+  if (NULL == (file = fopen(path, "r")))
+  {
+    L(ERROR, "affinity: no NUMA node for interface %s: %s", spec, strerror(errno));
+    return -1;
+  }
+  if (fscanf(file, "%d", &n) != 1 || n < 0)
+  {
+    L(ERROR, "affinity: interface %s is not attached to a NUMA node", spec);
+    n = -1;
+  }
+  fclose(file);
+  return n;
+}
+
+int affinity_init(const char *spec, int pin)
+{
+  cpu_set_t allowed, on_node;
+  char path[64];
+
+  read_topology();
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+
+  if (spec != NULL)
+  {
+    if ((node = parse_node(spec)) < 0)
+    {
+      return -1;
+    }
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    if (read_cpulist(path, &on_node) < 0)
+    {
+      L(ERROR, "affinity: no NUMA node %d", node);
+      return -1;
+    }
+    CPU_AND(&allowed, &allowed, &on_node);
+    if (CPU_COUNT(&allowed) == 0 || sched_setaffinity(0, sizeof(allowed), &allowed) < 0)
+    {
+      L(ERROR, "affinity: unable to run on node %d", node);
+      return -1;
+    }
+    node_from = isdigit((unsigned char)spec[0]) ? NULL : spec;
+  }
+
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+  {
+    if (CPU_ISSET(cpu, &allowed))
+    {
+      cpus[ncpus++] = cpu;
+    }
+  }
+
+  pin_threads = pin;
+  active = spec != NULL || pin;
+  if (active)
+  {
+    char buf[256];
+
+    format_cpus(&allowed, buf, sizeof(buf));
+    L(INFO, "affinity: threads run on cpus %s%s", buf, pin ? ", each pinned to one" : "");
+  }
+  return 0;
+}
+
+// Elastic workers come and go, so counts and CPU loads only cover threads still running
+static void thread_exit(void *arg)
+{
+  affinity_role_t *r = arg;
+
+  pthread_mutex_lock(&roles_mutex);
+  r->threads--;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+  {
+    if (CPU_ISSET(cpu, &my_cpus))
+    {
+      r->on_cpu[cpu]--;
+    }
+  }
+  if (my_pin >= 0)
+  {
+    pinned[my_pin]--;
+  }
+  pthread_mutex_unlock(&roles_mutex);
+}
+
+static void thread_key_create()
+{
+  pthread_key_create(&thread_key, thread_exit);
+}
+
+void affinity_thread(const char *role, int pin)
+{
+  affinity_role_t *r = NULL;
+  cpu_set_t set;
+
+  pthread_once(&thread_once, thread_key_create);
+  pthread_mutex_lock(&roles_mutex);
+
+  // The allowed CPU with the fewest threads pinned to it right now
+  if (pin && pin_threads && ncpus > 0)
+  {
+    my_pin = 0;
+    for (int i = 1; i < ncpus; i++)
+    {
+      if (pinned[i] < pinned[my_pin])
+      {
+        my_pin = i;
+      }
+    }
+    pinned[my_pin]++;
+    CPU_ZERO(&set);
+    CPU_SET(cpus[my_pin], &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+  else
+  {
+    pthread_getaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+
+  for (int i = 0; i < nroles && r == NULL; i++)
+  {
+    if (strcmp(roles[i].name, role) == 0)
+    {
+      r = &roles[i];
+    }
+  }
+  if (r == NULL && nroles < AFFINITY_ROLES)
+  {
+    r = &roles[nroles++];
+    r->name = role;
+  }
+  if (r != NULL)
+  {
+    if (++r->threads > r->peak)
+    {
+      r->peak = r->threads;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+      if (CPU_ISSET(cpu, &set))
+      {
+        r->on_cpu[cpu]++;
+      }
+    }
+    my_cpus = set;
+    pthread_setspecific(thread_key, r);
+  }
+  else if (my_pin >= 0)
+  {
+    pinned[my_pin]--;
+    my_pin = -1;
+  }
+  pthread_mutex_unlock(&roles_mutex);
+}
+
+void *affinity_alloc(size_t size)
+{
+  unsigned long mask;
+  void *ptr;
+  int target = node;
+
+  if (!active)
+  {
+    return malloc(size);
+  }
+
+  if ((ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+  {
+    return NULL;
+  }
+
+  // Preferred rather than bound, so that a full node falls back to another
+  if (target < 0)
+  {
+    int cpu = sched_getcpu();
+
+    target = cpu >= 0 && cpu < CPU_SETSIZE ? cpu_node[cpu] : -1;
+  }
+  if (target >= 0 && target < (int)(8 * sizeof(mask)))
+  {
+    mask = 1UL << target;
+    syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, &mask, 8 * sizeof(mask), 0);
+  }
+  return ptr;
+}
+
+void affinity_free(void *ptr, size_t size)
+{
+  if (!active)
+  {
+    free(ptr);
+  }
+  else if (ptr != NULL)
+  {
+    munmap(ptr, size);
+  }
+}
+
+void affinity_report()
+{
+  char buf[256];
+  cpu_set_t live, nodes;
+
+  if (!active)
+  {
+    return;
+  }
+
+  if (node >= 0)
+  {
+    L(INFO, "affinity: NUMA node %d%s%s", node, node_from != NULL ? " of " : "", node_from != NULL ? node_from : "");
+  }
+
+  pthread_mutex_lock(&roles_mutex);
+  for (int i = 0; i < nroles; i++)
+  {
+    CPU_ZERO(&live);
+    CPU_ZERO(&nodes);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+      if (roles[i].on_cpu[cpu] > 0)
+      {
+        CPU_SET(cpu, &live);
+        if (cpu_node[cpu] >= 0)
+        {
+          CPU_SET(cpu_node[cpu], &nodes);
+        }
+      }
+    }
+    format_cpus(&live, buf, sizeof(buf) / 2);
+    format_cpus(&nodes, buf + sizeof(buf) / 2, sizeof(buf) / 2);
+    L(INFO, "affinity: %d %s threads running (peak %d) on cpus %s, nodes %s", roles[i].threads, roles[i].name,
+      roles[i].peak, buf, buf + sizeof(buf) / 2);
+  }
+  pthread_mutex_unlock(&roles_mutex);
+}
@@ -0,0 +1,40 @@
+#ifndef __AFFINITY_H__
+#define __AFFINITY_H__
+
+#include <stddef.h>
+
+/*
+ * CPU and NUMA placement of the server's threads, read from /sys.  Threads
+ * inherit the CPU affinity of the thread that starts them, so restricting
+ * the main thread to a node before any other starts keeps them all there.
+ */
+
+/*
+ * Restricts the calling thread to the CPUs of a NUMA node, given as a node
+ * number or as a network interface whose device's node is used, unless
+ * node is NULL.  With pin, affinity_thread gives each thread that asks the
+ * allowed CPU with the fewest running threads pinned to it.  Returns -1 if the node
+ * cannot be found or has no usable CPU.
+ */
+int affinity_init(const char *node, int pin);
+
+/*
+ * Places the calling thread, pinning it to the least loaded CPU if pin is
+ * set and pinning was asked for, and records where it runs under role for
+ * affinity_report until the thread exits.
+ */
+void affinity_thread(const char *role, int pin);
+
+/*
+ * Allocates a buffer preferably on the node the calling thread runs on,
+ * or on the node given to affinity_init.  Buffers must be released with
+ * affinity_free and the same size.  Without a node or pinning these are
+ * malloc and free.
+ */
+void *affinity_alloc(size_t size);
+void affinity_free(void *ptr, size_t size);
+
+/* Logs the node and the CPUs each role's threads were placed on. */
+void affinity_report();
+
+#endif
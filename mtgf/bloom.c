@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "bloom.h"
+
+#define BLOOM_BLOCK_WORDS 8 // 512 bits, one cache line
+#define BLOOM_PROBES 7
+
+struct bloom_t
+{
+  uint64_t (*blocks)[BLOOM_BLOCK_WORDS];
+  size_t nblocks;
+};
+
+// FNV-1a, then a finalizer so that the high and low halves are both usable
+static uint64_t bloom_hash(const char *key)
+{
+  uint64_t hash = 14695981039346656037ULL;
+
+  while (*key != '\0')
+  {
+    hash ^= (unsigned char)*key++;
+    hash *= 1099511628211ULL;
+  }
+
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+bloom_t *bloom_create(size_t nkeys)
+{
+  bloom_t *bloom = malloc(sizeof(bloom_t));
+
+  if (bloom == NULL)
+  {
+    return NULL;
+  }
+  bloom->nblocks = (nkeys * BLOOM_BITS_PER_KEY + 511) / 512;
+  if (bloom->nblocks == 0)
+  {
+    bloom->nblocks = 1;
+  }
+  if (posix_memalign((void **)&bloom->blocks, 64, bloom->nblocks * sizeof(*bloom->blocks)) != 0)
+  {
+    free(bloom);
+    return NULL;
+  }
+  memset(bloom->blocks, 0, bloom->nblocks * sizeof(*bloom->blocks));
+  return bloom;
+}
+
+// The block comes from the high half of the hash, the probes from the low half
+void bloom_add(bloom_t *bloom, const char *key)
+{
+  uint64_t hash = bloom_hash(key);
+  uint64_t *block = bloom->blocks[(hash >> 32) % bloom->nblocks];
+  uint32_t h1 = hash, h2 = (hash >> 16) | 1;
+
+  for (int i = 0; i < BLOOM_PROBES; i++, h1 += h2)
+  {
+    block[(h1 >> 6) & 7] |= 1ULL << (h1 & 63);
+  }
+}
+
+int bloom_may_contain(const bloom_t *bloom, const char *key)
+{
+  uint64_t hash = bloom_hash(key);
+  const uint64_t *block = bloom->blocks[(hash >> 32) % bloom->nblocks];
+  uint32_t h1 = hash, h2 = (hash >> 16) | 1;
+
+  for (int i = 0; i < BLOOM_PROBES; i++, h1 += h2)
+  {
+    if (!(block[(h1 >> 6) & 7] & (1ULL << (h1 & 63))))
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void bloom_destroy(bloom_t *bloom)
+{
+  free(bloom->blocks);
+  free(bloom);
+}
@@ -0,0 +1,27 @@
+#ifndef __BLOOM_H__
+#define __BLOOM_H__
+
+#include <stddef.h>
+
+/*
+ * A blocked Bloom filter over strings: each key sets and tests bits within
+ * a single 64-byte block, so a lookup touches one cache line.  It answers
+ * whether a key may have been added, with no false negatives and, at
+ * BLOOM_BITS_PER_KEY, about 1% false positives.  Adding is not
+ * thread-safe; testing a filter that is no longer being added to is.
+ */
+#define BLOOM_BITS_PER_KEY 10
+
+typedef struct bloom_t bloom_t;
+
+/* Sizes a filter for nkeys keys.  Returns NULL if out of memory. */
+bloom_t *bloom_create(size_t nkeys);
+
+void bloom_add(bloom_t *bloom, const char *key);
+
+/* Returns 0 if key was certainly never added and 1 if it may have been. */
+int bloom_may_contain(const bloom_t *bloom, const char *key);
+
+void bloom_destroy(bloom_t *bloom);
+
+#endif
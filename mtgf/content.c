@@ -6,15 +6,19 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#include "bloom.h"
+
 #define MAX_KEYLEN 512
 
 typedef struct{
 	int fildes;
+	off_t size;
 	char key[MAX_KEYLEN];
 } item_t;
 
 static int nitems;
 static item_t *items;
+static bloom_t *filter;
 
 static int _itemcmp(const void *a, const void *b){
 	return strcmp(((item_t*) a)->key,((item_t*) b)->key);
@@ -22,8 +26,9 @@ static int _itemcmp(const void *a, const void *b){
 
 int content_init(const char *filename){
 	FILE *filelist;
-	int capacity = 16;
+	int capacity = 16, i;
 	char *path, *ptr;
+	struct stat st;
 
 	if( NULL == (filelist = fopen(filename, "r"))){
 		fprintf(stderr, "Unable to open file in content_init.\n");
@@ -45,6 +50,11 @@ int content_init(const char *filename){
 			fprintf(stderr, "Unable to open file %s.\n", path);
 			exit(EXIT_FAILURE);
 		}
+		if( 0 > fstat(items[nitems].fildes, &st)){
+			fprintf(stderr, "Unable to stat file %s.\n", path);
+			exit(EXIT_FAILURE);
+		}
+		items[nitems].size = st.st_size;
 		nitems++;
 
 		if(nitems == capacity){
@@ -58,20 +68,22 @@ int content_init(const char *filename){
 
 	qsort(items, nitems, sizeof(item_t), _itemcmp);
 
+	/* Lets callers turn away unknown keys without a search or the delay */
+	if((filter = bloom_create(nitems)) == NULL)
+		fprintf(stderr, "Unable to allocate lookup filter, running without it.\n");
+	for(i = 0; filter != NULL && i < nitems; i++)
+		bloom_add(filter, items[i].key);
+
 	return EXIT_SUCCESS;
 }
 
 unsigned long int content_delay = 0;
 
-int content_get(const char *key){
+static item_t *_find(const char *key){
 	int lo = 0;
 	int hi = nitems - 1;
 	int mid, cmp;
 
-	if (content_delay > 0) {
-		usleep(content_delay);
-	}
-
 	while (lo <= hi) {
 		// Key is in items[lo..hi] or not present.
 		mid = lo + (hi - lo) / 2;
@@ -79,10 +91,31 @@ int content_get(const char *key){
 		if ( cmp < 0) hi = mid - 1;
 		else if (cmp > 0) lo = mid + 1;
 		else{
-			return items[mid].fildes;
+			return &items[mid];
 		} 
 	}
-	return -1;
+	return NULL;
+}
+
+int content_get(const char *key){
+	item_t *item;
+
+	if (content_delay > 0) {
+		usleep(content_delay);
+	}
+
+	item = _find(key);
+	return item == NULL ? -1 : item->fildes;
+}
+
+ssize_t content_size(const char *key){
+	item_t *item = _find(key);
+
+	return item == NULL ? -1 : item->size;
+}
+
+int content_may_exist(const char *key){
+	return filter == NULL ? -1 : bloom_may_contain(filter, key);
 }
 
 void content_destroy(){
@@ -91,4 +124,7 @@ void content_destroy(){
 		close(items[i].fildes);
 	
 	free(items);
+	if(filter != NULL)
+		bloom_destroy(filter);
+	filter = NULL;
 }
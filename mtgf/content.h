@@ -1,6 +1,8 @@
 #ifndef __CONTENT_H__
 #define __CONTENT_H__
 
+#include <sys/types.h>
+
 /* 
  * Initializes the content library given the information from
  * the provided file.  Each row of the file is assumed
@@ -19,6 +21,20 @@ int content_init(const char *filename);
  */
 int content_get(const char *key);
 
+/* 
+ * Returns the size of the file associated with the input key, as of
+ * content_init, without the delay applied by content_get.
+ * Returns -1 if the the key is not found
+ */
+ssize_t content_size(const char *key);
+
+/* 
+ * Returns 0 if there is certainly no file for the input key and 1 if
+ * there may be, consulting only a Bloom filter built by content_init.
+ * Returns -1 if the filter could not be built.
+ */
+int content_may_exist(const char *key);
+
 /* 
  * Frees all memory and closes all file descriptors
  * associated with the cache.
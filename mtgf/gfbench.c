@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/utsname.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "gfbench.h"
+#include "log.h"
+
+#define USAGE                                                                 \
+  "usage:\n"                                                                  \
+  "  gfbench [options]\n"                                                     \
+  "options:\n"                                                                \
+  "  -h                  Show this help message\n"                            \
+  "  -o [output]         JSON results file (Default: bench.json)\n"           \
+  "  -r [repetitions]    Timed repetitions per benchmark (Default: 30)\n"     \
+  "  -w [warmup]         Untimed warmup repetitions (Default: 3)\n"           \
+  "  -f [filter]         Only run benchmarks whose name contains filter\n"
+
+/* OPTIONS DESCRIPTOR ====================================================== */
+static struct option gLongOptions[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"output", required_argument, NULL, 'o'},
+    {"repetitions", required_argument, NULL, 'r'},
+    {"warmup", required_argument, NULL, 'w'},
+    {"filter", required_argument, NULL, 'f'},
+    {NULL, 0, NULL, 0}};
+
+typedef struct gfbench_result_t
+{
+  double min, mean, p50, p90, p99, max;
+} gfbench_result_t;
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+FILE *gfbench_tempfile(char *path)
+{
+  int fd;
+
+  strcpy(path, "/tmp/gfbench-XXXXXX");
+  if ((fd = mkstemp(path)) < 0)
+  {
+    perror("mkstemp");
+    exit(EXIT_FAILURE);
+  }
+
+  return fdopen(fd, "w+");
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void summarize(double *samples, int n, gfbench_result_t *result)
+{
+  double sum = 0;
+
+  qsort(samples, n, sizeof(double), cmp_double);
+  for (int i = 0; i < n; i++)
+  {
+    sum += samples[i];
+  }
+
+  result->min = samples[0];
+  result->max = samples[n - 1];
+  result->mean = sum / n;
+  result->p50 = samples[(n - 1) * 50 / 100];
+  result->p90 = samples[(n - 1) * 90 / 100];
+  result->p99 = samples[(n - 1) * 99 / 100];
+}
+
+static void json_result(FILE *out, const char *name, gfbench_result_t *result)
+{
+  fprintf(out, "\"%s\": {\"min\": %.3f, \"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}",
+          name, result->min, result->mean, result->p50, result->p90, result->p99, result->max);
+}
+
+static void run_bench(gfbench_t *bench, int reps, int warmup, FILE *out, int first)
+{
+  double *ns = malloc(sizeof(double) * reps);
+  double *cyc = malloc(sizeof(double) * reps);
+  gfbench_result_t ns_result, cyc_result;
+  uint64_t t0, c0;
+  void *state;
+
+  state = bench->setup ? bench->setup() : NULL;
+
+  for (int i = 0; i < warmup; i++)
+  {
+    bench->run(state, bench->ops);
+  }
+
+  for (int i = 0; i < reps; i++)
+  {
+    t0 = now_ns();
+    c0 = cycles();
+    bench->run(state, bench->ops);
+    cyc[i] = (double)(cycles() - c0) / bench->ops;
+    ns[i] = (double)(now_ns() - t0) / bench->ops;
+  }
+
+  if (bench->teardown)
+  {
+    bench->teardown(state);
+  }
+
+  summarize(ns, reps, &ns_result);
+  summarize(cyc, reps, &cyc_result);
+
+  fprintf(stdout, "%-32s %10.1f %10.1f %10.1f %10.1f %10.1f\n", bench->name,
+          ns_result.p50, ns_result.p90, ns_result.p99, ns_result.min, cyc_result.p50);
+
+  fprintf(out, "%s\n    {\"name\": \"%s\", \"ops_per_rep\": %zu, \"reps\": %d, ",
+          first ? "" : ",", bench->name, bench->ops, reps);
+  json_result(out, "ns_per_op", &ns_result);
+  fprintf(out, ", ");
+  json_result(out, "cycles_per_op", &cyc_result);
+  fprintf(out, "}");
+
+  free(ns);
+  free(cyc);
+}
+
+/* Main ========================================================= */
+int main(int argc, char **argv)
+{
+  char *output = "bench.json";
+  char *filter = NULL;
+  int reps = 30, warmup = 3;
+  int option_char = 0, first = 1;
+  gfbench_t *suites[] = {gfbench_server_cases, gfbench_client_cases};
+  struct utsname uts;
+  FILE *out;
+
+  while ((option_char = getopt_long(argc, argv, "ho:r:w:f:", gLongOptions, NULL)) != -1)
+  {
+    switch (option_char)
+    {
+    case 'o': // output
+      output = optarg;
+      break;
+    case 'r': // repetitions
+      reps = atoi(optarg);
+      break;
+    case 'w': // warmup
+      warmup = atoi(optarg);
+      break;
+    case 'f': // filter
+      filter = optarg;
+      break;
+    case 'h': // help
+      fprintf(stdout, "%s", USAGE);
+      exit(0);
+    default:
+      fprintf(stderr, "%s", USAGE);
+      exit(1);
+    }
+  }
+
+  if (reps < 1 || warmup < 0)
+  {
+    fprintf(stderr, "%s", USAGE);
+    exit(1);
+  }
+
+  // The benchmarked code logs at DEBUG and below; keep it quiet
+  log_set_level(WARN);
+
+  if (NULL == (out = fopen(output, "w")))
+  {
+    perror("Unable to open output file");
+    exit(EXIT_FAILURE);
+  }
+
+  uname(&uts);
+  fprintf(out, "{\n  \"host\": \"%s\",\n  \"machine\": \"%s\",\n  \"timestamp\": %ld,\n  \"benchmarks\": [",
+          uts.nodename, uts.machine, (long)time(NULL));
+
+  fprintf(stdout, "%-32s %10s %10s %10s %10s %10s\n", "benchmark", "p50 ns/op", "p90 ns/op",
+          "p99 ns/op", "min ns/op", "p50 cyc/op");
+
+  for (int s = 0; s < sizeof(suites) / sizeof(suites[0]); s++)
+  {
+    for (gfbench_t *bench = suites[s]; bench->name != NULL; bench++)
+    {
+      if (filter != NULL && strstr(bench->name, filter) == NULL)
+      {
+        continue;
+      }
+      run_bench(bench, reps, warmup, out, first);
+      first = 0;
+    }
+  }
+
+  fprintf(out, "\n  ]\n}\n");
+  fclose(out);
+
+  return 0;
+}
@@ -0,0 +1,34 @@
+#ifndef __GFBENCH_H__
+#define __GFBENCH_H__
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * A microbenchmark.  setup runs once and returns the state handed to run
+ * and teardown.  run performs ops operations and is timed as a whole; the
+ * harness repeats it to get a distribution of per-operation costs.
+ */
+typedef struct gfbench_t
+{
+  const char *name;
+  size_t ops;
+  void *(*setup)(void);
+  void (*run)(void *state, size_t ops);
+  void (*teardown)(void *state);
+} gfbench_t;
+
+/* Defined in gfbench_server.c and gfbench_client.c */
+extern gfbench_t gfbench_server_cases[];
+extern gfbench_t gfbench_client_cases[];
+
+/* Keeps the compiler from optimising away a benchmark's result. */
+#define GFBENCH_USE(x) __asm__ __volatile__("" : : "r"(x) : "memory")
+
+/*
+ * Creates a temporary file for content maps and workloads, storing its
+ * name in path (at least 32 bytes).  The caller closes and unlinks it.
+ */
+FILE *gfbench_tempfile(char *path);
+
+#endif
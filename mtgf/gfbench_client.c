@@ -0,0 +1,79 @@
+#include <stdlib.h>
+
+#include "gfclient-student.h"
+#include "gfbench.h"
+#include "workload.h"
+
+#define WORKLOAD_PATHS 10000
+
+/* Response parsing ======================================================== */
+
+static void parse_response_run(void *arg, size_t ops)
+{
+  const char *header = "GETFILE OK 123456\r\n\r\n";
+  size_t header_len = strlen(header);
+  gfstatus_t status;
+  size_t file_len;
+
+  for (size_t i = 0; i < ops; i++)
+  {
+    GFBENCH_USE(gfc_parse_response(header, header_len, &status, &file_len));
+  }
+}
+
+/* workload_get_path ======================================================= */
+
+static char workload_file[32];
+
+static void workload_setup(int mode)
+{
+  FILE *workload = gfbench_tempfile(workload_file);
+
+  for (int i = 0; i < WORKLOAD_PATHS; i++)
+  {
+    fprintf(workload, "/courses/ud923/filecorpus/file-%05d.jpg\n", i);
+  }
+  fclose(workload);
+
+  workload_init(workload_file);
+  workload_set_mode(mode);
+}
+
+static void *workload_seq_setup(void)
+{
+  workload_setup(WORKLOAD_SEQ);
+  return NULL;
+}
+
+static void *workload_rnd_setup(void)
+{
+  workload_setup(WORKLOAD_RND);
+  return NULL;
+}
+
+static void *workload_zipf_setup(void)
+{
+  workload_setup(WORKLOAD_ZIPF);
+  return NULL;
+}
+
+static void workload_run(void *arg, size_t ops)
+{
+  for (size_t i = 0; i < ops; i++)
+  {
+    GFBENCH_USE(workload_get_path());
+  }
+}
+
+static void workload_teardown(void *arg)
+{
+  workload_destroy();
+  unlink(workload_file);
+}
+
+gfbench_t gfbench_client_cases[] = {
+    {"gfc_parse_response", 100000, NULL, parse_response_run, NULL},
+    {"workload_get_path_seq", 100000, workload_seq_setup, workload_run, workload_teardown},
+    {"workload_get_path_rnd", 100000, workload_rnd_setup, workload_run, workload_teardown},
+    {"workload_get_path_zipf", 100000, workload_zipf_setup, workload_run, workload_teardown},
+    {NULL, 0, NULL, NULL, NULL}};
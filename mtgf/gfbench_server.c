@@ -0,0 +1,174 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "gfserver-student.h"
+#include "gfbench.h"
+#include "steque.h"
+
+#define CONTENT_KEYS 512
+#define STEQUE_THREADS 4
+
+/* content_get ============================================================= */
+
+typedef struct content_state_t
+{
+  char path[32];
+  char keys[CONTENT_KEYS][32];
+  unsigned int seed;
+} content_state_t;
+
+static void *content_setup(void)
+{
+  content_state_t *state = calloc(1, sizeof(content_state_t));
+  FILE *map = gfbench_tempfile(state->path);
+
+  // Every key maps to the same file: the lookup is what is being measured
+  for (int i = 0; i < CONTENT_KEYS; i++)
+  {
+    snprintf(state->keys[i], sizeof(state->keys[i]), "/bench/file-%05d", i);
+    fprintf(map, "%s %s\n", state->keys[i], state->path);
+  }
+  fclose(map);
+
+  content_init(state->path);
+  state->seed = 1;
+  return state;
+}
+
+static void content_run(void *arg, size_t ops)
+{
+  content_state_t *state = arg;
+
+  for (size_t i = 0; i < ops; i++)
+  {
+    GFBENCH_USE(content_get(state->keys[rand_r(&state->seed) % CONTENT_KEYS]));
+  }
+}
+
+static void content_teardown(void *arg)
+{
+  content_state_t *state = arg;
+
+  content_destroy();
+  unlink(state->path);
+  free(state);
+}
+
+/* steque under a mutex ==================================================== */
+
+//
+//  The worker pool's request queue: each thread enqueues and pops under one
+//  mutex, as the boss and workers do.  Threads are started once and gated
+//  by barriers so that thread creation is not part of the measurement.
+//
+typedef struct steque_state_t
+{
+  steque_t queue;
+  pthread_mutex_t mutex;
+  pthread_barrier_t start, end;
+  pthread_t threads[STEQUE_THREADS];
+  size_t ops;
+  int stop;
+} steque_state_t;
+
+static void *steque_worker(void *arg)
+{
+  steque_state_t *state = arg;
+  long item = 0;
+
+  while (1)
+  {
+    pthread_barrier_wait(&state->start);
+    if (state->stop)
+    {
+      return NULL;
+    }
+
+    for (size_t i = 0; i < state->ops / STEQUE_THREADS; i++)
+    {
+      pthread_mutex_lock(&state->mutex);
+      steque_enqueue(&state->queue, (steque_item)++item);
+      pthread_mutex_unlock(&state->mutex);
+
+      pthread_mutex_lock(&state->mutex);
+      GFBENCH_USE(steque_pop(&state->queue));
+      pthread_mutex_unlock(&state->mutex);
+    }
+
+    pthread_barrier_wait(&state->end);
+  }
+}
+
+static void *steque_setup(void)
+{
+  steque_state_t *state = calloc(1, sizeof(steque_state_t));
+
+  steque_init(&state->queue);
+  pthread_mutex_init(&state->mutex, NULL);
+  pthread_barrier_init(&state->start, NULL, STEQUE_THREADS + 1);
+  pthread_barrier_init(&state->end, NULL, STEQUE_THREADS + 1);
+
+  for (int i = 0; i < STEQUE_THREADS; i++)
+  {
+    pthread_create(&state->threads[i], NULL, steque_worker, state);
+  }
+
+  return state;
+}
+
+static void steque_run(void *arg, size_t ops)
+{
+  steque_state_t *state = arg;
+
+  state->ops = ops;
+  pthread_barrier_wait(&state->start);
+  pthread_barrier_wait(&state->end);
+}
+
+static void steque_teardown(void *arg)
+{
+  steque_state_t *state = arg;
+
+  state->stop = 1;
+  pthread_barrier_wait(&state->start);
+  for (int i = 0; i < STEQUE_THREADS; i++)
+  {
+    pthread_join(state->threads[i], NULL);
+  }
+
+  steque_destroy(&state->queue);
+  pthread_mutex_destroy(&state->mutex);
+  pthread_barrier_destroy(&state->start);
+  pthread_barrier_destroy(&state->end);
+  free(state);
+}
+
+/* Request parsing and response formatting ================================ */
+
+static void parse_request_run(void *arg, size_t ops)
+{
+  const char *header = "GETFILE GET /courses/ud923/filecorpus/road.jpg\r\n\r\n";
+  char path[2048];
+
+  for (size_t i = 0; i < ops; i++)
+  {
+    GFBENCH_USE(gfs_parse_request(header, path, sizeof(path)));
+  }
+}
+
+static void format_header_run(void *arg, size_t ops)
+{
+  char header[2048];
+
+  for (size_t i = 0; i < ops; i++)
+  {
+    GFBENCH_USE(gfs_format_header(header, sizeof(header), GF_OK, 123456 + i));
+  }
+}
+
+gfbench_t gfbench_server_cases[] = {
+    {"content_get", 100000, content_setup, content_run, content_teardown},
+    {"steque_mutex_4threads", 100000, steque_setup, steque_run, steque_teardown},
+    {"gfs_parse_request", 100000, NULL, parse_request_run, NULL},
+    {"gfs_format_header", 100000, NULL, format_header_run, NULL},
+    {NULL, 0, NULL, NULL, NULL}};
@@ -1,11 +1,67 @@
-/*
- *  This file is for use by students to define anything they wish.  It is used by the gf client implementation
- */
-#ifndef __GF_CLIENT_STUDENT_H__
-#define __GF_CLIENT_STUDENT_H__
-
-#include "workload.h"
-#include "gfclient.h"
-#include "gf-student.h"
- 
+/*
+ *  This file is for use by students to define anything they wish.  It is used by the gf client implementation
+ */
+#ifndef __GF_CLIENT_STUDENT_H__
+#define __GF_CLIENT_STUDENT_H__
+
+#include "workload.h"
+#include "gfclient.h"
+#include "gf-student.h"
+
+/*
+ * Parses the first len bytes of a NUL-terminated response.  Returns the
+ * length of the header once it is complete and valid, 0 if more bytes are
+ * needed, and -1 if the response is malformed.  file_len is set to 0 for
+ * responses other than GF_OK, except that for GF_BUSY it holds the
+ * server's retry-after hint in milliseconds (0 if it sent none).
+ */
+int gfc_parse_response(const char *buf, size_t len, gfstatus_t *status, size_t *file_len);
+
+/*
+ * Returns the retry-after hint, in milliseconds, of a GF_BUSY response.
+ */
+size_t gfc_get_retryafter(gfcrequest_t **gfr);
+
+/*
+ * Has the body written to fd, from offset 0, instead of passed to a write
+ * callback.  Unless a write callback is set as well, which takes
+ * precedence, the body is moved from the socket to fd with splice and never
+ * copied through userspace.  The caller still owns fd.
+ */
+void gfc_set_sinkfd(gfcrequest_t **gfr, int fd);
+
+/*
+ * An event loop that drives many transfers from the thread that runs it,
+ * with nonblocking sockets and epoll instead of a thread per request.
+ * A loop must only be used from one thread at a time, apart from
+ * gfc_loop_wakeup.
+ */
+typedef struct gfcloop_t gfcloop_t;
+
+gfcloop_t *gfc_loop_create();
+
+/*
+ * Starts the transfer described by gfr on loop and returns without
+ * waiting for it.  Once the transfer is over, gfc_loop_run calls donefunc
+ * with the request, the value gfc_perform would have returned and donearg;
+ * the request must not be cleaned up before then, and donefunc may clean
+ * it up or start another.  Returns -1, without calling donefunc, if the
+ * server cannot be resolved or no connection attempt can be started.
+ */
+int gfc_perform_async(gfcloop_t *loop, gfcrequest_t **gfr,
+                      void (*donefunc)(gfcrequest_t **gfr, int result, void *donearg), void *donearg);
+
+/*
+ * Waits up to timeout_ms (-1 for no limit) for progress on the loop's
+ * transfers, or for gfc_loop_wakeup, and makes what progress it can.
+ * Returns the number of transfers still in flight, or -1 on error.
+ */
+int gfc_loop_run(gfcloop_t *loop, int timeout_ms);
+
+/* Makes a concurrent or the next gfc_loop_run return.  Thread-safe. */
+void gfc_loop_wakeup(gfcloop_t *loop);
+
+/* Frees the loop.  No transfers may be in flight. */
+void gfc_loop_destroy(gfcloop_t *loop);
+ 
  #endif // __GF_CLIENT_STUDENT_H__
\ No newline at end of file
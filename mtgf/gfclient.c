@@ -0,0 +1,914 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "gfclient-student.h"
+#include "objpool.h"
+#include "log.h"
+
+// Modify this file to implement the interface specified in
+// gfclient.h.
+#define BUFSIZE 2048
+#define SCHEMESIZE 2048
+#define STATUSSIZE 2048
+#define EVENTS 64
+#define SINK_PIPE_SIZE (1024 * 1024)
+
+static const char *scheme = "GETFILE ";
+static const char *method = "GET ";
+static const char *endofreq = "\r\n\r\n";
+
+// Define gfcrequest_t
+struct gfcrequest_t
+{
+  unsigned short port;
+  const char *req_path;
+  const char *server;
+  void (*writefunc)(void *data, size_t len, void *arg);
+  void (*headerfunc)(void *header_buffer, size_t header_buffer_len, void *handlerarg);
+  void *writearg, *headerarg;
+  int sock_fd;
+  char buffer[BUFSIZE];
+  char header[BUFSIZE];
+  size_t file_len;
+  size_t bytes_received;
+  size_t retry_after;
+  gfstatus_t status;
+
+  // Body spliced into a file descriptor
+  int sink_fd;
+  int pipe_fd[2];
+  size_t pipe_size;
+
+  // Asynchronous transfers
+  gfcloop_t *loop;
+  int state;
+  struct addrinfo *addr;
+  size_t request_len, request_sent;
+  size_t response_len;
+  void (*donefunc)(gfcrequest_t **gfr, int result, void *donearg);
+  void *donearg;
+};
+
+enum
+{
+  GFC_CONNECTING,
+  GFC_SENDING,
+  GFC_HEADER,
+  GFC_BODY
+};
+
+// Resolved server addresses, kept for the lifetime of a loop
+typedef struct gfc_server_t
+{
+  char *name;
+  unsigned short port;
+  struct addrinfo *addrs;
+  struct gfc_server_t *next;
+} gfc_server_t;
+
+struct gfcloop_t
+{
+  int epfd;
+  int wakefd;
+  int inflight;
+  gfc_server_t *servers;
+};
+
+static int sendall(int s, char *buf, size_t len)
+{
+  size_t total = 0;       // how many bytes we've sent
+  size_t bytesleft = len; // how many we have left to send
+  ssize_t n = 0;
+
+  while (total < len)
+  {
+    n = send(s, buf + total, bytesleft, MSG_NOSIGNAL);
+    if (n == -1)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      break; // an error occurred
+    }
+
+    L(TRACE, "sent %zd bytes", n);
+    total += n;
+    bytesleft -= n;
+  }
+
+  return n == -1 ? -1 : 0; // return -1 on failure, 0 on success
+}
+
+// Get GET FILE header
+static int get_request_header(gfcrequest_t *gfr)
+{
+  return snprintf(gfr->header, BUFSIZE, "%s%s%s%s", scheme, method, gfr->req_path, endofreq);
+}
+
+int gfc_parse_response(const char *buf, size_t len, gfstatus_t *status, size_t *file_len)
+{
+  char scheme[SCHEMESIZE] = {0};
+  char status_code[STATUSSIZE] = {0};
+  unsigned long long length = 0;
+  const char *eoh;
+
+  if (len >= BUFSIZE)
+  {
+    return -1;
+  }
+
+  if ((eoh = strstr(buf, "\r\n\r\n")) == NULL)
+  {
+    return 0;
+  }
+
+  if (sscanf(buf, "%s %s %llu", scheme, status_code, &length) < 2)
+  {
+    L(DEBUG, "failed to parse response header");
+    return -1;
+  }
+
+  if (strcmp(scheme, "GETFILE") != 0)
+  {
+    L(DEBUG, "invalid response scheme %s", scheme);
+    return -1;
+  }
+
+  if (strcmp(status_code, "OK") == 0)
+  {
+    *status = GF_OK;
+  }
+  else if (strcmp(status_code, "ERROR") == 0)
+  {
+    *status = GF_ERROR;
+  }
+  else if (strcmp(status_code, "FILE_NOT_FOUND") == 0)
+  {
+    *status = GF_FILE_NOT_FOUND;
+  }
+  else if (strcmp(status_code, "BUSY") == 0)
+  {
+    *status = GF_BUSY;
+  }
+  else
+  {
+    L(DEBUG, "invalid response status code %s", status_code);
+    return -1;
+  }
+
+  *file_len = *status == GF_OK || *status == GF_BUSY ? length : 0;
+  return eoh + 4 - buf;
+}
+
+/* Body delivery =========================================================== */
+
+// Passes body bytes that were received into userspace to the write callback or the sink
+static int deliver(gfcrequest_t *gfr, char *data, size_t len)
+{
+  off_t off = gfr->bytes_received;
+  size_t done = 0;
+  ssize_t n;
+
+  if (gfr->writefunc != NULL)
+  {
+    gfr->writefunc(data, len, gfr->writearg);
+  }
+  else if (gfr->sink_fd >= 0)
+  {
+    while (done < len)
+    {
+      if ((n = pwrite(gfr->sink_fd, data + done, len - done, off + done)) < 0)
+      {
+        if (errno == EINTR)
+        {
+          continue;
+        }
+        L(WARN, "error writing body: %s", strerror(errno));
+        return -1;
+      }
+      done += n;
+    }
+  }
+
+  gfr->bytes_received += len;
+  return 0;
+}
+
+//
+//  Sets up the pipe the body is spliced through when it goes to a sink and
+//  not to a write callback.  Without a pipe the body is copied instead.
+//
+static void sink_begin(gfcrequest_t *gfr)
+{
+  int size;
+
+  if (gfr->sink_fd < 0 || gfr->writefunc != NULL || gfr->bytes_received >= gfr->file_len)
+  {
+    return;
+  }
+
+  if (pipe2(gfr->pipe_fd, O_CLOEXEC) < 0)
+  {
+    L(DEBUG, "pipe2: %s, copying the body instead", strerror(errno));
+    gfr->pipe_fd[0] = gfr->pipe_fd[1] = -1;
+    return;
+  }
+
+  // A larger pipe moves more per call; unprivileged processes may be capped below it
+  fcntl(gfr->pipe_fd[1], F_SETPIPE_SZ, SINK_PIPE_SIZE);
+  gfr->pipe_size = (size = fcntl(gfr->pipe_fd[1], F_GETPIPE_SZ)) > 0 ? size : 65536;
+}
+
+static void sink_end(gfcrequest_t *gfr)
+{
+  for (int i = 0; i < 2; i++)
+  {
+    if (gfr->pipe_fd[i] >= 0)
+    {
+      close(gfr->pipe_fd[i]);
+      gfr->pipe_fd[i] = -1;
+    }
+  }
+}
+
+// Moves the next stretch of the body from the socket to the sink without copying it
+static ssize_t sink_splice(gfcrequest_t *gfr)
+{
+  size_t want = gfr->file_len - gfr->bytes_received, done = 0;
+  loff_t off = gfr->bytes_received;
+  ssize_t n, m;
+
+  if (want > gfr->pipe_size)
+  {
+    want = gfr->pipe_size;
+  }
+
+  if ((n = splice(gfr->sock_fd, NULL, gfr->pipe_fd[1], NULL, want, SPLICE_F_MOVE)) <= 0)
+  {
+    return n;
+  }
+
+  while (done < (size_t)n)
+  {
+    if ((m = splice(gfr->pipe_fd[0], NULL, gfr->sink_fd, &off, n - done, SPLICE_F_MOVE)) <= 0)
+    {
+      if (m < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      L(WARN, "error writing body: %s", m < 0 ? strerror(errno) : "sink accepted no data");
+      if (m == 0)
+      {
+        errno = EIO;
+      }
+      return -1;
+    }
+    done += m;
+  }
+
+  gfr->bytes_received += n;
+  return n;
+}
+
+//
+//  Receives the next piece of the body and hands it on.  Returns the number
+//  of bytes received, 0 if the server closed the connection, and -1 with
+//  errno set on failure, or to EAGAIN if a nonblocking socket has nothing.
+//
+static ssize_t recv_body(gfcrequest_t *gfr)
+{
+  ssize_t n;
+
+  if (gfr->pipe_fd[0] >= 0)
+  {
+    return sink_splice(gfr);
+  }
+
+  if ((n = recv(gfr->sock_fd, gfr->buffer, BUFSIZE, 0)) > 0 && deliver(gfr, gfr->buffer, n) < 0)
+  {
+    return -1;
+  }
+  return n;
+}
+
+// Hands a complete header, and any body bytes that came with it, to the callbacks
+static int accept_header(gfcrequest_t *gfr, char *header_buffer, size_t header_res, int header_len, size_t file_len)
+{
+  L(TRACE, "status: %s, file_len: %zu, header_size: %d", gfc_strstatus(gfr->status), file_len, header_len);
+
+  if (gfr->headerfunc != NULL)
+  {
+    gfr->headerfunc(header_buffer, header_len, gfr->headerarg);
+  }
+
+  if (gfr->status == GF_BUSY)
+  {
+    gfr->retry_after = file_len;
+  }
+
+  if (gfr->status != GF_OK)
+  {
+    return 0;
+  }
+
+  gfr->file_len = file_len;
+
+  // Whatever followed the header in the same recv is the start of the body
+  if (header_res > header_len && deliver(gfr, header_buffer + header_len, header_res - header_len) < 0)
+  {
+    return -1;
+  }
+
+  sink_begin(gfr);
+  return 0;
+}
+
+// Parse response header
+static int parse_res_header(gfcrequest_t *gfr)
+{
+  char header_buffer[BUFSIZE] = {0};
+  ssize_t header_res = 0;
+  size_t file_len = 0;
+  int header_len = 0;
+
+  while (header_len == 0)
+  {
+    if (header_res >= BUFSIZE - 1)
+    {
+      L(WARN, "response header too long");
+      gfr->status = GF_INVALID;
+      return -1;
+    }
+
+    ssize_t new_header_res = recv(gfr->sock_fd, header_buffer + header_res, BUFSIZE - 1 - header_res, 0);
+    if (new_header_res == 0)
+    {
+      gfr->status = GF_INVALID;
+      return -1;
+    }
+    else if (new_header_res == -1)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      gfr->status = GF_ERROR;
+      return -1;
+    }
+    header_res += new_header_res;
+
+    if ((header_len = gfc_parse_response(header_buffer, header_res, &gfr->status, &file_len)) < 0)
+    {
+      gfr->status = GF_INVALID;
+      return -1;
+    }
+  }
+
+  return accept_header(gfr, header_buffer, header_res, header_len, file_len);
+}
+
+// Requests come and go once per download, so they are pooled rather than malloced
+static objpool_t *requests;
+static pthread_once_t requests_once = PTHREAD_ONCE_INIT;
+
+static void create_requests()
+{
+  requests = objpool_create("gfcrequest_t", sizeof(gfcrequest_t));
+}
+
+// optional function for cleaup processing.
+void gfc_cleanup(gfcrequest_t **gfr)
+{
+  sink_end(*gfr);
+  objpool_put(requests, *gfr);
+  *gfr = NULL;
+}
+
+// Returns NULL if the request cannot be allocated
+gfcrequest_t *gfc_create()
+{
+  gfcrequest_t *gfr;
+
+  pthread_once(&requests_once, create_requests);
+  if (NULL == (gfr = objpool_get(requests)))
+  {
+    return NULL;
+  }
+  gfr->sock_fd = -1;
+  gfr->sink_fd = -1;
+  gfr->pipe_fd[0] = gfr->pipe_fd[1] = -1;
+  gfr->status = GF_INVALID;
+  return gfr;
+}
+
+size_t gfc_get_filelen(gfcrequest_t **gfr)
+{
+  return (*gfr)->file_len;
+}
+
+size_t gfc_get_bytesreceived(gfcrequest_t **gfr)
+{
+  return (*gfr)->bytes_received;
+}
+
+gfstatus_t gfc_get_status(gfcrequest_t **gfr)
+{
+  return (*gfr)->status;
+}
+
+size_t gfc_get_retryafter(gfcrequest_t **gfr)
+{
+  return (*gfr)->retry_after;
+}
+
+void gfc_global_init() {}
+
+void gfc_global_cleanup() {}
+
+int gfc_perform(gfcrequest_t **gfr)
+{
+  struct addrinfo config, *serverinfo, *p;
+  int res, len;
+  ssize_t messagebytes;
+  char port[8];
+  (*gfr)->bytes_received = 0;
+  snprintf(port, sizeof(port), "%d", (*gfr)->port);
+
+  memset(&config, 0, sizeof config);
+  config.ai_family = AF_UNSPEC;
+  config.ai_socktype = SOCK_STREAM;
+
+  // getaddrinfo() returns a list of address structures.
+  if ((res = getaddrinfo((*gfr)->server, port, &config, &serverinfo)) != 0)
+  {
+    L(ERROR, "getaddrinfo: %s", gai_strerror(res));
+    (*gfr)->status = GF_ERROR;
+    return -1;
+  }
+
+  // loop through all the results and connect to the first we can
+  for (p = serverinfo; p != NULL; p = p->ai_next)
+  {
+    if (((*gfr)->sock_fd = socket(p->ai_family, p->ai_socktype,
+                                  p->ai_protocol)) == -1)
+    {
+      L(WARN, "socket: %s", strerror(errno));
+      continue;
+    }
+
+    if (connect((*gfr)->sock_fd, p->ai_addr, p->ai_addrlen) == -1)
+    {
+      close((*gfr)->sock_fd);
+      (*gfr)->sock_fd = -1;
+      continue;
+    }
+
+    break;
+  }
+
+  // free the linked list after we're done with it
+  freeaddrinfo(serverinfo);
+
+  // if we couldn't connect to any of the addresses, just bail
+  if (p == NULL)
+  {
+    L(WARN, "failed to connect to %s:%s", (*gfr)->server, port);
+    (*gfr)->status = GF_ERROR;
+    return -1;
+  }
+
+  len = get_request_header(*gfr);
+  if (len >= BUFSIZE || sendall((*gfr)->sock_fd, (*gfr)->header, len) == -1)
+  {
+    close((*gfr)->sock_fd);
+    (*gfr)->status = GF_ERROR;
+    return -1;
+  }
+
+  if (parse_res_header(*gfr) == -1)
+  {
+    sink_end(*gfr);
+    close((*gfr)->sock_fd);
+    return -1;
+  }
+  shutdown((*gfr)->sock_fd, SHUT_WR);
+
+  while ((*gfr)->status == GF_OK && (*gfr)->bytes_received < (*gfr)->file_len)
+  {
+    if ((messagebytes = recv_body(*gfr)) == -1)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      L(WARN, "error receiving data: %s", strerror(errno));
+      sink_end(*gfr);
+      close((*gfr)->sock_fd);
+      return -1;
+    }
+
+    if (messagebytes == 0)
+    {
+      L(WARN, "file incomplete: %zu of %zu bytes", (*gfr)->bytes_received, (*gfr)->file_len);
+      sink_end(*gfr);
+      close((*gfr)->sock_fd);
+      return -1;
+    }
+
+    L(TRACE, "bytes received: %zu of %zu", (*gfr)->bytes_received, (*gfr)->file_len);
+  }
+
+  sink_end(*gfr);
+  close((*gfr)->sock_fd);
+  return 0;
+}
+
+/* Asynchronous transfers ================================================== */
+
+gfcloop_t *gfc_loop_create()
+{
+  gfcloop_t *loop = calloc(1, sizeof(gfcloop_t));
+  struct epoll_event ev;
+
+  if ((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+      (loop->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+  {
+    L(ERROR, "unable to create event loop: %s", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev);
+  return loop;
+}
+
+void gfc_loop_destroy(gfcloop_t *loop)
+{
+  gfc_server_t *server, *next;
+
+  for (server = loop->servers; server != NULL; server = next)
+  {
+    next = server->next;
+    freeaddrinfo(server->addrs);
+    free(server->name);
+    free(server);
+  }
+
+  close(loop->wakefd);
+  close(loop->epfd);
+  free(loop);
+}
+
+void gfc_loop_wakeup(gfcloop_t *loop)
+{
+  uint64_t one = 1;
+
+  if (write(loop->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+  {
+    L(WARN, "event loop wakeup failed: %s", strerror(errno));
+  }
+}
+
+// getaddrinfo blocks, so each server is only looked up once per loop
+static struct addrinfo *async_resolve(gfcloop_t *loop, const char *name, unsigned short port)
+{
+  struct addrinfo config;
+  gfc_server_t *server;
+  char port_str[8];
+  int res;
+
+  for (server = loop->servers; server != NULL; server = server->next)
+  {
+    if (server->port == port && strcmp(server->name, name) == 0)
+    {
+      return server->addrs;
+    }
+  }
+
+  memset(&config, 0, sizeof config);
+  config.ai_family = AF_UNSPEC;
+  config.ai_socktype = SOCK_STREAM;
+  snprintf(port_str, sizeof(port_str), "%d", port);
+
+  server = calloc(1, sizeof(gfc_server_t));
+  if ((res = getaddrinfo(name, port_str, &config, &server->addrs)) != 0)
+  {
+    L(ERROR, "getaddrinfo: %s", gai_strerror(res));
+    free(server);
+    return NULL;
+  }
+
+  server->name = strdup(name);
+  server->port = port;
+  server->next = loop->servers;
+  loop->servers = server;
+  return server->addrs;
+}
+
+static int async_watch(gfcrequest_t *gfr, int op, uint32_t events)
+{
+  struct epoll_event ev;
+
+  ev.events = events;
+  ev.data.ptr = gfr;
+  return epoll_ctl(gfr->loop->epfd, op, gfr->sock_fd, &ev);
+}
+
+// Starts connecting to the current address or, failing that, the next ones
+static int async_connect(gfcrequest_t *gfr)
+{
+  struct addrinfo *p;
+
+  for (p = gfr->addr; p != NULL; p = p->ai_next)
+  {
+    gfr->addr = p;
+    if ((gfr->sock_fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                               p->ai_protocol)) == -1)
+    {
+      L(WARN, "socket: %s", strerror(errno));
+      continue;
+    }
+
+    if ((connect(gfr->sock_fd, p->ai_addr, p->ai_addrlen) == 0 || errno == EINPROGRESS) &&
+        async_watch(gfr, EPOLL_CTL_ADD, EPOLLOUT) == 0)
+    {
+      gfr->state = GFC_CONNECTING;
+      return 0;
+    }
+
+    close(gfr->sock_fd);
+    gfr->sock_fd = -1;
+  }
+
+  L(WARN, "failed to connect to %s:%d", gfr->server, gfr->port);
+  return -1;
+}
+
+static void async_finish(gfcrequest_t *gfr, int result)
+{
+  sink_end(gfr);
+  if (gfr->sock_fd >= 0)
+  {
+    close(gfr->sock_fd);
+    gfr->sock_fd = -1;
+  }
+
+  gfr->loop->inflight--;
+  gfr->loop = NULL;
+  gfr->donefunc(&gfr, result, gfr->donearg);
+}
+
+static void async_fail(gfcrequest_t *gfr, gfstatus_t status)
+{
+  gfr->status = status;
+  async_finish(gfr, -1);
+}
+
+// Moves a transfer along as far as its socket allows without blocking
+static void async_event(gfcrequest_t *gfr)
+{
+  size_t file_len = 0;
+  socklen_t len = sizeof(int);
+  int err = 0, header_len;
+  ssize_t n;
+
+  switch (gfr->state)
+  {
+  case GFC_CONNECTING:
+    if (getsockopt(gfr->sock_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+    {
+      close(gfr->sock_fd);
+      gfr->sock_fd = -1;
+      gfr->addr = gfr->addr->ai_next;
+      if (async_connect(gfr) < 0)
+      {
+        async_fail(gfr, GF_ERROR);
+      }
+      return;
+    }
+    gfr->state = GFC_SENDING;
+    /* FALLTHROUGH */
+
+  case GFC_SENDING:
+    if ((n = send(gfr->sock_fd, gfr->header + gfr->request_sent, gfr->request_len - gfr->request_sent,
+                  MSG_NOSIGNAL)) == -1)
+    {
+      if (errno != EAGAIN && errno != EINTR)
+      {
+        async_fail(gfr, GF_ERROR);
+      }
+      return;
+    }
+
+    if ((gfr->request_sent += n) == gfr->request_len)
+    {
+      gfr->state = GFC_HEADER;
+      async_watch(gfr, EPOLL_CTL_MOD, EPOLLIN);
+    }
+    return;
+
+  case GFC_HEADER:
+    if ((n = recv(gfr->sock_fd, gfr->buffer + gfr->response_len, BUFSIZE - 1 - gfr->response_len, 0)) <= 0)
+    {
+      if (n == 0)
+      {
+        async_fail(gfr, GF_INVALID);
+      }
+      else if (errno != EAGAIN && errno != EINTR)
+      {
+        async_fail(gfr, GF_ERROR);
+      }
+      return;
+    }
+
+    gfr->response_len += n;
+    gfr->buffer[gfr->response_len] = '\0';
+    if ((header_len = gfc_parse_response(gfr->buffer, gfr->response_len, &gfr->status, &file_len)) < 0 ||
+        (header_len == 0 && gfr->response_len >= BUFSIZE - 1))
+    {
+      async_fail(gfr, GF_INVALID);
+      return;
+    }
+    if (header_len == 0)
+    {
+      return;
+    }
+
+    if (accept_header(gfr, gfr->buffer, gfr->response_len, header_len, file_len) < 0)
+    {
+      async_finish(gfr, -1);
+      return;
+    }
+    shutdown(gfr->sock_fd, SHUT_WR);
+    if (gfr->status != GF_OK || gfr->bytes_received >= gfr->file_len)
+    {
+      async_finish(gfr, 0);
+      return;
+    }
+    gfr->state = GFC_BODY;
+    return;
+
+  case GFC_BODY:
+    if ((n = recv_body(gfr)) <= 0)
+    {
+      if (n == 0)
+      {
+        L(WARN, "file incomplete: %zu of %zu bytes", gfr->bytes_received, gfr->file_len);
+        async_finish(gfr, -1);
+      }
+      else if (errno != EAGAIN && errno != EINTR)
+      {
+        L(WARN, "error receiving data: %s", strerror(errno));
+        async_finish(gfr, -1);
+      }
+      return;
+    }
+
+    if (gfr->bytes_received >= gfr->file_len)
+    {
+      async_finish(gfr, 0);
+    }
+    return;
+  }
+}
+
+int gfc_perform_async(gfcloop_t *loop, gfcrequest_t **gfr,
+                      void (*donefunc)(gfcrequest_t **gfr, int result, void *donearg), void *donearg)
+{
+  gfcrequest_t *req = *gfr;
+
+  req->bytes_received = 0;
+  req->response_len = 0;
+  req->request_sent = 0;
+  req->donefunc = donefunc;
+  req->donearg = donearg;
+  req->loop = loop;
+
+  req->request_len = get_request_header(req);
+  if (req->request_len >= BUFSIZE || (req->addr = async_resolve(loop, req->server, req->port)) == NULL ||
+      async_connect(req) < 0)
+  {
+    req->loop = NULL;
+    req->status = GF_ERROR;
+    return -1;
+  }
+
+  loop->inflight++;
+  return 0;
+}
+
+int gfc_loop_run(gfcloop_t *loop, int timeout_ms)
+{
+  struct epoll_event events[EVENTS];
+  uint64_t count;
+  int n;
+
+  if ((n = epoll_wait(loop->epfd, events, EVENTS, timeout_ms)) < 0 && errno != EINTR)
+  {
+    L(ERROR, "epoll_wait: %s", strerror(errno));
+    return -1;
+  }
+
+  for (int i = 0; i < n; i++)
+  {
+    if (events[i].data.ptr == NULL)
+    {
+      if (read(loop->wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+      {
+        L(WARN, "event loop wakeup failed: %s", strerror(errno));
+      }
+      continue;
+    }
+
+    async_event(events[i].data.ptr);
+  }
+
+  return loop->inflight;
+}
+
+void gfc_set_port(gfcrequest_t **gfr, unsigned short port)
+{
+  (*gfr)->port = port;
+}
+void gfc_set_headerarg(gfcrequest_t **gfr, void *headerarg)
+{
+  (*gfr)->headerarg = headerarg;
+}
+
+void gfc_set_server(gfcrequest_t **gfr, const char *server)
+{
+  (*gfr)->server = server;
+}
+
+void gfc_set_headerfunc(gfcrequest_t **gfr, void (*headerfunc)(void *, size_t, void *))
+{
+  (*gfr)->headerfunc = headerfunc;
+}
+
+void gfc_set_path(gfcrequest_t **gfr, const char *path)
+{
+  (*gfr)->req_path = path;
+}
+
+void gfc_set_writearg(gfcrequest_t **gfr, void *writearg)
+{
+  (*gfr)->writearg = writearg;
+}
+
+void gfc_set_writefunc(gfcrequest_t **gfr, void (*writefunc)(void *, size_t, void *))
+{
+  (*gfr)->writefunc = writefunc;
+}
+
+void gfc_set_sinkfd(gfcrequest_t **gfr, int fd)
+{
+  (*gfr)->sink_fd = fd;
+}
+
+const char *gfc_strstatus(gfstatus_t status)
+{
+  const char *strstatus = "UNKNOWN";
+
+  switch (status)
+  {
+
+  case GF_OK:
+  {
+    strstatus = "OK";
+  }
+  break;
+
+  case GF_FILE_NOT_FOUND:
+  {
+    strstatus = "FILE_NOT_FOUND";
+  }
+  break;
+
+  case GF_INVALID:
+  {
+    strstatus = "INVALID";
+  }
+  break;
+
+  case GF_ERROR:
+  {
+    strstatus = "ERROR";
+  }
+  break;
+
+  case GF_BUSY:
+  {
+    strstatus = "BUSY";
+  }
+  break;
+  }
+
+  return strstatus;
+}
@@ -13,6 +13,7 @@ typedef enum{
   GF_FILE_NOT_FOUND = (GF_OK + 1),
   GF_ERROR = (GF_OK + 2),
   GF_INVALID = (GF_OK + 3),
+  GF_BUSY = (GF_OK + 4),
 } gfstatus_t;
 
 /*struct for a getfile request*/
@@ -1,11 +1,21 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/resource.h>
 
 #include "gfclient-student.h"
 #include "steque.h"
+#include "objpool.h"
 #include "pthread.h"
+#include "log.h"
 
 #define MAX_THREADS 1024
 #define PATH_BUFFER_SIZE 512
+#define WRITE_ALIGN 4096
+#define OPEN_LOOP_CONNS 64
 
 #define USAGE                                                             \
   "usage:\n"                                                              \
@@ -16,7 +26,23 @@
   "  -p [server_port]    Server port (Default: 39474)\n"                  \
   "  -w [workload_path]  Path to workload file (Default: workload.txt)\n" \
   "  -t [nthreads]       Number of threads (Default 8 Max: 1024)\n"       \
-  "  -n [num_requests]   Request download total (Default: 16)\n"
+  "  -n [num_requests]   Request download total (Default: 16)\n"        \
+  "  -l [level]          Log level: error, warn, info, debug, trace (Default: info)\n" \
+  "  -R [rate]           Open-loop mode: issue requests at this rate (req/s)\n" \
+  "  -a [arrival]        Open-loop arrivals: poisson or constant (Default: poisson)\n" \
+  "  -S [lo:hi:step]     Open-loop sweep of rates from lo to hi (req/s)\n" \
+  "  -m [mode]           Workload order: seq, rnd, zipf, hotspot, trace (Default: seq)\n" \
+  "  -z [skew]           Zipf exponent for -m zipf (Default: 0.99)\n"    \
+  "  -H [frac:prob]      Hotspot: frac of the paths get prob of requests (Default: 0.2:0.8)\n" \
+  "  -A [nconns]         Asynchronous mode: each thread runs an event loop with up to nconns\n" \
+  "                      transfers in flight instead of one blocking transfer\n" \
+  "                      (Default with -R, -S or -m trace: 64)\n" \
+  "  -W [bytes]          Write downloads in chunks of up to this size (Default: 1048576)\n" \
+  "  -O                  Write downloads with O_DIRECT, bypassing the page cache\n" \
+  "  -Y                  Write back each chunk with sync_file_range as it is written and\n" \
+  "                      drop it from the page cache\n"                    \
+  "  -Z                  Splice each body from the socket into its file without copying it\n" \
+  "                      (not with -O or -Y)\n"
 
 /* OPTIONS DESCRIPTOR ====================================================== */
 static struct option gLongOptions[] = {
@@ -26,6 +52,18 @@ static struct option gLongOptions[] = {
     {"workload", required_argument, NULL, 'w'},
     {"nthreads", required_argument, NULL, 't'},
     {"nrequests", required_argument, NULL, 'n'},
+    {"log-level", required_argument, NULL, 'l'},
+    {"rate", required_argument, NULL, 'R'},
+    {"arrival", required_argument, NULL, 'a'},
+    {"sweep", required_argument, NULL, 'S'},
+    {"mode", required_argument, NULL, 'm'},
+    {"skew", required_argument, NULL, 'z'},
+    {"hotspot", required_argument, NULL, 'H'},
+    {"async", required_argument, NULL, 'A'},
+    {"write-size", required_argument, NULL, 'W'},
+    {"direct", no_argument, NULL, 'O'},
+    {"sync", no_argument, NULL, 'Y'},
+    {"splice", no_argument, NULL, 'Z'},
     {NULL, 0, NULL, 0}};
 
 static void Usage() { fprintf(stderr, "%s", USAGE); }
@@ -34,13 +72,19 @@ static void localPath(char *req_path, char *local_path)
 {
   static int counter = 0;
 
-  sprintf(local_path, "%s-%06d", &req_path[1], counter++);
+  snprintf(local_path, PATH_BUFFER_SIZE, "%s-%06d", &req_path[1], __sync_fetch_and_add(&counter, 1));
 }
 
-static FILE *openFile(char *path)
+static size_t write_size = 1 << 20;
+static int direct_io = 0;
+static int sync_writes = 0;
+static int splice_body = 0;
+
+static int openFile(char *path, int *direct)
 {
+  static int direct_warned = 0;
   char *cur, *prev;
-  FILE *ans;
+  int fd = -1;
 
   /* Make the directory if it isn't there */
   prev = path;
@@ -61,23 +105,59 @@ static FILE *openFile(char *path)
     prev = cur;
   }
 
-  if (NULL == (ans = fopen(&path[0], "w")))
+  // Not every file system supports O_DIRECT; fall back to buffered writes
+  *direct = direct_io;
+  if (*direct && 0 > (fd = open(&path[0], O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644)) && errno == EINVAL)
+  {
+    if (!__sync_fetch_and_or(&direct_warned, 1))
+    {
+      L(WARN, "O_DIRECT not supported for %s, writing through the page cache", path);
+    }
+    *direct = 0;
+  }
+  if (!*direct)
+  {
+    fd = open(&path[0], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  }
+
+  if (0 > fd)
   {
     perror("Unable to open file");
     exit(EXIT_FAILURE);
   }
 
-  return ans;
+  return fd;
 }
 
-/* Callbacks ========================================================= */
-static void writecb(void *data, size_t data_len, void *arg)
+#define ARRIVAL_POISSON 0
+#define ARRIVAL_CONSTANT 1
+
+//
+//  A request handed from the boss to a worker.  In open-loop mode
+//  intended_ns is the time the request was scheduled to go out, and
+//  latency is measured from there rather than from when a worker got
+//  around to it, so time spent queued behind a saturated server counts.
+//
+typedef struct gfc_req_t
 {
-  FILE *file = (FILE *)arg;
-  fwrite(data, 1, data_len, file);
-}
+  char *path;
+  uint64_t intended_ns;
+  size_t idx;
+} gfc_req_t;
+
+typedef struct gfc_phase_t
+{
+  double offered;
+  double achieved;
+  size_t ok;
+  size_t busy;
+  size_t errors;
+  size_t backlog; // most requests ever waiting for a client thread
+  double p50, p90, p99, p999, max;
+} gfc_phase_t;
 
 static pthread_t *workers;
+static int *thread_ids;
 static short port;
 static char *server;
 static int exit_flag = 0;
@@ -85,19 +165,312 @@ pthread_cond_t gfc_cond = PTHREAD_COND_INITIALIZER;
 pthread_mutex_t gfc_mutex = PTHREAD_MUTEX_INITIALIZER;
 steque_t *queue;
 
-void *gfc_send_req(void *i)
+static int replay = 0;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static size_t completed;
+static uint64_t *latencies;
+static gfstatus_t *outcomes;
+
+static uint64_t now_ns()
 {
-  char *req_path = NULL;
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t deadline_ns)
+{
+  struct timespec ts;
+
+  ts.tv_sec = deadline_ns / 1000000000ULL;
+  ts.tv_nsec = deadline_ns % 1000000000ULL;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+}
+
+//
+//  One transfer in flight: the request it serves and the file it is
+//  written to.  The body is gathered in an aligned buffer and written out
+//  with pwrite a chunk at a time, into a file preallocated to the length
+//  given in the header.
+//
+typedef struct gfc_xfer_t
+{
+  gfc_req_t *req;
+  int fd;
+  int direct;
+  int failed;
+  uint64_t start;
+  size_t file_len;
+  char *buf;
+  size_t buf_size, buf_len;
+  off_t written, synced;
   char local_path[PATH_BUFFER_SIZE];
+} gfc_xfer_t;
+
+static size_t round_up(size_t n)
+{
+  return (n + WRITE_ALIGN - 1) & ~(size_t)(WRITE_ALIGN - 1);
+}
+
+static void alloc_buffer(gfc_xfer_t *xfer, size_t size)
+{
+  xfer->buf_size = round_up(size > 0 ? size : 1);
+  if (posix_memalign((void **)&xfer->buf, WRITE_ALIGN, xfer->buf_size) != 0)
+  {
+    L(ERROR, "unable to allocate a %zu byte write buffer", xfer->buf_size);
+    exit(EXIT_FAILURE);
+  }
+}
+
+//
+//  Starts writeback of the chunk just written and waits for the one before
+//  it, which is then dropped from the page cache, so a download keeps at
+//  most two chunks dirty instead of leaving the kernel to flush gigabytes
+//  at once.
+//
+static void sync_chunk(gfc_xfer_t *xfer, off_t start)
+{
+  sync_file_range(xfer->fd, start, xfer->written - start, SYNC_FILE_RANGE_WRITE);
+  if (xfer->synced < start)
+  {
+    sync_file_range(xfer->fd, xfer->synced, start - xfer->synced,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(xfer->fd, xfer->synced, start - xfer->synced, POSIX_FADV_DONTNEED);
+    xfer->synced = start;
+  }
+}
+
+static void flush_buffer(gfc_xfer_t *xfer)
+{
+  size_t len = xfer->buf_len, done = 0;
+  off_t start = xfer->written;
+  ssize_t n;
+
+  // O_DIRECT writes whole blocks; the file is truncated to size afterwards
+  if (xfer->direct)
+  {
+    len = round_up(len);
+    memset(xfer->buf + xfer->buf_len, 0, len - xfer->buf_len);
+  }
+
+  while (!xfer->failed && done < len)
+  {
+    if ((n = pwrite(xfer->fd, xfer->buf + done, len - done, start + done)) < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      L(WARN, "write to %s failed: %s", xfer->local_path, strerror(errno));
+      xfer->failed = 1;
+    }
+    else
+    {
+      done += n;
+    }
+  }
+
+  xfer->written += xfer->buf_len;
+  xfer->buf_len = 0;
+
+  if (sync_writes && !xfer->direct && !xfer->failed)
+  {
+    sync_chunk(xfer, start);
+  }
+}
+
+static void close_file(gfc_xfer_t *xfer)
+{
+  if (xfer->buf_len > 0)
+  {
+    flush_buffer(xfer);
+  }
+
+  // Trim the padding of a final O_DIRECT block, or preallocation never filled
+  if ((xfer->direct || xfer->written != xfer->file_len) && ftruncate(xfer->fd, xfer->written) < 0)
+  {
+    L(WARN, "ftruncate %s: %s", xfer->local_path, strerror(errno));
+  }
+
+  if (sync_writes && !xfer->direct && xfer->synced < xfer->written)
+  {
+    sync_file_range(xfer->fd, xfer->synced, 0,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(xfer->fd, xfer->synced, 0, POSIX_FADV_DONTNEED);
+  }
+
+  close(xfer->fd);
+  free(xfer->buf);
+  xfer->buf = NULL;
+}
+
+/* Callbacks ========================================================= */
+static void headercb(void *header, size_t header_len, void *arg)
+{
+  gfc_xfer_t *xfer = (gfc_xfer_t *)arg;
+  gfstatus_t status;
+  size_t file_len = 0;
+
+  if (gfc_parse_response(header, header_len, &status, &file_len) <= 0 || status != GF_OK)
+  {
+    return;
+  }
+
+  xfer->file_len = file_len;
+  if (file_len > 0 && fallocate(xfer->fd, 0, 0, file_len) < 0)
+  {
+    L(DEBUG, "fallocate %s: %s", xfer->local_path, strerror(errno));
+  }
+
+  // Spliced bodies go straight from the socket to the file
+  if (splice_body)
+  {
+    return;
+  }
+
+  // Small files get a buffer of their own size rather than a full chunk
+  alloc_buffer(xfer, file_len < write_size ? file_len : write_size);
+}
+
+static void writecb(void *data, size_t data_len, void *arg)
+{
+  gfc_xfer_t *xfer = (gfc_xfer_t *)arg;
+  size_t n;
+
+  if (xfer->buf == NULL)
+  {
+    alloc_buffer(xfer, write_size);
+  }
+
+  while (data_len > 0)
+  {
+    n = xfer->buf_size - xfer->buf_len < data_len ? xfer->buf_size - xfer->buf_len : data_len;
+    memcpy(xfer->buf + xfer->buf_len, data, n);
+    xfer->buf_len += n;
+    data = (char *)data + n;
+    data_len -= n;
+
+    if (xfer->buf_len == xfer->buf_size)
+    {
+      flush_buffer(xfer);
+    }
+  }
+}
+
+static gfcrequest_t *begin_transfer(gfc_req_t *req, gfc_xfer_t *xfer)
+{
+  gfcrequest_t *gfr = NULL;
+
+  xfer->req = req;
+  xfer->start = req->intended_ns ? req->intended_ns : now_ns();
+
+  localPath(req->path, xfer->local_path);
+
+  xfer->fd = openFile(xfer->local_path, &xfer->direct);
+  xfer->failed = 0;
+  xfer->file_len = 0;
+  xfer->buf = NULL;
+  xfer->buf_size = xfer->buf_len = 0;
+  xfer->written = xfer->synced = 0;
+
+  if (NULL == (gfr = gfc_create()))
+  {
+    L(WARN, "unable to allocate a request for %s", req->path);
+    return NULL;
+  }
+  gfc_set_path(&gfr, req->path);
+
+  gfc_set_port(&gfr, port);
+  gfc_set_server(&gfr, server);
+  gfc_set_headerarg(&gfr, xfer);
+  gfc_set_headerfunc(&gfr, headercb);
+  if (splice_body)
+  {
+    gfc_set_sinkfd(&gfr, xfer->fd);
+  }
+  else
+  {
+    gfc_set_writearg(&gfr, xfer);
+    gfc_set_writefunc(&gfr, writecb);
+  }
+  return gfr;
+}
+
+static void record_outcome(gfc_req_t *req, uint64_t start, gfstatus_t outcome)
+{
+  latencies[req->idx] = now_ns() - start;
+  outcomes[req->idx] = outcome;
+
+  pthread_mutex_lock(&gfc_mutex);
+  completed++;
+  pthread_mutex_unlock(&gfc_mutex);
+  pthread_cond_signal(&done_cond);
+}
+
+// A NULL gfr is a transfer that could not be started and counts as an error
+static void end_transfer(gfc_xfer_t *xfer, gfcrequest_t **gfr, int returncode)
+{
+  gfc_req_t *req = xfer->req;
+  gfstatus_t outcome = GF_ERROR;
+
+  if (splice_body && *gfr != NULL)
+  {
+    xfer->written = gfc_get_bytesreceived(gfr);
+  }
+  close_file(xfer);
+  if ((xfer->failed || *gfr == NULL) && returncode >= 0)
+  {
+    returncode = -1;
+  }
+
+  if (0 > returncode)
+  {
+    L(INFO, "gfc_perform returned an error %d", returncode);
+    if (0 > unlink(xfer->local_path))
+      fprintf(stderr, "warning: unlink failed on %s\n", xfer->local_path);
+  }
+  else if (gfc_get_status(gfr) != GF_OK)
+  {
+    if (0 > unlink(xfer->local_path))
+    {
+      fprintf(stderr, "warning: unlink failed on %s\n", xfer->local_path);
+    }
+  }
+
+  if (*gfr == NULL)
+  {
+    record_outcome(req, xfer->start, outcome);
+    return;
+  }
+
+  L(INFO, "Status: %s", gfc_strstatus(gfc_get_status(gfr)));
+  if (gfc_get_status(gfr) == GF_BUSY)
+  {
+    L(DEBUG, "server busy, retry after %zu ms", gfc_get_retryafter(gfr));
+  }
+  L(INFO, "Received %zu of %zu bytes", gfc_get_bytesreceived(gfr),
+    gfc_get_filelen(gfr));
+
+  if (returncode >= 0 && (gfc_get_status(gfr) == GF_OK || gfc_get_status(gfr) == GF_BUSY))
+  {
+    outcome = gfc_get_status(gfr);
+  }
+  gfc_cleanup(gfr);
+
+  record_outcome(req, xfer->start, outcome);
+}
+
+void *gfc_send_req(void *i)
+{
+  gfc_req_t *req = NULL;
+  gfc_xfer_t xfer;
   gfcrequest_t *gfr = NULL;
-  FILE *file = NULL;
-  int returncode = 0;
   int thread_id = *(int *)i;
-  /* Build your queue of requests here */
+
   while (1)
   {
-    /* Note that when you have a worker thread pool, you will need to move this
-     * logic into the worker threads */
     pthread_mutex_lock(&gfc_mutex);
     while (steque_isempty(queue))
     {
@@ -110,58 +483,95 @@ void *gfc_send_req(void *i)
       pthread_cond_wait(&gfc_cond, &gfc_mutex);
     }
 
-    req_path = steque_pop(queue);
+    req = steque_pop(queue);
     pthread_mutex_unlock(&gfc_mutex);
 
-    printf("thread %d requesting %s\n", thread_id, req_path);
+    L(DEBUG, "thread %d requesting %s", thread_id, req->path);
+
+    gfr = begin_transfer(req, &xfer);
+    end_transfer(&xfer, &gfr, gfr != NULL ? gfc_perform(&gfr) : -1);
+
+    L(DEBUG, "thread %d finished", thread_id);
+  }
+
+  return NULL;
+}
 
-    localPath(req_path, local_path);
+/* Asynchronous mode ================================================== */
 
-    file = openFile(local_path);
+static int async_conns = 0; // transfers in flight per thread, 0 for blocking mode
+static objpool_t *xfer_pool;
+static gfcloop_t **loops = NULL;
+static int nloops = 0;
 
-    gfr = gfc_create();
-    gfc_set_path(&gfr, req_path);
+static void async_done(gfcrequest_t **gfr, int returncode, void *arg)
+{
+  gfc_xfer_t *xfer = arg;
 
-    gfc_set_port(&gfr, port);
-    gfc_set_server(&gfr, server);
-    gfc_set_writearg(&gfr, file);
-    gfc_set_writefunc(&gfr, writecb);
+  end_transfer(xfer, gfr, returncode);
+  objpool_put(xfer_pool, xfer);
+}
 
-    // fprintf(stdout, "Requesting %s%s\n", server, req_path);
+//
+//  Keeps up to async_conns transfers going on this thread's loop, taking
+//  new ones from the queue whenever some finish.  The boss wakes the loop
+//  as well as signalling gfc_cond when it queues a request, since a busy
+//  thread waits in gfc_loop_run rather than on the condition variable.
+//
+void *gfc_async_loop(void *i)
+{
+  int thread_id = *(int *)i;
+  gfcloop_t *loop = loops[thread_id];
+  gfc_xfer_t *xfer;
+  gfcrequest_t *gfr;
+  gfc_req_t *req;
+  int inflight = 0;
 
-    if (0 > (returncode = gfc_perform(&gfr)))
-    {
-      fprintf(stdout, "gfc_perform returned an error %d\n", returncode);
-      fclose(file);
-      if (0 > unlink(local_path))
-        fprintf(stderr, "warning: unlink failed on %s\n", local_path);
-    }
-    else
+  pthread_mutex_lock(&gfc_mutex);
+  while (1)
+  {
+    while (inflight < async_conns && !steque_isempty(queue))
     {
-      fclose(file);
+      req = steque_pop(queue);
+      pthread_mutex_unlock(&gfc_mutex);
+
+      L(DEBUG, "thread %d requesting %s", thread_id, req->path);
+      if (NULL == (xfer = objpool_get(xfer_pool)))
+      {
+        L(WARN, "unable to allocate a transfer for %s", req->path);
+        record_outcome(req, req->intended_ns ? req->intended_ns : now_ns(), GF_ERROR);
+      }
+      else if (NULL == (gfr = begin_transfer(req, xfer)) || gfc_perform_async(loop, &gfr, async_done, xfer) < 0)
+      {
+        async_done(&gfr, -1, xfer);
+      }
+      else
+      {
+        inflight++;
+      }
+
+      pthread_mutex_lock(&gfc_mutex);
     }
 
-    if (gfc_get_status(&gfr) != GF_OK)
+    if (inflight == 0)
     {
-      if (0 > unlink(local_path))
+      if (exit_flag)
       {
-        fprintf(stderr, "warning: unlink failed on %s\n", local_path);
+        break;
       }
+      pthread_cond_wait(&gfc_cond, &gfc_mutex);
+      continue;
     }
 
-    printf("thread %d finished\n", thread_id);
-    fprintf(stdout, "Status: %s\n", gfc_strstatus(gfc_get_status(&gfr)));
-    fprintf(stdout, "Received %zu of %zu bytes\n", gfc_get_bytesreceived(&gfr),
-
-            gfc_get_filelen(&gfr));
-
-    gfc_cleanup(&gfr);
-
-    /*
-     * note that when you move the above logic into your worker thread, you will
-     * need to coordinate with the boss thread here to effect a clean shutdown.
-     */
+    pthread_mutex_unlock(&gfc_mutex);
+    if ((inflight = gfc_loop_run(loop, -1)) < 0)
+    {
+      exit(EXIT_FAILURE);
+    }
+    pthread_mutex_lock(&gfc_mutex);
   }
+  pthread_mutex_unlock(&gfc_mutex);
+  pthread_cond_signal(&gfc_cond);
 
   return NULL;
 }
@@ -169,18 +579,29 @@ void *gfc_send_req(void *i)
 void init_threads(size_t nthreads)
 {
   workers = malloc(sizeof(pthread_t) * nthreads);
-  int thread_id[nthreads];
+  thread_ids = malloc(sizeof(int) * nthreads);
+
+  if (async_conns > 0)
+  {
+    loops = malloc(sizeof(gfcloop_t *) * nthreads);
+    nloops = nthreads;
+    xfer_pool = objpool_create("gfc_xfer_t", sizeof(gfc_xfer_t));
+  }
 
   for (int i = 0; i < nthreads; i++)
   {
-    thread_id[i] = i;
-    if (pthread_create(&workers[i], NULL, gfc_send_req, &thread_id[i]) != 0)
+    thread_ids[i] = i;
+    if (async_conns > 0)
     {
-      fprintf(stderr, "Can't create thread %d\n", i);
+      loops[i] = gfc_loop_create();
+    }
+    if (pthread_create(&workers[i], NULL, async_conns > 0 ? gfc_async_loop : gfc_send_req, &thread_ids[i]) != 0)
+    {
+      L(ERROR, "Can't create thread %d", i);
       exit(1);
     }
 
-    printf("Created thread %d\n", i);
+    L(DEBUG, "Created thread %d", i);
   }
 }
 
@@ -189,13 +610,162 @@ void cleanup_threads(size_t nthreads)
   for (int i = 0; i < nthreads; i++)
   {
     pthread_join(workers[i], NULL);
+    if (async_conns > 0)
+    {
+      gfc_loop_destroy(loops[i]);
+    }
   }
+  free(loops);
 
   free(workers);
+  free(thread_ids);
   steque_destroy(queue);
   free(queue);
 }
 
+static void wake_loops()
+{
+  for (int i = 0; i < nloops; i++)
+  {
+    gfc_loop_wakeup(loops[i]);
+  }
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(uint64_t *sorted, size_t n, double p)
+{
+  size_t rank;
+
+  if (n == 0)
+  {
+    return 0;
+  }
+
+  rank = (size_t)ceil(p / 100.0 * n);
+  rank = rank == 0 ? 0 : rank - 1;
+  return sorted[rank < n ? rank : n - 1] / 1e6;
+}
+
+//
+//  Issues nrequests requests and waits for all of them to finish.  With a
+//  rate of zero the requests are all queued at once and the worker pool
+//  runs closed-loop; otherwise they are released on an open-loop schedule.
+//  When replaying a trace the schedule comes from the trace timestamps.
+//
+static void run_phase(double rate, int arrival, int nrequests, gfc_phase_t *phase)
+{
+  gfc_req_t *reqs = calloc(nrequests, sizeof(gfc_req_t));
+  uint64_t start, next, elapsed;
+  double timestamp = 0;
+  size_t n = 0, backlog = 0;
+
+  completed = 0;
+
+  start = now_ns();
+  next = start;
+  for (int i = 0; i < nrequests; i++)
+  {
+    reqs[i].path = workload_get_entry(&timestamp);
+    reqs[i].idx = i;
+
+    if (strlen(reqs[i].path) > PATH_BUFFER_SIZE)
+    {
+      fprintf(stderr, "Request path exceeded maximum of %d characters\n.", PATH_BUFFER_SIZE);
+      exit(EXIT_FAILURE);
+    }
+
+    if (replay)
+    {
+      next = start + (uint64_t)(timestamp * 1e9);
+      sleep_until(next);
+      reqs[i].intended_ns = next;
+    }
+    else if (rate > 0)
+    {
+      if (arrival == ARRIVAL_POISSON)
+      {
+        next += (uint64_t)(-log(1.0 - drand48()) / rate * 1e9);
+      }
+      else if (i > 0)
+      {
+        next += (uint64_t)(1e9 / rate);
+      }
+      sleep_until(next);
+      reqs[i].intended_ns = next;
+    }
+
+    pthread_mutex_lock(&gfc_mutex);
+    steque_enqueue(queue, &reqs[i]);
+    if ((size_t)steque_size(queue) > backlog)
+    {
+      backlog = steque_size(queue);
+    }
+    pthread_mutex_unlock(&gfc_mutex);
+    pthread_cond_signal(&gfc_cond);
+    wake_loops();
+  }
+
+  pthread_mutex_lock(&gfc_mutex);
+  while (completed < nrequests)
+  {
+    pthread_cond_wait(&done_cond, &gfc_mutex);
+  }
+  pthread_mutex_unlock(&gfc_mutex);
+
+  elapsed = now_ns() - start;
+
+  memset(phase, 0, sizeof(*phase));
+  phase->offered = replay && timestamp > 0 ? nrequests / timestamp : rate;
+  phase->backlog = backlog;
+  for (int i = 0; i < nrequests; i++)
+  {
+    if (outcomes[i] == GF_BUSY)
+    {
+      phase->busy++;
+    }
+    else if (outcomes[i] == GF_OK)
+    {
+      latencies[n++] = latencies[i];
+    }
+  }
+  phase->ok = n;
+  phase->errors = nrequests - n - phase->busy;
+  phase->achieved = n / (elapsed / 1e9);
+
+  qsort(latencies, n, sizeof(uint64_t), cmp_u64);
+  phase->p50 = percentile_ms(latencies, n, 50);
+  phase->p90 = percentile_ms(latencies, n, 90);
+  phase->p99 = percentile_ms(latencies, n, 99);
+  phase->p999 = percentile_ms(latencies, n, 99.9);
+  phase->max = n > 0 ? latencies[n - 1] / 1e6 : 0;
+
+  free(reqs);
+}
+
+static void print_phase(gfc_phase_t *phase, int nthreads)
+{
+  // Time spent waiting for a client thread is counted as server latency
+  if (phase->backlog > (size_t)nthreads)
+  {
+    L(WARN, "at %.1f req/s up to %zu requests waited for a free client thread, raise -A or -t",
+      phase->offered, phase->backlog);
+  }
+  fprintf(stdout, "%10.1f %10.1f %8zu %8zu %8zu %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+          phase->offered, phase->achieved, phase->ok, phase->busy, phase->errors,
+          phase->p50, phase->p90, phase->p99, phase->p999, phase->max);
+}
+
+static void print_phase_header()
+{
+  fprintf(stdout, "%10s %10s %8s %8s %8s %10s %10s %10s %10s %10s\n",
+          "offered", "achieved", "ok", "busy", "errors", "p50(ms)", "p90(ms)", "p99(ms)", "p99.9(ms)", "max(ms)");
+}
+
 /* Main ========================================================= */
 int main(int argc, char **argv)
 {
@@ -206,12 +776,16 @@ int main(int argc, char **argv)
   port = 39474;
   int nthreads = 8;
   int nrequests = 14;
-  char *req_path;
-
-  setbuf(stdout, NULL); // disable caching
+  int level = INFO;
+  int arrival = ARRIVAL_POISSON;
+  double rate = 0;
+  double sweep_lo = 0, sweep_hi = 0, sweep_step = 0;
+  int mode = WORKLOAD_SEQ;
+  double skew = 0, hot_fraction = 0, hot_probability = 0;
+  gfc_phase_t phase;
 
   // Parse and set command line arguments
-  while ((option_char = getopt_long(argc, argv, "p:n:hs:t:r:w:", gLongOptions,
+  while ((option_char = getopt_long(argc, argv, "p:n:hs:t:r:w:l:R:a:S:m:z:H:A:W:OYZ", gLongOptions,
                                     NULL)) != -1)
   {
     switch (option_char)
@@ -233,6 +807,67 @@ int main(int argc, char **argv)
     case 'p': // port
       port = atoi(optarg);
       break;
+    case 'l': // log-level
+      level = log_parse_level(optarg);
+      break;
+    case 'R': // rate
+      rate = atof(optarg);
+      break;
+    case 'a': // arrival
+      if (strcmp(optarg, "poisson") == 0)
+      {
+        arrival = ARRIVAL_POISSON;
+      }
+      else if (strcmp(optarg, "constant") == 0)
+      {
+        arrival = ARRIVAL_CONSTANT;
+      }
+      else
+      {
+        Usage();
+        exit(1);
+      }
+      break;
+    case 'S': // sweep
+      if (sscanf(optarg, "%lf:%lf:%lf", &sweep_lo, &sweep_hi, &sweep_step) != 3 ||
+          sweep_lo <= 0 || sweep_hi < sweep_lo || sweep_step <= 0)
+      {
+        fprintf(stderr, "Invalid sweep %s, expected lo:hi:step\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'm': // mode
+      if ((mode = workload_parse_mode(optarg)) < 0)
+      {
+        Usage();
+        exit(1);
+      }
+      break;
+    case 'z': // skew
+      skew = atof(optarg);
+      break;
+    case 'H': // hotspot
+      if (sscanf(optarg, "%lf:%lf", &hot_fraction, &hot_probability) != 2)
+      {
+        fprintf(stderr, "Invalid hotspot %s, expected frac:prob\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'A': // async
+      async_conns = atoi(optarg);
+      break;
+    case 'W': // write-size
+      write_size = strtoul(optarg, NULL, 10);
+      break;
+    case 'O': // direct
+      direct_io = 1;
+      break;
+    case 'Y': // sync
+      sync_writes = 1;
+      break;
+    case 'Z': // splice
+      splice_body = 1;
+      break;
     default:
       Usage();
       exit(1);
@@ -248,6 +883,23 @@ int main(int argc, char **argv)
     fprintf(stderr, "Unable to load workload file %s.\n", workload_path);
     exit(EXIT_FAILURE);
   }
+  if ((skew > 0 && 0 > workload_set_skew(skew)) ||
+      (hot_fraction > 0 && 0 > workload_set_hotspot(hot_fraction, hot_probability)))
+  {
+    fprintf(stderr, "Invalid workload distribution parameters\n");
+    exit(EXIT_FAILURE);
+  }
+  if (0 > workload_set_mode(mode))
+  {
+    fprintf(stderr, "Workload mode not supported by %s (trace needs a timestamp on every line)\n", workload_path);
+    exit(EXIT_FAILURE);
+  }
+  replay = mode == WORKLOAD_TRACE;
+  if (replay && (rate > 0 || sweep_step > 0))
+  {
+    fprintf(stderr, "-R and -S cannot be combined with -m trace, which takes its schedule from the trace\n");
+    exit(EXIT_FAILURE);
+  }
   if (port > 65331)
   {
     fprintf(stderr, "Invalid port number\n");
@@ -258,44 +910,125 @@ int main(int argc, char **argv)
     fprintf(stderr, "Invalid amount of threads\n");
     exit(EXIT_FAILURE);
   }
+  if (write_size < WRITE_ALIGN)
+  {
+    fprintf(stderr, "Write size must be at least %d bytes\n", WRITE_ALIGN);
+    exit(EXIT_FAILURE);
+  }
+  if (splice_body && direct_io)
+  {
+    fprintf(stderr, "Spliced bodies cannot be written with O_DIRECT\n");
+    exit(EXIT_FAILURE);
+  }
+  if (splice_body && sync_writes)
+  {
+    fprintf(stderr, "Spliced bodies are not written back chunk by chunk, -Y cannot be combined with -Z\n");
+    exit(EXIT_FAILURE);
+  }
+  if (async_conns < 0)
+  {
+    fprintf(stderr, "Invalid number of connections\n");
+    exit(EXIT_FAILURE);
+  }
+  if (nrequests < 1 || rate < 0)
+  {
+    Usage();
+    exit(EXIT_FAILURE);
+  }
+
+  log_init(level);
   gfc_global_init();
 
+  // A fixed pool of blocking transfers would queue open-loop arrivals in the client
+  if ((rate > 0 || sweep_step > 0 || replay) && async_conns == 0)
+  {
+    async_conns = OPEN_LOOP_CONNS;
+    L(INFO, "open-loop mode, running %d transfers in flight per thread (-A)", async_conns);
+  }
+
+  // Every transfer in flight holds a socket and a file open, and a pipe when spliced
+  if (async_conns > 0)
+  {
+    struct rlimit limit;
+
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    if ((rlim_t)async_conns * nthreads * (splice_body ? 4 : 2) + 64 > limit.rlim_cur)
+    {
+      L(WARN, "%d transfers in flight may exceed the limit of %llu open files",
+        async_conns * nthreads, (unsigned long long)limit.rlim_cur);
+    }
+  }
+
   queue = malloc(sizeof(steque_t));
   steque_init(queue);
 
+  latencies = malloc(sizeof(uint64_t) * nrequests);
+  outcomes = malloc(nrequests * sizeof(gfstatus_t));
+  srand48(now_ns());
+
   // add your threadpool creation here
   init_threads(nthreads);
 
-  /* Build your queue of requests here */
-  for (int i = 0; i < nrequests; i++)
+  if (sweep_step > 0)
   {
-    /* Note that when you have a worker thread pool, you will need to move this
-     * logic into the worker threads */
-    req_path = workload_get_path();
+    double base_p99 = 0, knee = 0;
 
-    if (strlen(req_path) > PATH_BUFFER_SIZE)
+    print_phase_header();
+    for (double r = sweep_lo; r <= sweep_hi + sweep_step / 2; r += sweep_step)
     {
-      fprintf(stderr, "Request path exceeded maximum of %d characters\n.", PATH_BUFFER_SIZE);
-      exit(EXIT_FAILURE);
-    }
+      run_phase(r, arrival, nrequests, &phase);
+      print_phase(&phase, nthreads);
 
-    pthread_mutex_lock(&gfc_mutex);
-    steque_enqueue(queue, req_path);
-    pthread_mutex_unlock(&gfc_mutex);
-    pthread_cond_signal(&gfc_cond);
+      // The first rate that measured any latency at all
+      if (base_p99 <= 0)
+      {
+        base_p99 = phase.p99;
+      }
 
-    /*
-     * note that when you move the above logic into your worker thread, you will
-     * need to coordinate with the boss thread here to effect a clean shutdown.
-     */
+      // The knee is the first rate the server cannot keep up with, either
+      // because throughput falls behind the offered load or latency blows up
+      if (knee == 0 && (phase.achieved < 0.9 * phase.offered || phase.errors > 0 || phase.busy > 0 ||
+                        (base_p99 > 0 && phase.p99 > 10 * base_p99)))
+      {
+        knee = r;
+      }
+    }
+
+    if (knee > 0)
+    {
+      fprintf(stdout, "saturation knee at ~%.1f req/s\n", knee);
+    }
+    else
+    {
+      fprintf(stdout, "no saturation up to %.1f req/s\n", sweep_hi);
+    }
+  }
+  else
+  {
+    run_phase(rate, arrival, nrequests, &phase);
+    if (rate > 0 || replay)
+    {
+      print_phase_header();
+      print_phase(&phase, nthreads);
+    }
   }
 
+  pthread_mutex_lock(&gfc_mutex);
   exit_flag = 1;
-  pthread_cond_signal(&gfc_cond);
+  pthread_mutex_unlock(&gfc_mutex);
+  pthread_cond_broadcast(&gfc_cond);
+  wake_loops();
 
   cleanup_threads(nthreads);
   gfc_global_cleanup(); /* use for any global cleanup for AFTER your thread
                          pool has terminated. */
+  objpool_report();
+
+  free(latencies);
+  free(outcomes);
+  workload_destroy();
 
   return 0;
 }
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include "manifest.h"
+#include "log.h"
+
+#define USAGE                                                                 \
+  "usage:\n"                                                                  \
+  "  gfmanifest [options] content_file manifest_file\n"                       \
+  "options:\n"                                                                \
+  "  -h                  Show this help message\n"                            \
+  "  -f                  Look up every size again instead of reusing those\n" \
+  "                      of an existing manifest_file\n"                      \
+  "  -l [level]          Log level: error, warn, info, debug, trace (Default: info)\n"
+
+/* OPTIONS DESCRIPTOR ====================================================== */
+static struct option gLongOptions[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"full", no_argument, NULL, 'f'},
+    {"log-level", required_argument, NULL, 'l'},
+    {NULL, 0, NULL, 0}};
+
+//
+//  Compiles a content map into a manifest for gfserver_main -F.  An
+//  existing manifest is used as the previous build: entries whose key and
+//  path are unchanged keep their size, so only new or changed entries are
+//  looked up on disk.  A file rewritten in place under the same name keeps
+//  its old size unless -f is given; the server corrects it when the file
+//  is opened.
+//
+int main(int argc, char **argv)
+{
+  manifest_t *previous = NULL, *manifest;
+  size_t reused, statted;
+  int option_char, full = 0;
+  const char *input, *output;
+
+  log_set_level(INFO);
+  while ((option_char = getopt_long(argc, argv, "hfl:", gLongOptions, NULL)) != -1)
+  {
+    switch (option_char)
+    {
+    case 'f': // full
+      full = 1;
+      break;
+    case 'l': // log-level
+      log_set_level(log_parse_level(optarg));
+      break;
+    case 'h': // help
+      fprintf(stdout, "%s", USAGE);
+      exit(0);
+    default:
+      fprintf(stderr, "%s", USAGE);
+      exit(1);
+    }
+  }
+
+  if (argc - optind != 2)
+  {
+    fprintf(stderr, "%s", USAGE);
+    exit(1);
+  }
+  input = argv[optind];
+  output = argv[optind + 1];
+
+  if (!full && NULL == (previous = manifest_open(output)) && errno != ENOENT)
+  {
+    L(WARN, "%s: %s, rebuilding from scratch", output, errno == EINVAL ? "not a manifest" : strerror(errno));
+  }
+
+  if (NULL == (manifest = manifest_build(input, previous, 1)))
+  {
+    fprintf(stderr, "Unable to read %s: %s\n", input, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  if (manifest_write(manifest, output) < 0)
+  {
+    fprintf(stderr, "Unable to write %s: %s\n", output, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  manifest_build_stats(manifest, &reused, &statted);
+  L(INFO, "%s: %zu entries, %zu sizes reused, %zu looked up", output, manifest_count(manifest), reused, statted);
+
+  manifest_close(manifest);
+  if (previous != NULL)
+  {
+    manifest_close(previous);
+  }
+  return 0;
+}
@@ -1,15 +1,133 @@
-/*
- *  This file is for use by students to define anything they wish.  It is used by the gf server implementation
- */
-#ifndef __GF_SERVER_STUDENT_H__
-#define __GF_SERVER_STUDENT_H__
-
-#include "gf-student.h"
-#include "gfserver.h"
-#include "content.h"
-
-
-void init_threads(size_t numthreads);
-void cleanup_threads();
-
-#endif // __GF_SERVER_STUDENT_H__
+/*
+ *  This file is for use by students to define anything they wish.  It is used by the gf server implementation
+ */
+#ifndef __GF_SERVER_STUDENT_H__
+#define __GF_SERVER_STUDENT_H__
+
+#include "gf-student.h"
+#include "gfserver.h"
+#include "content.h"
+
+
+void init_threads(size_t numthreads);
+
+/*
+ * Formats a response header into buf and returns its length as snprintf
+ * would.  This is what gfs_sendheader puts on the wire.
+ */
+int gfs_format_header(char *buf, size_t size, gfstatus_t status, size_t file_len);
+
+/*
+ * Parses a complete, NUL-terminated request header and copies the
+ * requested path into path.  Returns 0 on success and -1 if the request
+ * is malformed.
+ */
+int gfs_parse_request(const char *header, char *path, size_t path_size);
+
+/*
+ * Copies the address of the client on the other end of ctx, as returned
+ * by accept, into addr.  Returns 0.
+ */
+int gfs_getpeer(gfcontext_t **ctx, struct sockaddr_storage *addr, socklen_t *addrlen);
+
+/*
+ * By default an OK header is held back and sent with the first body bytes
+ * in a single sendmsg, every send but the last of a body is flagged
+ * MSG_MORE so the kernel emits full segments, and gfs_chunksize follows
+ * the socket send buffer.  Passing 0 restores one send per call with
+ * 2 KB chunks, for comparison.
+ */
+void gfserver_set_coalesce(gfserver_t **gfs, int coalesce);
+
+/*
+ * Returns how many bytes a handler should pass to each gfs_send, based on
+ * the size of the connection's socket send buffer.
+ */
+size_t gfs_chunksize(gfcontext_t **ctx);
+
+/* Logs send calls and TCP data segments per completed response. */
+void gfs_log_sendstats();
+
+/*
+ * Like gfs_send, but makes a single nonblocking attempt.  Returns the
+ * number of bytes of data sent, which may be 0 if the socket buffer is
+ * full, or -1 on error.  Any bandwidth limit is charged after the send
+ * without sleeping; the caller must then wait out gfs_send_delay.
+ */
+ssize_t gfs_trysend(gfcontext_t **ctx, const void *data, size_t len);
+
+/*
+ * Returns how many ns must pass before the bandwidth limits let
+ * gfs_trysend send on the connection again, 0 if it may send now.
+ */
+uint64_t gfs_send_delay(gfcontext_t **ctx);
+
+/*
+ * Takes ownership of the connection from gfserver_serve and clears *ctx,
+ * so that it is not closed when the handler returns.  The taker, or the
+ * thread it hands the context to, must finish the response with gfs_send
+ * or gfs_trysend, or end it with gfs_abort, which returns the context to
+ * the pool.  Call it before publishing the context to another thread.
+ */
+gfcontext_t *gfs_take(gfcontext_t **ctx);
+
+/*
+ * Preallocates count connection contexts, each on its own cache lines, so
+ * that up to count open connections need no heap allocation.  More are
+ * allocated as needed.
+ */
+void gfserver_set_contexts(gfserver_t **gfs, size_t count);
+
+/*
+ * Closes a connection that has not sent its complete request header within
+ * timeout_ms of being accepted, however slowly it trickles in.  Requests
+ * are received without blocking, every connection at once, so a slow
+ * client never delays the others.  0, the default, waits forever.
+ */
+void gfserver_set_header_timeout(gfserver_t **gfs, unsigned long timeout_ms);
+
+/*
+ * Makes a blocking gfs_send or gfs_sendheader give up with an error, so
+ * the caller aborts the response, once the client has taken no data for
+ * timeout_ms.  0, the default, waits for as long as the connection lasts.
+ * gfs_trysend never blocks and is not affected.
+ */
+void gfserver_set_send_timeout(gfserver_t **gfs, unsigned long timeout_ms);
+
+/* Returns the connection's socket, for polling it for writability. */
+int gfs_getfd(gfcontext_t **ctx);
+
+/*
+ * Serves connections from fd, a socket that is already listening, instead
+ * of binding the configured port.
+ */
+void gfserver_set_listenfd(gfserver_t **gfs, int fd);
+
+/* Returns the listening socket, or -1 before gfserver_serve has bound it. */
+int gfserver_get_listenfd(gfserver_t **gfs);
+
+/*
+ * Makes gfserver_serve stop accepting connections, close its listening
+ * socket and return.  Thread-safe and async-signal-safe.
+ */
+void gfserver_stop(gfserver_t **gfs);
+
+/* Waits until every connection accepted so far has been closed. */
+void gfserver_drain(gfserver_t **gfs);
+
+/* A request handed from the boss thread to the workers. */
+typedef struct gfs_queue_ctx
+{
+  gfcontext_t *ctx;
+  const char *path;
+} gfs_queue_ctx;
+
+/*
+ * Opens path in the storage backend and sends the response header.
+ * Returns the length of the body still to be sent, with the storage
+ * handle to read it from and close afterwards in handle, or 0 or -1 if
+ * the response is already complete or an error response has been sent.
+ */
+ssize_t gfs_start_transfer(gfcontext_t **ctx, const char *path, int *handle);
+
+#endif // __GF_SERVER_STUDENT_H__
@@ -0,0 +1,924 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <linux/tcp.h>
+#include "gfserver-student.h"
+#include "log.h"
+#include "shape.h"
+#include "objpool.h"
+#include "wheel.h"
+
+#define BUFSIZE 2048
+#define MIN_CHUNK (16 * 1024)
+#define MAX_CHUNK (256 * 1024)
+#define MAX_REQUEST (BUFSIZE - 1) // longest request header accepted
+#define SERVE_EVENTS 64
+#define HEADER_TICK_MS 10
+#define SERVE_DRAIN_MS 1000
+// Modify this file to implement the interface specified in
+// gfserver.h.
+struct gfserver_t
+{
+    unsigned short port;
+    gfh_error_t (*gfs_handler)(gfcontext_t **ctx, const char *path, void *arg);
+    void *handlerarg;
+    int max_pending;
+    int sock_fd;
+    int coalesce;
+    int stop_fd; // written by gfserver_stop
+    struct timeval send_timeout; // zero lets a blocking send wait forever
+    unsigned long header_timeout; // ms to send the request in, 0 waits forever
+};
+
+//
+//  One context per accepted connection.  The boss thread takes it from the
+//  pool, the handler may take ownership of it with gfs_take, and the
+//  library returns it to the pool once the response is complete or
+//  aborted.  Contexts start on a cache line of their own, so that
+//  neighbours served by different threads do not share one.
+//
+struct __attribute__((aligned(64))) gfcontext_t
+{
+    int sock_fd;
+    gfstatus_t status;
+    size_t file_len;
+    size_t bytes_sent;
+    int coalesce;
+    size_t header_len; // an OK header waiting to go out with the first body bytes
+    size_t header_off; // how much of it gfs_trysend has sent
+    struct sockaddr_storage peer;
+    socklen_t peer_len;
+    shape_conn_t shape;
+    size_t request_len; // request bytes received into header so far
+    wheel_timer_t timer; // while the request is being received
+    struct gfcontext_t *prev_pending, *next_pending;
+    char header[BUFSIZE];
+    char path[BUFSIZE];
+};
+
+// Send path counters, for comparing syscalls and segments per response
+static unsigned long send_calls;
+static unsigned long responses;
+static unsigned long segments;
+static unsigned long send_timeouts;
+
+// Connections accepted and not yet closed, for gfserver_drain
+static int open_conns;
+static int peak_conns;
+static size_t reserved_conns;
+static pthread_mutex_t conns_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t conns_cond = PTHREAD_COND_INITIALIZER;
+
+// Connections still sending their request, and how those ended badly,
+// all owned by the boss thread
+static int pending_requests;
+static gfcontext_t *pending_head;
+static unsigned long request_timeouts;
+static unsigned long requests_oversized;
+
+// Contexts are taken by the boss thread and released by whichever finishes the response
+static objpool_t *contexts;
+
+static int sendallv(int s, struct iovec *iov, int iovcnt, int flags)
+{
+    struct msghdr msg;
+    size_t total = 0, len = 0; // how many bytes we've sent, out of len
+    ssize_t n = 0;
+
+    for (int i = 0; i < iovcnt; i++)
+    {
+        len += iov[i].iov_len;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    while (total < len)
+    {
+        __atomic_add_fetch(&send_calls, 1, __ATOMIC_RELAXED);
+        n = sendmsg(s, &msg, flags | MSG_NOSIGNAL);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                // SO_SNDTIMEO expired with the client taking nothing
+                __atomic_add_fetch(&send_timeouts, 1, __ATOMIC_RELAXED);
+                L(DEBUG, "send timed out after %zu of %zu bytes", total, len);
+            }
+            break; // an error occurred
+        }
+        L(TRACE, "sent %zd of %zu bytes", n, len);
+        total += n;
+
+        // Skip past what was sent
+        while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len)
+        {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0)
+        {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+
+    return n == -1 ? -1 : total; // return -1 on failure, bytes sent on success
+}
+
+static int sendall(int s, const void *buf, size_t len, int flags)
+{
+    struct iovec iov = {(void *)buf, len};
+
+    return sendallv(s, &iov, 1, flags);
+}
+
+static void gfs_close(gfcontext_t **ctx)
+{
+    struct tcp_info info;
+    socklen_t info_len = sizeof(info);
+
+    if ((*ctx)->sock_fd >= 0)
+    {
+        if ((*ctx)->file_len > 0 && (*ctx)->bytes_sent >= (*ctx)->file_len)
+        {
+            __atomic_add_fetch(&responses, 1, __ATOMIC_RELAXED);
+            if (getsockopt((*ctx)->sock_fd, IPPROTO_TCP, TCP_INFO, &info, &info_len) == 0)
+            {
+                __atomic_add_fetch(&segments, info.tcpi_data_segs_out, __ATOMIC_RELAXED);
+            }
+        }
+        close((*ctx)->sock_fd);
+    }
+    shape_conn_close(&(*ctx)->shape);
+
+    objpool_put(contexts, *ctx);
+    *ctx = NULL;
+
+    pthread_mutex_lock(&conns_mutex);
+    if (--open_conns == 0)
+    {
+        pthread_cond_broadcast(&conns_cond);
+    }
+    pthread_mutex_unlock(&conns_mutex);
+}
+
+gfcontext_t *gfs_take(gfcontext_t **ctx)
+{
+    gfcontext_t *taken = *ctx;
+
+    *ctx = NULL;
+    return taken;
+}
+
+void gfs_abort(gfcontext_t **ctx)
+{
+    if ((*ctx) == NULL)
+    {
+        L(WARN, "gfs_abort: ctx is NULL");
+        return;
+    }
+
+    L(DEBUG, "aborting transfer of %s after %zu bytes", (*ctx)->path, (*ctx)->bytes_sent);
+    gfs_close(ctx);
+}
+
+ssize_t gfs_trysend(gfcontext_t **ctx, const void *data, size_t len)
+{
+    struct iovec iov[2];
+    struct msghdr msg;
+    ssize_t n, header_sent = 0;
+    size_t header_left;
+    int flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+
+    if ((*ctx)->header_len > 0)
+    {
+        iov[msg.msg_iovlen].iov_base = (*ctx)->header + (*ctx)->header_off;
+        iov[msg.msg_iovlen++].iov_len = (*ctx)->header_len - (*ctx)->header_off;
+    }
+    iov[msg.msg_iovlen].iov_base = (void *)data;
+    iov[msg.msg_iovlen++].iov_len = len;
+
+    if ((*ctx)->coalesce && (*ctx)->bytes_sent + len < (*ctx)->file_len)
+    {
+        flags |= MSG_MORE;
+    }
+
+    __atomic_add_fetch(&send_calls, 1, __ATOMIC_RELAXED);
+    if ((n = sendmsg((*ctx)->sock_fd, &msg, flags)) == -1)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        {
+            return 0;
+        }
+        L(WARN, "send failed: %s", strerror(errno));
+        return -1;
+    }
+
+    if ((*ctx)->header_len > 0)
+    {
+        header_left = (*ctx)->header_len - (*ctx)->header_off;
+        header_sent = (size_t)n < header_left ? n : header_left;
+        (*ctx)->header_off += header_sent;
+        if ((*ctx)->header_off == (*ctx)->header_len)
+        {
+            (*ctx)->header_len = (*ctx)->header_off = 0;
+        }
+        n -= header_sent;
+    }
+
+    // Charged after the fact so that retries after EAGAIN are not counted twice
+    shape_charge(&(*ctx)->shape, (*ctx)->sock_fd, (struct sockaddr *)&(*ctx)->peer, n);
+
+    (*ctx)->bytes_sent += n;
+    if ((*ctx)->bytes_sent >= (*ctx)->file_len)
+    {
+        gfs_close(ctx);
+    }
+
+    return n;
+}
+
+int gfs_getfd(gfcontext_t **ctx)
+{
+    return (*ctx)->sock_fd;
+}
+
+uint64_t gfs_send_delay(gfcontext_t **ctx)
+{
+    return shape_delay(&(*ctx)->shape);
+}
+
+ssize_t gfs_send(gfcontext_t **ctx, const void *data, size_t len)
+{
+    struct iovec iov[2];
+    ssize_t bytes_sent;
+    int flags = 0, iovcnt = 0;
+
+    shape_throttle(&(*ctx)->shape, (*ctx)->sock_fd, (struct sockaddr *)&(*ctx)->peer, len);
+
+    // Let the kernel fill whole segments until the last of the body
+    if ((*ctx)->coalesce && (*ctx)->bytes_sent + len < (*ctx)->file_len)
+    {
+        flags = MSG_MORE;
+    }
+
+    if ((*ctx)->header_len > 0)
+    {
+        iov[iovcnt].iov_base = (*ctx)->header;
+        iov[iovcnt++].iov_len = (*ctx)->header_len;
+    }
+    iov[iovcnt].iov_base = (void *)data;
+    iov[iovcnt++].iov_len = len;
+
+    if ((bytes_sent = sendallv((*ctx)->sock_fd, iov, iovcnt, flags)) == -1)
+    {
+        L(WARN, "send failed: %s", strerror(errno));
+        return -1;
+    }
+    bytes_sent -= (*ctx)->header_len;
+    (*ctx)->header_len = 0;
+
+    (*ctx)->bytes_sent += bytes_sent;
+    if ((*ctx)->bytes_sent >= (*ctx)->file_len)
+    {
+        gfs_close(ctx);
+    }
+
+    return bytes_sent;
+}
+
+int gfs_format_header(char *buf, size_t size, gfstatus_t status, size_t file_len)
+{
+    char *eof = "\r\n\r\n";
+    char *scheme = "GETFILE";
+
+    if (status == GF_OK)
+    {
+        return snprintf(buf, size, "%s OK %zu%s", scheme, file_len, eof);
+    }
+    else if (status == GF_FILE_NOT_FOUND)
+    {
+        return snprintf(buf, size, "%s FILE_NOT_FOUND%s", scheme, eof);
+    }
+    else if (status == GF_ERROR)
+    {
+        return snprintf(buf, size, "%s ERROR%s", scheme, eof);
+    }
+    else if (status == GF_BUSY && file_len > 0)
+    {
+        return snprintf(buf, size, "%s BUSY %zu%s", scheme, file_len, eof);
+    }
+    else if (status == GF_BUSY)
+    {
+        return snprintf(buf, size, "%s BUSY%s", scheme, eof);
+    }
+
+    return snprintf(buf, size, "%s INVALID%s", scheme, eof);
+}
+
+ssize_t gfs_sendheader(gfcontext_t **ctx, gfstatus_t status, size_t file_len)
+{
+    int len;
+
+    (*ctx)->status = status;
+    (*ctx)->file_len = file_len;
+    (*ctx)->bytes_sent = 0;
+
+    len = gfs_format_header((*ctx)->header, BUFSIZE, status, file_len);
+
+    // Hold an OK header back so that it goes out with the start of the body
+    if ((*ctx)->coalesce && status == GF_OK && file_len > 0)
+    {
+        (*ctx)->header_len = len;
+        return len;
+    }
+
+    if (sendall((*ctx)->sock_fd, (*ctx)->header, len, 0) == -1)
+    {
+        L(WARN, "send header failed: %s", strerror(errno));
+        gfs_close(ctx);
+        return -1;
+    }
+
+    // Only an OK response with a body keeps the connection open
+    if (status != GF_OK || file_len == 0)
+    {
+        gfs_close(ctx);
+    }
+
+    return len;
+}
+
+size_t gfs_chunksize(gfcontext_t **ctx)
+{
+    int sndbuf = 0;
+    socklen_t optlen = sizeof(sndbuf);
+
+    if (!(*ctx)->coalesce)
+    {
+        return BUFSIZE;
+    }
+
+    if (getsockopt((*ctx)->sock_fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &optlen) < 0 || sndbuf < MIN_CHUNK)
+    {
+        return MIN_CHUNK;
+    }
+
+    return sndbuf > MAX_CHUNK ? MAX_CHUNK : sndbuf;
+}
+
+void gfs_log_sendstats()
+{
+    if (responses > 0)
+    {
+        L(INFO, "send path: %lu responses, %.2f send calls and %.2f data segments per response",
+          responses, (double)send_calls / responses, (double)segments / responses);
+    }
+    if (send_timeouts > 0)
+    {
+        L(INFO, "send path: %lu blocking sends timed out on a stalled client", send_timeouts);
+    }
+    if (request_timeouts > 0 || requests_oversized > 0)
+    {
+        L(INFO, "request headers: %lu connections closed for not sending one in time, %lu too long",
+          request_timeouts, requests_oversized);
+    }
+    if (peak_conns > 0)
+    {
+        L(INFO, "connections: at most %d open at once, %zu contexts preallocated", peak_conns, reserved_conns);
+    }
+}
+
+int gfs_getpeer(gfcontext_t **ctx, struct sockaddr_storage *addr, socklen_t *addrlen)
+{
+    memcpy(addr, &(*ctx)->peer, (*ctx)->peer_len);
+    *addrlen = (*ctx)->peer_len;
+    return 0;
+}
+
+int set_gfserver(gfserver_t *gfs)
+{
+    struct addrinfo config, *serverinfo, *p;
+    int yes = 1;
+    int res;
+    char port[8];
+    snprintf(port, sizeof(port), "%d", gfs->port);
+
+    memset(&config, 0, sizeof config);
+    config.ai_family = AF_UNSPEC;
+    config.ai_socktype = SOCK_STREAM;
+    config.ai_flags = AI_PASSIVE; // use my IP
+
+    if ((res = getaddrinfo(NULL, port, &config, &serverinfo)) != 0)
+    {
+        L(ERROR, "getaddrinfo: %s", gai_strerror(res));
+        return -1;
+    }
+
+    for (p = serverinfo; p != NULL; p = p->ai_next)
+    {
+        if ((gfs->sock_fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC,
+                                   p->ai_protocol)) == -1)
+        {
+            L(WARN, "server: socket: %s", strerror(errno));
+            continue;
+        }
+
+        if (setsockopt(gfs->sock_fd, SOL_SOCKET, SO_REUSEADDR, &yes,
+                       sizeof(int)) == -1)
+        {
+            L(ERROR, "setsockopt: %s", strerror(errno));
+            exit(1);
+        }
+
+        if (bind(gfs->sock_fd, p->ai_addr, p->ai_addrlen) == -1)
+        {
+            close(gfs->sock_fd);
+            L(WARN, "server: bind: %s", strerror(errno));
+            continue;
+        }
+
+        break;
+    }
+
+    freeaddrinfo(serverinfo);
+
+    if (p == NULL)
+    {
+        L(ERROR, "server: failed to bind");
+        return -1;
+    }
+
+    if (listen(gfs->sock_fd, gfs->max_pending) == -1)
+    {
+        L(ERROR, "listen: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int gfs_parse_request(const char *header, char *path, size_t path_size)
+{
+    char scheme[BUFSIZE] = {0};
+    char method[BUFSIZE] = {0};
+    char req_path[BUFSIZE] = {0};
+
+    if (strlen(header) >= BUFSIZE || strstr(header, "\r\n\r\n") == NULL)
+    {
+        return -1;
+    }
+
+    if (sscanf(header, "%s %s %s\r\n\r\n", scheme, method, req_path) != 3)
+    {
+        L(DEBUG, "failed to parse client header");
+        return -1;
+    }
+
+    if (strcmp(scheme, "GETFILE") != 0)
+    {
+        L(DEBUG, "invalid request scheme %s", scheme);
+        return -1;
+    }
+
+    if (strcmp(method, "GET") != 0)
+    {
+        L(DEBUG, "invalid request method %s", method);
+        return -1;
+    }
+
+    if (strncmp(req_path, "/", 1) != 0 || strlen(req_path) >= path_size)
+    {
+        L(DEBUG, "invalid request path %s", req_path);
+        return -1;
+    }
+
+    strcpy(path, req_path);
+    return 0;
+}
+
+// Parse request header
+//
+//  Reads what the client has sent of its request without blocking.
+//  Returns 1 once the request is complete and parsed, 0 if more is to
+//  come, and -1 with ctx->status set if it is malformed or too long or
+//  the connection failed.
+//
+static int read_req_header(gfcontext_t *ctx)
+{
+    size_t from;
+    ssize_t n;
+
+    while (1)
+    {
+        if (ctx->request_len >= MAX_REQUEST)
+        {
+            L(WARN, "request header too long");
+            requests_oversized++;
+            ctx->status = GF_INVALID;
+            return -1;
+        }
+
+        n = recv(ctx->sock_fd, ctx->header + ctx->request_len, MAX_REQUEST - ctx->request_len, 0);
+        if (n == 0)
+        {
+            L(DEBUG, "client closed connection before sending a header");
+            ctx->status = GF_INVALID;
+            return -1;
+        }
+        else if (n == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            L(WARN, "failed to receive header: %s", strerror(errno));
+            ctx->status = GF_ERROR;
+            return -1;
+        }
+        L(TRACE, "header recv %zd bytes", n);
+
+        // The terminator may straddle the previous read
+        from = ctx->request_len > 3 ? ctx->request_len - 3 : 0;
+        ctx->request_len += n;
+        ctx->header[ctx->request_len] = '\0';
+        if (strstr(ctx->header + from, "\r\n\r\n") != NULL)
+        {
+            break;
+        }
+    }
+
+    L(TRACE, "header_buffer: %s", ctx->header);
+
+    if (gfs_parse_request(ctx->header, ctx->path, BUFSIZE) < 0)
+    {
+        ctx->status = GF_INVALID;
+        return -1;
+    }
+
+    L(DEBUG, "request for %s", ctx->path);
+
+    return 1;
+}
+
+gfserver_t *gfserver_create()
+{
+    gfserver_t *gfs = calloc(1, sizeof(gfserver_t));
+    if (contexts == NULL)
+    {
+        contexts = objpool_create_aligned("gfcontext_t", sizeof(gfcontext_t), 64);
+    }
+    gfs->sock_fd = -1;
+    gfs->coalesce = 1;
+    if ((gfs->stop_fd = eventfd(0, EFD_CLOEXEC)) == -1)
+    {
+        L(ERROR, "eventfd: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return gfs;
+}
+
+void gfserver_set_coalesce(gfserver_t **gfs, int coalesce)
+{
+    (*gfs)->coalesce = coalesce;
+}
+
+void gfserver_set_contexts(gfserver_t **gfs, size_t count)
+{
+    if (objpool_reserve(contexts, count) < 0)
+    {
+        L(WARN, "unable to preallocate %zu connection contexts", count);
+        return;
+    }
+    reserved_conns += count;
+}
+
+void gfserver_set_header_timeout(gfserver_t **gfs, unsigned long timeout_ms)
+{
+    (*gfs)->header_timeout = timeout_ms;
+}
+
+void gfserver_set_send_timeout(gfserver_t **gfs, unsigned long timeout_ms)
+{
+    (*gfs)->send_timeout.tv_sec = timeout_ms / 1000;
+    (*gfs)->send_timeout.tv_usec = (timeout_ms % 1000) * 1000;
+}
+
+void gfserver_set_port(gfserver_t **gfs, unsigned short port)
+{
+    (*gfs)->port = port;
+}
+
+// What epoll reports for the listening socket and gfserver_stop's eventfd,
+// and what the drain timer hands to request_expired
+static char listen_marker, stop_marker, drain_marker;
+static int drained;
+
+static void pending_add(gfcontext_t *ctx)
+{
+    ctx->prev_pending = NULL;
+    ctx->next_pending = pending_head;
+    if (pending_head != NULL)
+    {
+        pending_head->prev_pending = ctx;
+    }
+    pending_head = ctx;
+    pending_requests++;
+}
+
+static void pending_remove(gfcontext_t *ctx)
+{
+    if (ctx->prev_pending != NULL)
+    {
+        ctx->prev_pending->next_pending = ctx->next_pending;
+    }
+    else
+    {
+        pending_head = ctx->next_pending;
+    }
+    if (ctx->next_pending != NULL)
+    {
+        ctx->next_pending->prev_pending = ctx->prev_pending;
+    }
+    pending_requests--;
+}
+
+// A slow or silent client only ever costs its socket and context
+static void request_expired(void *data)
+{
+    gfcontext_t *ctx = data;
+
+    if (data == &drain_marker)
+    {
+        drained = 1;
+        return;
+    }
+
+    L(DEBUG, "closing connection that sent %zu request bytes in time", ctx->request_len);
+    request_timeouts++;
+    pending_remove(ctx);
+    gfs_close(&ctx);
+}
+
+// Once stopped, requests get SERVE_DRAIN_MS to arrive, whatever -T allows
+static void drain_expired(gfserver_t *gfs, wheel_t *wheel)
+{
+    L(INFO, "closing %d connections that sent no request in %d ms", pending_requests, SERVE_DRAIN_MS);
+    while (pending_head != NULL)
+    {
+        if (gfs->header_timeout > 0)
+        {
+            wheel_cancel(wheel, &pending_head->timer);
+        }
+        request_expired(pending_head);
+    }
+}
+
+// Accepts every waiting connection and starts receiving its request
+static void accept_all(gfserver_t *gfs, int epfd, wheel_t *wheel)
+{
+    struct sockaddr_storage gfclient_addr;
+    struct epoll_event ev;
+    socklen_t sin_size;
+    gfcontext_t *ctx;
+    int sock_fd;
+
+    while (1)
+    {
+        sin_size = sizeof gfclient_addr;
+        if ((sock_fd = accept4(gfs->sock_fd, (struct sockaddr *)&gfclient_addr, &sin_size,
+                               SOCK_CLOEXEC | SOCK_NONBLOCK)) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                L(WARN, "accept: %s", strerror(errno));
+            }
+            return;
+        }
+
+        if (NULL == (ctx = objpool_get(contexts)))
+        {
+            L(ERROR, "unable to allocate connection context");
+            close(sock_fd);
+            continue;
+        }
+        pthread_mutex_lock(&conns_mutex);
+        if (++open_conns > peak_conns)
+        {
+            peak_conns = open_conns;
+        }
+        pthread_mutex_unlock(&conns_mutex);
+        if (gfs->send_timeout.tv_sec > 0 || gfs->send_timeout.tv_usec > 0)
+        {
+            setsockopt(sock_fd, SOL_SOCKET, SO_SNDTIMEO, &gfs->send_timeout, sizeof(struct timeval));
+        }
+        ctx->sock_fd = sock_fd;
+        ctx->coalesce = gfs->coalesce;
+        memcpy(&ctx->peer, &gfclient_addr, sin_size);
+        ctx->peer_len = sin_size;
+        shape_conn_init(&ctx->shape, sock_fd);
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = ctx;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock_fd, &ev) == -1)
+        {
+            L(WARN, "epoll_ctl: %s", strerror(errno));
+            gfs_close(&ctx);
+            continue;
+        }
+        if (gfs->header_timeout > 0)
+        {
+            wheel_add(wheel, &ctx->timer, gfs->header_timeout, ctx);
+        }
+        pending_add(ctx);
+    }
+}
+
+// Hands a connection whose request has arrived, or failed, to the handler
+static void dispatch(gfserver_t *gfs, int epfd, wheel_t *wheel, gfcontext_t *ctx, int res)
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, ctx->sock_fd, NULL);
+    if (gfs->header_timeout > 0)
+    {
+        wheel_cancel(wheel, &ctx->timer);
+    }
+    pending_remove(ctx);
+
+    // Responses are written with blocking sends, bounded by SO_SNDTIMEO
+    fcntl(ctx->sock_fd, F_SETFL, fcntl(ctx->sock_fd, F_GETFL) & ~O_NONBLOCK);
+
+    if (res < 0)
+    {
+        gfs_sendheader(&ctx, ctx->status, 0);
+        return;
+    }
+
+    gfs->gfs_handler(&ctx, ctx->path, gfs->handlerarg);
+
+    // The handler neither finished the response nor took ownership
+    if (ctx != NULL)
+    {
+        gfs_close(&ctx);
+    }
+}
+
+void gfserver_serve(gfserver_t **gfs)
+{
+    struct epoll_event ev, events[SERVE_EVENTS];
+    wheel_timer_t drain_timer;
+    wheel_t wheel;
+    int epfd, n, res, stopping = 0;
+
+    if ((*gfs)->sock_fd == -1 && set_gfserver(*gfs) == -1)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    // Accept without blocking so that gfserver_stop is noticed even when the
+    // socket is shared with another process that takes every connection
+    if (fcntl((*gfs)->sock_fd, F_SETFL, fcntl((*gfs)->sock_fd, F_GETFL) | O_NONBLOCK) == -1)
+    {
+        L(ERROR, "fcntl: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    // Requests are received from every connection at once, so that one
+    // that trickles in or never comes does not hold up the others
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+    {
+        L(ERROR, "epoll_create1: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listen_marker;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, (*gfs)->sock_fd, &ev);
+    ev.data.ptr = &stop_marker;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, (*gfs)->stop_fd, &ev);
+    wheel_init(&wheel, 1024, HEADER_TICK_MS);
+    drained = 0;
+
+    // Once stopped, finish receiving the requests already under way, for
+    // at most SERVE_DRAIN_MS
+    while (!stopping || pending_requests > 0)
+    {
+        if ((n = epoll_wait(epfd, events, SERVE_EVENTS, wheel_timeout(&wheel))) == -1)
+        {
+            if (errno != EINTR)
+            {
+                L(ERROR, "epoll_wait: %s", strerror(errno));
+            }
+            continue;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            if (events[i].data.ptr == &listen_marker)
+            {
+                accept_all(*gfs, epfd, &wheel);
+            }
+            else if (events[i].data.ptr == &stop_marker)
+            {
+                stopping = 1;
+                epoll_ctl(epfd, EPOLL_CTL_DEL, (*gfs)->sock_fd, NULL);
+                epoll_ctl(epfd, EPOLL_CTL_DEL, (*gfs)->stop_fd, NULL);
+                wheel_add(&wheel, &drain_timer, SERVE_DRAIN_MS, &drain_marker);
+            }
+            else if ((res = read_req_header(events[i].data.ptr)) != 0)
+            {
+                dispatch(*gfs, epfd, &wheel, events[i].data.ptr, res);
+            }
+        }
+
+        wheel_expire(&wheel, request_expired);
+        if (drained && pending_requests > 0)
+        {
+            drain_expired(*gfs, &wheel);
+        }
+    }
+
+    if (stopping && !drained)
+    {
+        wheel_cancel(&wheel, &drain_timer);
+    }
+    close(epfd);
+    wheel_destroy(&wheel);
+
+    // The socket now belongs to whoever else holds it
+    close((*gfs)->sock_fd);
+    (*gfs)->sock_fd = -1;
+}
+
+void gfserver_set_listenfd(gfserver_t **gfs, int fd)
+{
+    (*gfs)->sock_fd = fd;
+}
+
+int gfserver_get_listenfd(gfserver_t **gfs)
+{
+    return __atomic_load_n(&(*gfs)->sock_fd, __ATOMIC_ACQUIRE);
+}
+
+// Only write(2), so that a signal handler may call it
+void gfserver_stop(gfserver_t **gfs)
+{
+    uint64_t one = 1;
+    int saved_errno = errno;
+    ssize_t n;
+
+    // An eventfd write only fails once the counter would overflow
+    n = write((*gfs)->stop_fd, &one, sizeof(one));
+    (void)n;
+    errno = saved_errno;
+}
+
+void gfserver_drain(gfserver_t **gfs)
+{
+    pthread_mutex_lock(&conns_mutex);
+    if (open_conns > 0)
+    {
+        L(INFO, "waiting for %d connections to finish", open_conns);
+    }
+    while (open_conns > 0)
+    {
+        pthread_cond_wait(&conns_cond, &conns_mutex);
+    }
+    pthread_mutex_unlock(&conns_mutex);
+}
+
+void gfserver_set_handlerarg(gfserver_t **gfs, void *arg)
+{
+    (*gfs)->handlerarg = arg;
+}
+
+void gfserver_set_handler(gfserver_t **gfs, gfh_error_t (*handler)(gfcontext_t **, const char *, void *))
+{
+    (*gfs)->gfs_handler = handler;
+}
+
+void gfserver_set_maxpending(gfserver_t **gfs, int max_pending)
+{
+    (*gfs)->max_pending = max_pending;
+}
@@ -12,6 +12,7 @@ typedef int gfstatus_t;
 #define  GF_FILE_NOT_FOUND 400
 #define  GF_ERROR 500
 #define  GF_INVALID 600
+#define  GF_BUSY 503
 
 typedef enum {
     gfh_success = 5,
@@ -67,6 +68,8 @@ void gfserver_serve(gfserver_t **gfs);
  * Sends to the client the Getfile header containing the appropriate 
  * status and file length for the given inputs.  This function should
  * only be called from within a callback registered gfserver_set_handler.
+ * For GF_BUSY, file_len is instead a retry-after hint in milliseconds
+ * (0 for none).
  */
 ssize_t gfs_sendheader(gfcontext_t **ctx, gfstatus_t status, size_t file_len);
 
@@ -1,66 +1,194 @@
 #include <stdlib.h>
 
 #include "gfserver-student.h"
-#include "steque.h"
+#include "sched.h"
+#include "shape.h"
+#include "pipeline.h"
+#include "storage.h"
+#include "upgrade.h"
+#include "pool.h"
+#include "affinity.h"
+#include "objpool.h"
 #include "pthread.h"
+#include "log.h"
 
 #define USAGE                                                                                \
   "usage:\n"                                                                                 \
   "  gfserver_main [options]\n"                                                              \
   "options:\n"                                                                               \
   "  -h                  Show this help message.\n"                                          \
-  "  -t [nthreads]       Number of threads (Default: 16)\n"                                  \
+  "  -t [nthreads[:max]] Number of threads, growing up to max under load (Default: 16)\n"   \
+  "  -g [depth[:wait]]   Add a thread once depth requests, or any for wait ms, have queued\n" \
+  "                      with none idle (Default: 4:10)\n"                                    \
+  "  -i [idle]           Threads beyond nthreads exit after idle ms (Default: 10000)\n"      \
+  "  -A [node]           Keep every thread on a NUMA node, given by number or as the\n"       \
+  "                      network interface whose node to use, e.g. eth0\n"                    \
+  "  -c                  Pin each worker and network thread to a CPU of its own\n"           \
   "  -m [content_file]   Content file mapping keys to content files (Default: content.txt\n" \
   "  -p [listen_port]    Listen port (Default: 39474)\n"                                     \
-  "  -d [delay]          Delay in content_get, default 0, range 0-5000000 "                  \
-  "(microseconds)\n "
+  "  -P [backlog]        Listen backlog (Default: 24)\n"                                      \
+  "  -x [contexts]       Connection contexts to preallocate (Default: 256)\n"                \
+  "  -T [timeout]        Close connections that have not sent a request within timeout ms\n" \
+  "                      (Default: 5000, 0 waits forever)\n"                                \
+  "  -d [delay]          Delay opening each file, default 0, range 0-5000000 "                  \
+  "(microseconds)\n"                                                                         \
+  "  -M                  Serve the content file from memory, read in at startup\n"           \
+  "  -F [max_open]       Open files on first use, keeping at most max_open open\n"           \
+  "                      (Default: 0, open every file at startup)\n"                          \
+  "  -R [dir]            Serve every file under dir, resolving paths beneath it, with -F\n"    \
+  "                      bounding the path cache (Default: 1024)\n"                            \
+  "  -u [host:port]      Fetch files from an upstream GETFILE server instead\n"              \
+  "  -D [spec]           Inject storage latency, e.g. open=const:1000,read=exp:200\n"       \
+  "                      (const:US, uniform:LO:HI, exp:MEAN or pareto:MIN:ALPHA)\n"        \
+  "  -l [level]          Log level: error, warn, info, debug, trace (Default: info)\n"          \
+  "  -q [high[:low]]     Shed requests once high are queued, until the queue drains to low\n"  \
+  "                      (Default: 0, unbounded; low defaults to high/2)\n"                    \
+  "  -b [retry_after]    Answer shed requests with BUSY and this retry-after hint in\n"        \
+  "                      milliseconds instead of ERROR\n"                                     \
+  "  -s [bytes]          Files below this size are served shortest first (Default: 1048576,\n" \
+  "                      0 serves every request in arrival order)\n"                           \
+  "  -L [nthreads]       Most threads serving larger files at once (Default: max/2)\n"        \
+  "  -Q [bytes]          Fair queuing quantum: clients take turns being served this many\n"   \
+  "                      bytes (Default: 65536, 0 disables fair queuing)\n"                  \
+  "  -B [limits_file]    Bandwidth limits per connection, client and in total, reread on\n"    \
+  "                      SIGHUP (Default: unlimited)\n"                                         \
+  "  -K                  Enforce the per-connection limit with kernel pacing\n"                \
+  "  -C                  Send headers and 2 KB chunks separately, as before coalescing\n"   \
+  "  -n [nthreads]       Network threads sending what the -t threads read from disk\n"       \
+  "                      (Default: 2, 0 has each thread read and send whole files)\n"       \
+  "  -k [buffers]        64 KB buffers between disk and network threads (Default: 256)\n" \
+  "  -w [timeout]        Abort a response once its client has taken no data for timeout\n"  \
+  "                      ms (Default: 30000, 0 waits forever)\n"                            \
+  "SIGUSR2 restarts the server from its binary without dropping connections.\n"
 
 /* OPTIONS DESCRIPTOR ====================================================== */
 static struct option gLongOptions[] = {
     {"content", required_argument, NULL, 'm'},
     {"port", required_argument, NULL, 'p'},
+    {"backlog", required_argument, NULL, 'P'},
+    {"contexts", required_argument, NULL, 'x'},
+    {"header-timeout", required_argument, NULL, 'T'},
     {"nthreads", required_argument, NULL, 't'},
+    {"grow", required_argument, NULL, 'g'},
+    {"idle-timeout", required_argument, NULL, 'i'},
+    {"numa-node", required_argument, NULL, 'A'},
+    {"pin-cpus", no_argument, NULL, 'c'},
     {"delay", required_argument, NULL, 'd'},
+    {"memory", no_argument, NULL, 'M'},
+    {"fd-cache", required_argument, NULL, 'F'},
+    {"root", required_argument, NULL, 'R'},
+    {"upstream", required_argument, NULL, 'u'},
+    {"storage-latency", required_argument, NULL, 'D'},
+    {"log-level", required_argument, NULL, 'l'},
+    {"queue-limit", required_argument, NULL, 'q'},
+    {"busy", required_argument, NULL, 'b'},
+    {"small-limit", required_argument, NULL, 's'},
+    {"large-threads", required_argument, NULL, 'L'},
+    {"quantum", required_argument, NULL, 'Q'},
+    {"bandwidth", required_argument, NULL, 'B'},
+    {"pacing", no_argument, NULL, 'K'},
+    {"no-coalesce", no_argument, NULL, 'C'},
+    {"network-threads", required_argument, NULL, 'n'},
+    {"buffers", required_argument, NULL, 'k'},
+    {"write-timeout", required_argument, NULL, 'w'},
     {"help", no_argument, NULL, 'h'},
     {NULL, 0, NULL, 0}};
 
-extern unsigned long int content_delay;
+extern int queue_high_watermark;
+extern int queue_low_watermark;
+extern long shed_retry_after;
+extern unsigned long requests_admitted;
+extern unsigned long requests_shed;
 
 extern gfh_error_t gfs_handler(gfcontext_t **ctx, const char *path, void *arg);
 
 extern ssize_t gfs_transfer_file(gfcontext_t **ctx, const char *path);
 
+// The signal that asked for shutdown, acted on by main once serving stops
+static volatile sig_atomic_t shutdown_signal = 0;
+static gfserver_t *volatile serving = NULL;
+
 static void _sig_handler(int signo)
 {
+  gfserver_t *gfs = serving;
+
   if ((SIGINT == signo) || (SIGTERM == signo))
   {
-    exit(signo);
+    shutdown_signal = signo;
+    if (gfs == NULL)
+    {
+      // Not serving yet, or draining after a handover: nothing to report
+      _exit(signo);
+    }
+    gfserver_stop(&gfs);
   }
 }
 
-static pthread_t *workers;
-pthread_cond_t gfs_cond = PTHREAD_COND_INITIALIZER;
-pthread_mutex_t gfs_mutex = PTHREAD_MUTEX_INITIALIZER;
-steque_t *queue;
+sched_t *queue;
+storage_t *store;
+objpool_t *request_pool;
+
+static void _report_stats(void)
+{
+  if (queue_high_watermark > 0)
+  {
+    L(INFO, "admitted %lu requests, shed %lu", requests_admitted, requests_shed);
+  }
+  // Startup may fail before either exists
+  if (queue != NULL)
+  {
+    sched_report(queue);
+  }
+  if (store != NULL)
+  {
+    storage_report(store);
+  }
+  shape_report();
+  gfs_log_sendstats();
+  pipeline_report();
+  pool_report();
+  affinity_report();
+  objpool_report();
+}
+
+static char *limits_path = NULL;
 
-typedef struct gfs_queue_ctx
+// SIGHUP is blocked in every other thread; reload the limits when it arrives
+static void *_reload_limits(void *arg)
 {
-  gfcontext_t *ctx;
-  char *path;
-} gfs_queue_ctx;
+  sigset_t *set = arg;
+  int signo;
+
+  while (sigwait(set, &signo) == 0)
+  {
+    L(INFO, "SIGHUP: reloading %s", limits_path);
+    shape_load(limits_path);
+  }
+
+  return NULL;
+}
+
+pthread_cond_t gfs_cond = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t gfs_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static void *gfs_process_req(void *arg)
 {
   while (1)
   {
     gfs_queue_ctx *ctx = NULL;
+    int lane, wake;
 
     pthread_mutex_lock(&gfs_mutex);
-    while (steque_isempty(queue))
+    while (!sched_ready(queue))
     {
-      pthread_cond_wait(&gfs_cond, &gfs_mutex);
+      if (!pool_wait())
+      {
+        pthread_mutex_unlock(&gfs_mutex);
+        return NULL;
+      }
     }
-    ctx = steque_pop(queue);
+    ctx = sched_dequeue(queue, &lane);
+    pool_check(sched_size(queue));
     pthread_mutex_unlock(&gfs_mutex);
 
     if (NULL == ctx)
@@ -68,57 +196,27 @@ static void *gfs_process_req(void *arg)
       break;
     }
 
-    printf("processing request for %s\n", ctx->path);
+    L(DEBUG, "processing request for %s", ctx->path);
     gfs_transfer_file(&(ctx->ctx), ctx->path);
 
-    free(ctx);
-  }
-
-  return NULL;
-}
-
-// static void enqueue_gfs_req(gfcontext_t **ctx, char *path)
-// {
-//   gfs_queue_ctx *new_ctx = NULL;
-
-//   new_ctx = malloc(sizeof(gfs_queue_ctx));
-//   new_ctx->ctx = ctx;
-//   new_ctx->path = path;
-
-//   pthread_mutex_lock(&gfs_mutex);
-//   steque_enqueue(queue, new_ctx);
-//   pthread_cond_signal(&gfs_cond);
-//   pthread_mutex_unlock(&gfs_mutex);
-// }
+    objpool_put(request_pool, ctx);
 
-void init_threads(size_t nthreads)
-{
-  workers = malloc(sizeof(pthread_t) * nthreads);
-  for (int i = 0; i < nthreads; i++)
-  {
-    if (pthread_create(&workers[i], NULL, gfs_process_req, NULL) != 0)
+    // A finished large transfer may let a queued one start
+    pthread_mutex_lock(&gfs_mutex);
+    wake = sched_finish(queue, lane);
+    pthread_mutex_unlock(&gfs_mutex);
+    if (wake)
     {
-      fprintf(stderr, "Can't create thread %d\n", i);
-      exit(1);
+      pthread_cond_signal(&gfs_cond);
     }
-
-    printf("Created thread %d\n", i);
   }
+
+  return NULL;
 }
 
-void cleanup_threads(size_t nthreads, gfserver_t *gfs)
+void init_threads(size_t nthreads)
 {
-  for (int i = 0; i < nthreads; i++)
-  {
-    pthread_join(workers[i], NULL);
-  }
-
-  free(workers);
-  steque_destroy(queue);
-  free(queue);
-  free(gfs);
-
-  content_destroy();
+  pool_start(gfs_process_req, nthreads);
 }
 
 /* Main ========================================================= */
@@ -127,10 +225,35 @@ int main(int argc, char **argv)
   char *content_map = "content.txt";
   gfserver_t *gfs = NULL;
   int nthreads = 16;
+  int max_threads = 0;
+  int grow_depth = 4;
+  unsigned long grow_wait = 10;
+  unsigned long idle_timeout = 10000;
+  char *numa_node = NULL;
+  int pin_cpus = 0;
   unsigned short port = 39474;
+  int backlog = 24;
+  int ncontexts = 256;
+  unsigned long header_timeout = 5000;
   int option_char = 0;
-
-  setbuf(stdout, NULL);
+  int level = INFO;
+  size_t small_limit = 1 << 20;
+  int large_threads = 0;
+  size_t quantum = 1 << 16;
+  int coalesce = 1;
+  unsigned long content_delay = 0;
+  char delay_spec[32];
+  int memory = 0;
+  int max_open = 0;
+  char *upstream = NULL;
+  char *root = NULL;
+  char *latency = NULL;
+  int nnetwork = 2;
+  int nbuffers = 256;
+  unsigned long write_timeout = 30000;
+  pthread_t sighup_thread;
+  sigset_t sighup, sigusr2;
+  int listen_fd;
 
   if (SIG_ERR == signal(SIGINT, _sig_handler))
   {
@@ -145,7 +268,7 @@ int main(int argc, char **argv)
   }
 
   // Parse and set command line arguments
-  while ((option_char = getopt_long(argc, argv, "p:d:rhm:t:", gLongOptions,
+  while ((option_char = getopt_long(argc, argv, "p:P:x:T:d:rhm:t:g:i:A:cl:q:b:s:L:Q:B:KCn:k:w:MF:R:u:D:", gLongOptions,
                                     NULL)) != -1)
   {
     switch (option_char)
@@ -157,15 +280,90 @@ int main(int argc, char **argv)
     case 'p': /* listen-port */
       port = atoi(optarg);
       break;
+    case 'P': /* backlog */
+      backlog = atoi(optarg);
+      break;
+    case 'x': /* contexts */
+      ncontexts = atoi(optarg);
+      break;
+    case 'T': /* header-timeout */
+      header_timeout = strtoul(optarg, NULL, 10);
+      break;
     case 'd': /* delay */
-      content_delay = (unsigned long int)atoi(optarg);
+      content_delay = strtoul(optarg, NULL, 10);
       break;
     case 't': /* nthreads */
-      nthreads = atoi(optarg);
+      sscanf(optarg, "%d:%d", &nthreads, &max_threads);
+      break;
+    case 'g': /* grow */
+      sscanf(optarg, "%d:%lu", &grow_depth, &grow_wait);
+      break;
+    case 'i': /* idle-timeout */
+      idle_timeout = strtoul(optarg, NULL, 10);
+      break;
+    case 'A': /* numa-node */
+      numa_node = optarg;
+      break;
+    case 'c': /* pin-cpus */
+      pin_cpus = 1;
       break;
     case 'm': /* file-path */
       content_map = optarg;
       break;
+    case 'M': /* memory */
+      memory = 1;
+      break;
+    case 'F': /* fd-cache */
+      max_open = atoi(optarg);
+      break;
+    case 'R': /* root */
+      root = optarg;
+      break;
+    case 'u': /* upstream */
+      upstream = optarg;
+      break;
+    case 'D': /* storage-latency */
+      latency = optarg;
+      break;
+    case 'l': /* log-level */
+      level = log_parse_level(optarg);
+      break;
+    case 'q': /* queue-limit */
+      if (sscanf(optarg, "%d:%d", &queue_high_watermark, &queue_low_watermark) == 1)
+      {
+        queue_low_watermark = queue_high_watermark / 2;
+      }
+      break;
+    case 'b': /* busy */
+      shed_retry_after = atol(optarg);
+      break;
+    case 's': /* small-limit */
+      small_limit = strtoul(optarg, NULL, 10);
+      break;
+    case 'L': /* large-threads */
+      large_threads = atoi(optarg);
+      break;
+    case 'Q': /* quantum */
+      quantum = strtoul(optarg, NULL, 10);
+      break;
+    case 'B': /* bandwidth */
+      limits_path = optarg;
+      break;
+    case 'K': /* pacing */
+      shape_set_pacing(1);
+      break;
+    case 'C': /* no-coalesce */
+      coalesce = 0;
+      break;
+    case 'n': /* network-threads */
+      nnetwork = atoi(optarg);
+      break;
+    case 'k': /* buffers */
+      nbuffers = atoi(optarg);
+      break;
+    case 'w': /* write-timeout */
+      write_timeout = strtoul(optarg, NULL, 10);
+      break;
     default:
       fprintf(stderr, "%s", USAGE);
       exit(1);
@@ -177,6 +375,16 @@ int main(int argc, char **argv)
   {
     nthreads = 1;
   }
+  if (max_threads < nthreads)
+  {
+    max_threads = nthreads;
+  }
+
+  if (nnetwork < 0 || nbuffers < 1)
+  {
+    fprintf(stderr, "Network threads must not be negative and buffers must be positive\n");
+    exit(__LINE__);
+  }
 
   if (content_delay > 5000000)
   {
@@ -184,26 +392,136 @@ int main(int argc, char **argv)
     exit(__LINE__);
   }
 
-  content_init(content_map);
+  if (queue_high_watermark < 0 || queue_low_watermark < 0 ||
+      (queue_high_watermark > 0 && queue_low_watermark >= queue_high_watermark))
+  {
+    fprintf(stderr, "Queue low watermark must be below the high watermark\n");
+    exit(__LINE__);
+  }
+
+  // Block SIGHUP and SIGUSR2 before any thread starts so that only
+  // _reload_limits and the upgrade thread see them
+  sigemptyset(&sighup);
+  sigaddset(&sighup, SIGHUP);
+  if (limits_path != NULL)
+  {
+    pthread_sigmask(SIG_BLOCK, &sighup, NULL);
+  }
+  sigemptyset(&sigusr2);
+  sigaddset(&sigusr2, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &sigusr2, NULL);
+
+  log_init(level);
+  atexit(_report_stats);
+
+  // Before any other thread starts, so that they all inherit the node
+  if (affinity_init(numa_node, pin_cpus) < 0)
+  {
+    exit(EXIT_FAILURE);
+  }
+  affinity_thread("acceptor", 0);
+
+  if (limits_path != NULL)
+  {
+    if (shape_load(limits_path) < 0)
+    {
+      exit(EXIT_FAILURE);
+    }
+
+    if (pthread_create(&sighup_thread, NULL, _reload_limits, &sighup) != 0)
+    {
+      L(ERROR, "Can't create SIGHUP thread");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (upstream != NULL)
+  {
+    if (NULL == (store = storage_upstream(upstream)))
+    {
+      L(ERROR, "bad upstream address %s", upstream);
+      exit(EXIT_FAILURE);
+    }
+  }
+  else if (root != NULL)
+  {
+    store = storage_root(root, max_open > 0 ? max_open : 1024);
+  }
+  else if (memory)
+  {
+    store = storage_memory(content_map);
+  }
+  else
+  {
+    store = max_open > 0 ? storage_lazy(content_map, max_open) : storage_local(content_map);
+  }
+
+  // -d is the constant case of -D, applied to every backend
+  if (content_delay > 0)
+  {
+    snprintf(delay_spec, sizeof(delay_spec), "open=const:%lu", content_delay);
+    store = storage_latency(store, delay_spec);
+  }
+
+  if (latency != NULL && NULL == (store = storage_latency(store, latency)))
+  {
+    L(ERROR, "bad storage latency %s", latency);
+    exit(EXIT_FAILURE);
+  }
 
   /* Initialize thread management */
-  queue = malloc(sizeof(steque_t));
-  steque_init(queue);
+  if (large_threads < 1 || large_threads > max_threads)
+  {
+    large_threads = small_limit > 0 ? (max_threads + 1) / 2 : max_threads;
+  }
+  request_pool = objpool_create("gfs_queue_ctx", sizeof(gfs_queue_ctx));
+  queue = malloc(sizeof(sched_t));
+  sched_init(queue, small_limit, large_threads, quantum);
 
   /* Initialize thread pool */
-  init_threads(nthreads);
+  pool_init(nthreads, max_threads, grow_depth, grow_wait, idle_timeout);
+  if (nnetwork > 0)
+  {
+    pipeline_init(nthreads, nnetwork, nbuffers, write_timeout);
+  }
+  else
+  {
+    init_threads(nthreads);
+  }
 
   /*Initializing server*/
   gfs = gfserver_create();
+  serving = gfs;
 
   // Setting options
   gfserver_set_port(&gfs, port);
-  gfserver_set_maxpending(&gfs, 24);
+  gfserver_set_maxpending(&gfs, backlog);
+  gfserver_set_contexts(&gfs, ncontexts > 0 ? ncontexts : 0);
+  gfserver_set_coalesce(&gfs, coalesce);
+  gfserver_set_send_timeout(&gfs, write_timeout);
+  gfserver_set_header_timeout(&gfs, header_timeout);
   gfserver_set_handler(&gfs, gfs_handler);
   gfserver_set_handlerarg(&gfs, NULL); // doesn't have to be NULL!
 
-  /*Loops forever*/
+  // Take over from the process being upgraded, now that this one is ready
+  if ((listen_fd = upgrade_inherit()) >= 0)
+  {
+    gfserver_set_listenfd(&gfs, listen_fd);
+  }
+  upgrade_init(argv, gfs);
+  upgrade_ready();
+
+  /*Loops until an upgraded process takes over the listening socket*/
   gfserver_serve(&gfs);
 
-  cleanup_threads(nthreads, gfs);
+  if (shutdown_signal != 0)
+  {
+    L(INFO, "caught signal %d, exiting", (int)shutdown_signal);
+    exit(shutdown_signal);
+  }
+  serving = NULL;
+
+  gfserver_drain(&gfs);
+  L(INFO, "handed over to the upgraded server, exiting");
+  exit(EXIT_SUCCESS);
 }
@@ -3,12 +3,14 @@
 #include "workload.h"
 #include "content.h"
 #include "pthread.h"
-#include "steque.h"
+#include "sched.h"
+#include "storage.h"
+#include "pool.h"
+#include "affinity.h"
+#include "objpool.h"
 #include "stdlib.h"
-#include <sys/stat.h>
-#include <fcntl.h>
-
-#define BUFSIZE 2048
+#include <errno.h>
+#include "log.h"
 
 //
 //  The purpose of this function is to handle a get request
@@ -21,30 +23,79 @@
 //
 extern pthread_mutex_t gfs_mutex;
 extern pthread_cond_t gfs_cond;
-extern steque_t *queue;
-
-typedef struct gfs_queue_ctx
-{
-	gfcontext_t *ctx;
-	const char *path;
-} gfs_queue_ctx;
+extern sched_t *queue;
+extern storage_t *store;
+extern objpool_t *request_pool;
 
-static void enqueue_gfs_req(gfcontext_t *ctx, const char *path)
+//
+//  Admission control.  Once the queue holds queue_high_watermark requests
+//  the boss sheds new ones until the workers have drained it down to
+//  queue_low_watermark, so that under overload the workers only serve
+//  requests whose clients are still likely to be waiting.
+//
+int queue_high_watermark = 0; // 0 disables admission control
+int queue_low_watermark = 0;
+long shed_retry_after = -1; // >= 0 answers BUSY with this hint (ms) instead of ERROR
+unsigned long requests_admitted = 0;
+unsigned long requests_shed = 0;
+static int shedding = 0;
+
+// Returns -1 while shedding load and -2 if the request could not be queued
+static int enqueue_gfs_req(gfcontext_t **ctx, const char *path)
 {
 	gfs_queue_ctx *new_ctx = NULL;
+	struct sockaddr_storage peer;
+	socklen_t peer_len;
+	ssize_t size;
+	int depth;
 
-	new_ctx = malloc(sizeof(gfs_queue_ctx));
-	new_ctx->ctx = ctx;
-	new_ctx->path = path;
+	gfs_getpeer(ctx, &peer, &peer_len);
+	size = storage_stat(store, path);
 
 	pthread_mutex_lock(&gfs_mutex);
-	steque_enqueue(queue, new_ctx);
+	depth = sched_size(queue);
+	if (!shedding && queue_high_watermark > 0 && depth >= queue_high_watermark)
+	{
+		shedding = 1;
+		L(WARN, "queue depth %d reached high watermark, shedding requests", depth);
+	}
+	else if (shedding && depth <= queue_low_watermark)
+	{
+		shedding = 0;
+		L(WARN, "queue drained to %d, admitting requests (%lu shed so far)", depth, requests_shed);
+	}
+
+	if (shedding)
+	{
+		requests_shed++;
+		pthread_mutex_unlock(&gfs_mutex);
+		return -1;
+	}
+
+	if (NULL == (new_ctx = objpool_get(request_pool)))
+	{
+		pthread_mutex_unlock(&gfs_mutex);
+		return -2;
+	}
+	new_ctx->path = path;
+	if (sched_enqueue(queue, new_ctx, size, (struct sockaddr *)&peer) < 0)
+	{
+		objpool_put(request_pool, new_ctx);
+		pthread_mutex_unlock(&gfs_mutex);
+		return -2;
+	}
+	new_ctx->ctx = gfs_take(ctx);
+	pool_check(depth + 1);
+	requests_admitted++;
 	pthread_mutex_unlock(&gfs_mutex);
 	pthread_cond_signal(&gfs_cond);
+	return 0;
 }
 
 gfh_error_t gfs_handler(gfcontext_t **ctx, const char *path, void *arg)
 {
+	int res;
+
 	if (path == NULL)
 	{
 		return gfh_failure;
@@ -55,70 +106,133 @@ gfh_error_t gfs_handler(gfcontext_t **ctx, const char *path, void *arg)
 		return gfh_failure;
 	}
 
-	enqueue_gfs_req(*ctx, path);
-	*ctx = NULL;
+	// Keys the backend knows are missing never reach a worker
+	if (!storage_may_exist(store, path))
+	{
+		L(DEBUG, "file not found: %s", path);
+		gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
+		return gfh_success;
+	}
+
+	if ((res = enqueue_gfs_req(ctx, path)) == -2)
+	{
+		L(WARN, "unable to queue request for %s", path);
+		gfs_sendheader(ctx, GF_ERROR, 0);
+	}
+	else if (res < 0)
+	{
+		L(DEBUG, "shed request for %s", path);
+		if (shed_retry_after >= 0)
+		{
+			gfs_sendheader(ctx, GF_BUSY, shed_retry_after);
+		}
+		else
+		{
+			gfs_sendheader(ctx, GF_ERROR, 0);
+		}
+	}
+
 	return gfh_success;
 }
 
-int sendall(int s, const void *buf, size_t len)
+// Grown to the largest chunk size this worker has been asked for, on its own node
+static __thread char *buffer = NULL;
+static __thread size_t buffer_size = 0;
+static pthread_key_t buffer_key;
+static pthread_once_t buffer_once = PTHREAD_ONCE_INIT;
+
+// Elastic workers exit when idle, and their buffers with them
+static void buffer_release(void *arg)
+{
+	affinity_free(arg, buffer_size);
+	buffer = NULL;
+	buffer_size = 0;
+}
+
+static void buffer_key_create()
 {
-	size_t total = 0;		// how many bytes we've sent
-	size_t bytesleft = len; // how many we have left to send
-	size_t n;
+	pthread_key_create(&buffer_key, buffer_release);
+}
 
-	while (total < len)
+ssize_t gfs_start_transfer(gfcontext_t **ctx, const char *path, int *handle_out)
+{
+	int handle;
+	size_t file_len;
+
+	if ((handle = storage_open(store, path, &file_len)) < 0)
 	{
-		n = send(s, buf + total, bytesleft, 0);
-		if (n == -1)
+		if (errno == ENOENT)
+		{
+			L(DEBUG, "file not found: %s", path);
+			gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
+		}
+		else
 		{
-			break; // an error occurred
+			L(WARN, "unable to open %s: %s", path, strerror(errno));
+			gfs_sendheader(ctx, GF_ERROR, 0);
 		}
-		printf("length %zu\n", len);
-		printf("sent %ld bytes\n", n);
-		total += n;
-		bytesleft -= n;
+		return -1;
+	}
+
+	L(DEBUG, "sending %s (%zu bytes)", path, file_len);
+	if (gfs_sendheader(ctx, GF_OK, file_len) < 0 || file_len == 0)
+	{
+		storage_close(store, handle);
+		return file_len == 0 ? 0 : -1;
 	}
 
-	return n == -1 ? -1 : total; // return -1 on failure, 0 on success
+	*handle_out = handle;
+	return file_len;
 }
 
 ssize_t gfs_transfer_file(gfcontext_t **ctx, const char *path)
 {
-	int fd;
-	ssize_t bytes_sent, file_len;
-	char buffer[BUFSIZE];
+	int handle;
+	ssize_t bytes_sent, bytes_read, file_len;
+	size_t chunk;
 
-	fd = content_get(path);
-	if (fd < 0)
+	if ((file_len = gfs_start_transfer(ctx, path, &handle)) <= 0)
 	{
-		gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
-		printf("Error: file not found\n");
-		return -1;
+		return file_len;
 	}
 
-	struct stat st;
-	if (fstat(fd, &st) < 0)
+	chunk = gfs_chunksize(ctx);
+	if (chunk > buffer_size)
 	{
-		gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
-		printf("Error: file not found\n");
-		return -1;
+		pthread_once(&buffer_once, buffer_key_create);
+		affinity_free(buffer, buffer_size);
+		buffer_size = (buffer = affinity_alloc(chunk)) != NULL ? chunk : 0;
+		pthread_setspecific(buffer_key, buffer);
+		if (buffer == NULL)
+		{
+			L(ERROR, "unable to allocate a %zu-byte transfer buffer", chunk);
+			gfs_abort(ctx);
+			storage_close(store, handle);
+			return -1;
+		}
 	}
-	file_len = st.st_size;
-	printf("File length %ld\n", file_len);
-	gfs_sendheader(ctx, GF_OK, file_len);
-	printf("Sending file %s\n", path);
+
+	// The library releases the context once file_len bytes have been sent
 	bytes_sent = 0;
 	while (bytes_sent < file_len)
 	{
-		if (pread(fd, buffer, BUFSIZE, bytes_sent) <= 0)
+		if ((bytes_read = storage_read(store, handle, buffer, chunk, bytes_sent)) <= 0)
 		{
-			printf("Error reading file\n");
+			L(WARN, "error reading file at offset %zd", bytes_sent);
 			gfs_abort(ctx);
+			storage_close(store, handle);
 			return -1;
 		}
 
-		bytes_sent += gfs_send(ctx, buffer, BUFSIZE);
+		if (gfs_send(ctx, buffer, bytes_read) < 0)
+		{
+			gfs_abort(ctx);
+			storage_close(store, handle);
+			return -1;
+		}
+		bytes_sent += bytes_read;
 	}
 
+	storage_close(store, handle);
 	return bytes_sent;
-}
\ No newline at end of file
+}
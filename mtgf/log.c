@@ -0,0 +1,390 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+// Per-thread ring size, must be a power of two
+#define LOG_RING_SIZE (1 << 15)
+#define LOG_LINE_MAX 1024
+#define LOG_MAX_IOV 64
+
+//
+//  Each thread that logs owns one single-producer/single-consumer ring.
+//  The owning thread only ever advances head and the writer thread only
+//  ever advances tail, so neither side takes a lock on the hot path.
+//  head and tail are free-running byte counters; their difference is the
+//  number of bytes waiting to be written.
+//
+typedef struct log_ring_t
+{
+  char buf[LOG_RING_SIZE];
+  size_t head;
+  size_t tail;
+  size_t dropped;
+  int dead;
+  struct log_ring_t *next;
+} log_ring_t;
+
+int log_level = INFO;
+
+static pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static log_ring_t *rings = NULL;
+static pthread_key_t ring_key;
+static __thread log_ring_t *my_ring = NULL;
+
+static pthread_t writer;
+static int running = 0;
+// Set by the writer while it is about to sleep, under wake_mutex
+static int writer_waiting = 0;
+static pthread_mutex_t wake_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+static int initialized = 0;
+
+static void write_all(const char *data, size_t len)
+{
+  fwrite(data, 1, len, MYLOG_FILE);
+}
+
+static void writev_all(struct iovec *iov, int iovcnt)
+{
+  int fd = fileno(MYLOG_FILE);
+  ssize_t n;
+
+  while (iovcnt > 0)
+  {
+    n = writev(fd, iov, iovcnt);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      return; // nowhere to report it, drop the batch
+    }
+
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len)
+    {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+
+    if (iovcnt > 0)
+    {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+}
+
+static void ring_release(void *arg)
+{
+  log_ring_t *ring = arg;
+
+  __atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+  my_ring = NULL;
+}
+
+static log_ring_t *get_ring()
+{
+  log_ring_t *ring;
+
+  if (my_ring != NULL)
+  {
+    return my_ring;
+  }
+
+  if (NULL == (ring = calloc(1, sizeof(log_ring_t))))
+  {
+    return NULL;
+  }
+
+  pthread_setspecific(ring_key, ring);
+
+  pthread_mutex_lock(&ring_mutex);
+  ring->next = rings;
+  rings = ring;
+  pthread_mutex_unlock(&ring_mutex);
+
+  my_ring = ring;
+  return ring;
+}
+
+static int ring_put(log_ring_t *ring, const char *data, size_t len)
+{
+  size_t head = ring->head;
+  size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  size_t off, first;
+
+  if (LOG_RING_SIZE - (head - tail) < len)
+  {
+    return -1;
+  }
+
+  off = head & (LOG_RING_SIZE - 1);
+  first = len < LOG_RING_SIZE - off ? len : LOG_RING_SIZE - off;
+  memcpy(ring->buf + off, data, first);
+  memcpy(ring->buf, data + first, len - first);
+
+  __atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+  return 0;
+}
+
+static size_t drain();
+
+static void wake_writer()
+{
+  pthread_mutex_lock(&wake_mutex);
+  pthread_cond_signal(&wake_cond);
+  pthread_mutex_unlock(&wake_mutex);
+}
+
+void log_write(int priority, const char *format, ...)
+{
+  char line[LOG_LINE_MAX];
+  log_ring_t *ring;
+  va_list ap;
+  int len;
+
+  va_start(ap, format);
+  len = vsnprintf(line, sizeof(line) - 1, format, ap);
+  va_end(ap);
+
+  if (len < 0)
+  {
+    return;
+  }
+  if (len > sizeof(line) - 2)
+  {
+    len = sizeof(line) - 2;
+  }
+  line[len++] = '\n';
+
+  if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE) || NULL == (ring = get_ring()))
+  {
+    write_all(line, len);
+    return;
+  }
+
+  if (ring_put(ring, line, len) < 0)
+  {
+    // Never lose errors and warnings, everything else is best effort
+    if (priority <= WARN)
+    {
+      write_all(line, len);
+    }
+    else
+    {
+      __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+    }
+    return;
+  }
+
+  // Pairs with the fence in log_writer: either it sees the new head or we see it waiting.
+  // Likewise with log_destroy: either its last drain sees the new head or
+  // we see the writer gone and write the message out ourselves.
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (!__atomic_load_n(&running, __ATOMIC_SEQ_CST))
+  {
+    drain();
+  }
+  else if (__atomic_load_n(&writer_waiting, __ATOMIC_RELAXED))
+  {
+    wake_writer();
+  }
+}
+
+//
+//  Collects everything currently queued in every ring and writes it with
+//  as few writev calls as possible.  Returns the number of bytes written.
+//
+static size_t drain()
+{
+  struct iovec iov[LOG_MAX_IOV];
+  log_ring_t *owner[LOG_MAX_IOV];
+  size_t head[LOG_MAX_IOV];
+  size_t total = 0, dropped = 0;
+  int iovcnt = 0, nrings = 0;
+  log_ring_t **link, *ring;
+
+  pthread_mutex_lock(&ring_mutex);
+
+  link = &rings;
+  while ((ring = *link) != NULL)
+  {
+    size_t h = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    size_t t = ring->tail;
+    size_t off, first;
+
+    dropped += __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+
+    if (h == t)
+    {
+      if (__atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE))
+      {
+        *link = ring->next;
+        free(ring);
+        continue;
+      }
+      link = &ring->next;
+      continue;
+    }
+
+    off = t & (LOG_RING_SIZE - 1);
+    first = h - t < LOG_RING_SIZE - off ? h - t : LOG_RING_SIZE - off;
+    iov[iovcnt].iov_base = ring->buf + off;
+    iov[iovcnt++].iov_len = first;
+    if (first < h - t)
+    {
+      iov[iovcnt].iov_base = ring->buf;
+      iov[iovcnt++].iov_len = h - t - first;
+    }
+    owner[nrings] = ring;
+    head[nrings++] = h;
+    total += h - t;
+
+    if (iovcnt > LOG_MAX_IOV - 2)
+    {
+      writev_all(iov, iovcnt);
+      while (nrings > 0)
+      {
+        nrings--;
+        __atomic_store_n(&owner[nrings]->tail, head[nrings], __ATOMIC_RELEASE);
+      }
+      iovcnt = 0;
+    }
+
+    link = &ring->next;
+  }
+
+  if (iovcnt > 0)
+  {
+    writev_all(iov, iovcnt);
+    while (nrings > 0)
+    {
+      nrings--;
+      __atomic_store_n(&owner[nrings]->tail, head[nrings], __ATOMIC_RELEASE);
+    }
+  }
+
+  pthread_mutex_unlock(&ring_mutex);
+
+  if (dropped > 0)
+  {
+    char line[64];
+    int len = snprintf(line, sizeof(line), "log: dropped %zu messages\n", dropped);
+    write_all(line, len);
+  }
+
+  return total;
+}
+
+// Whether any ring holds bytes not yet written
+static int pending()
+{
+  log_ring_t *ring;
+  int found = 0;
+
+  pthread_mutex_lock(&ring_mutex);
+  for (ring = rings; ring != NULL && !found; ring = ring->next)
+  {
+    found = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != ring->tail ||
+            __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED) > 0;
+  }
+  pthread_mutex_unlock(&ring_mutex);
+  return found;
+}
+
+//
+//  Sleeps until a producer finds it waiting after publishing a message, so
+//  an idle logger costs nothing.  The rescan after announcing the wait
+//  catches messages published before the producer could see the flag.
+//
+static void *log_writer(void *arg)
+{
+  while (__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+  {
+    if (drain() > 0)
+    {
+      continue;
+    }
+
+    pthread_mutex_lock(&wake_mutex);
+    __atomic_store_n(&writer_waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&running, __ATOMIC_ACQUIRE) && !pending())
+    {
+      pthread_cond_wait(&wake_cond, &wake_mutex);
+    }
+    __atomic_store_n(&writer_waiting, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&wake_mutex);
+  }
+
+  drain();
+  return NULL;
+}
+
+void log_init(int level)
+{
+  log_set_level(level);
+
+  if (initialized)
+  {
+    return;
+  }
+  initialized = 1;
+
+  pthread_key_create(&ring_key, ring_release);
+  __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+
+  if (pthread_create(&writer, NULL, log_writer, NULL) != 0)
+  {
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    fprintf(MYLOG_FILE, "log: unable to start writer thread, logging synchronously\n");
+    return;
+  }
+
+  atexit(log_destroy);
+}
+
+void log_set_level(int level)
+{
+  __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
+int log_parse_level(const char *name)
+{
+  static const char *names[] = {"error", "warn", "info", "debug", "trace"};
+
+  for (int i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+  {
+    if (strcasecmp(name, names[i]) == 0)
+    {
+      return ERROR + i;
+    }
+  }
+
+  return atoi(name);
+}
+
+void log_destroy()
+{
+  if (!__atomic_exchange_n(&running, 0, __ATOMIC_SEQ_CST))
+  {
+    return;
+  }
+
+  wake_writer();
+  pthread_join(writer, NULL);
+
+  // Threads still running may have published after the writer's last drain
+  drain();
+  fflush(MYLOG_FILE);
+}
@@ -9,12 +9,52 @@
 #define DEBUG 4
 #define TRACE 5
 
+/*
+ * Compile-time ceiling.  Levels above it are removed entirely; levels at or
+ * below it are filtered at runtime against log_level.
+ */
 #ifndef MYLOG_PRIORITY
-#define MYLOG_PRIORITY 1
-#endif 
+#define MYLOG_PRIORITY TRACE
+#endif
 
 #define MYLOG_FILE stderr
 
-#define L(priority,format,a...) if(priority <= MYLOG_PRIORITY) fprintf(MYLOG_FILE, format "\n", ## a);
+/*
+ * Current runtime level.  A disabled level costs one relaxed atomic load and
+ * one branch.
+ */
+extern int log_level;
 
-#endif 
+#define L(priority,format,a...) do { \
+    if ((priority) <= MYLOG_PRIORITY && \
+        (priority) <= __atomic_load_n(&log_level, __ATOMIC_RELAXED)) \
+        log_write(priority, format, ## a); \
+} while (0)
+
+/*
+ * Starts the background writer thread.  Until this is called (and after
+ * log_destroy) messages are written synchronously to MYLOG_FILE.
+ */
+void log_init(int level);
+
+/* Changes the runtime level.  Safe to call from any thread at any time. */
+void log_set_level(int level);
+
+/* Parses "error", "warn", "info", "debug", "trace" or a number. */
+int log_parse_level(const char *name);
+
+/*
+ * Formats a message into the calling thread's ring buffer.  Use the L macro
+ * rather than calling this directly so that disabled levels are skipped
+ * before any formatting work is done.
+ */
+void log_write(int priority, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/*
+ * Stops the writer thread and drains every ring buffer.  Messages from
+ * threads still logging are written synchronously from then on.
+ */
+void log_destroy(void);
+
+#endif
@@ -0,0 +1,348 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "manifest.h"
+#include "log.h"
+
+struct manifest_t
+{
+  const manifest_entry_t *entries;
+  const manifest_slot_t *slots;
+  const char *strings;
+  uint64_t nentries, nslots, strings_len;
+  void *map; // the mapped file, or NULL if built in memory
+  size_t map_len;
+  size_t reused, statted;
+};
+
+uint64_t manifest_hash(const char *key)
+{
+  uint64_t hash = 14695981039346656037ULL;
+
+  while (*key != '\0')
+  {
+    hash ^= (unsigned char)*key++;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+size_t manifest_count(const manifest_t *manifest)
+{
+  return manifest->nentries;
+}
+
+// Offsets are checked on use so that opening a manifest touches none of its pages
+static const char *string_at(const manifest_t *manifest, uint64_t off)
+{
+  return off < manifest->strings_len ? manifest->strings + off : "";
+}
+
+const char *manifest_key(const manifest_t *manifest, size_t index)
+{
+  return string_at(manifest, manifest->entries[index].key_off);
+}
+
+const char *manifest_path(const manifest_t *manifest, size_t index)
+{
+  return string_at(manifest, manifest->entries[index].path_off);
+}
+
+ssize_t manifest_size(const manifest_t *manifest, size_t index)
+{
+  return manifest->entries[index].size;
+}
+
+ssize_t manifest_find(const manifest_t *manifest, const char *key)
+{
+  uint64_t hash = manifest_hash(key), mask = manifest->nslots - 1, slot = hash & mask;
+  uint64_t index;
+
+  for (uint64_t probes = 0; probes < manifest->nslots && manifest->slots[slot] != 0; probes++)
+  {
+    index = manifest->slots[slot] - 1;
+    if (index < manifest->nentries && manifest->entries[index].hash == hash &&
+        strcmp(manifest_key(manifest, index), key) == 0)
+    {
+      return index;
+    }
+    slot = (slot + 1) & mask;
+  }
+
+  return -1;
+}
+
+void manifest_build_stats(const manifest_t *manifest, size_t *reused, size_t *statted)
+{
+  *reused = manifest->reused;
+  *statted = manifest->statted;
+}
+
+void manifest_close(manifest_t *manifest)
+{
+  if (manifest->map != NULL)
+  {
+    munmap(manifest->map, manifest->map_len);
+  }
+  else
+  {
+    free((void *)manifest->entries);
+    free((void *)manifest->slots);
+    free((void *)manifest->strings);
+  }
+  free(manifest);
+}
+
+/* Loading ================================================================= */
+
+static int valid_region(uint64_t off, uint64_t count, uint64_t size, uint64_t align, size_t len)
+{
+  return off % align == 0 && off <= len && count <= (len - off) / size;
+}
+
+manifest_t *manifest_open(const char *path)
+{
+  const manifest_header_t *header;
+  manifest_t *manifest;
+  struct stat st;
+  void *map;
+  int fd, err;
+
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+  {
+    return NULL;
+  }
+  if (fstat(fd, &st) < 0)
+  {
+    err = errno;
+    close(fd);
+    errno = err;
+    return NULL;
+  }
+  if ((size_t)st.st_size < sizeof(manifest_header_t))
+  {
+    close(fd);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+  {
+    return NULL;
+  }
+
+  header = map;
+  if (memcmp(header->magic, MANIFEST_MAGIC, sizeof(header->magic)) != 0)
+  {
+    munmap(map, st.st_size);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if (header->nentries >= UINT32_MAX ||
+      header->nslots <= header->nentries || (header->nslots & (header->nslots - 1)) != 0 ||
+      !valid_region(header->entries_off, header->nentries, sizeof(manifest_entry_t), 8, st.st_size) ||
+      !valid_region(header->slots_off, header->nslots, sizeof(manifest_slot_t), 4, st.st_size) ||
+      !valid_region(header->strings_off, header->strings_len, 1, 1, st.st_size) || header->strings_len == 0 ||
+      ((char *)map)[header->strings_off + header->strings_len - 1] != '\0')
+  {
+    munmap(map, st.st_size);
+    errno = EBADMSG;
+    return NULL;
+  }
+
+  manifest = calloc(1, sizeof(manifest_t));
+  manifest->map = map;
+  manifest->map_len = st.st_size;
+  manifest->nentries = header->nentries;
+  manifest->nslots = header->nslots;
+  manifest->strings_len = header->strings_len;
+  manifest->entries = (const manifest_entry_t *)((char *)map + header->entries_off);
+  manifest->slots = (const manifest_slot_t *)((char *)map + header->slots_off);
+  manifest->strings = (char *)map + header->strings_off;
+  return manifest;
+}
+
+/* Building ================================================================ */
+
+static uint64_t add_string(char **strings, uint64_t *len, uint64_t *cap, const char *s)
+{
+  size_t n = strlen(s) + 1;
+  uint64_t off = *len;
+
+  while (*len + n > *cap)
+  {
+    *cap *= 2;
+    *strings = realloc(*strings, *cap);
+  }
+  memcpy(*strings + off, s, n);
+  *len += n;
+  return off;
+}
+
+static ssize_t entry_size(manifest_t *manifest, const manifest_t *previous, const char *key, const char *path)
+{
+  struct stat st;
+  ssize_t index;
+
+  if (previous != NULL && (index = manifest_find(previous, key)) >= 0 && manifest_size(previous, index) >= 0 &&
+      strcmp(manifest_path(previous, index), path) == 0)
+  {
+    manifest->reused++;
+    return manifest_size(previous, index);
+  }
+
+  manifest->statted++;
+  if (stat(path, &st) < 0)
+  {
+    L(WARN, "manifest: stat %s: %s", path, strerror(errno));
+    return -1;
+  }
+  return st.st_size;
+}
+
+manifest_t *manifest_build(const char *content_map, const manifest_t *previous, int stat_sizes)
+{
+  manifest_t *manifest = calloc(1, sizeof(manifest_t));
+  manifest_entry_t *entries, *entry;
+  manifest_slot_t *slots;
+  uint64_t capacity = 1024, strings_cap = 1 << 16, slot, mask;
+  char *strings, *line = NULL, *ptr, *key, *path;
+  size_t line_cap = 0;
+  FILE *filelist;
+
+  if (NULL == (filelist = fopen(content_map, "r")))
+  {
+    free(manifest);
+    return NULL;
+  }
+
+  entries = malloc(capacity * sizeof(manifest_entry_t));
+  strings = malloc(strings_cap);
+  strings[manifest->strings_len++] = '\0';
+
+  while (getline(&line, &line_cap, filelist) > 0)
+  {
+    line[strcspn(line, "\r\n")] = '\0';
+    ptr = line;
+    key = strsep(&ptr, " \t");
+    path = strsep(&ptr, " \t");
+    if (key == NULL || path == NULL || manifest->nentries == UINT32_MAX - 1)
+    {
+      continue;
+    }
+
+    if (manifest->nentries == capacity)
+    {
+      capacity *= 2;
+      entries = realloc(entries, capacity * sizeof(manifest_entry_t));
+    }
+
+    entry = &entries[manifest->nentries++];
+    entry->hash = manifest_hash(key);
+    entry->size = stat_sizes ? entry_size(manifest, previous, key, path) : -1;
+    entry->key_off = add_string(&strings, &manifest->strings_len, &strings_cap, key);
+    entry->path_off = add_string(&strings, &manifest->strings_len, &strings_cap, path);
+  }
+  free(line);
+  fclose(filelist);
+
+  for (manifest->nslots = 16; manifest->nslots < 2 * manifest->nentries; manifest->nslots *= 2)
+    ;
+  mask = manifest->nslots - 1;
+  slots = calloc(manifest->nslots, sizeof(manifest_slot_t));
+  manifest->entries = entries;
+  manifest->strings = strings;
+  manifest->slots = slots;
+
+  // Later duplicates of a key stay in the entry array but cannot be found
+  for (uint64_t i = 0; i < manifest->nentries; i++)
+  {
+    if (manifest_find(manifest, manifest_key(manifest, i)) >= 0)
+    {
+      continue;
+    }
+    for (slot = entries[i].hash & mask; slots[slot] != 0; slot = (slot + 1) & mask)
+      ;
+    slots[slot] = i + 1;
+  }
+
+  return manifest;
+}
+
+/* Writing ================================================================= */
+
+static int write_all(int fd, const void *data, size_t len)
+{
+  ssize_t n;
+
+  while (len > 0)
+  {
+    if ((n = write(fd, data, len)) < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      return -1;
+    }
+    data = (const char *)data + n;
+    len -= n;
+  }
+  return 0;
+}
+
+int manifest_write(const manifest_t *manifest, const char *path)
+{
+  manifest_header_t header;
+  char tmp[4096], pad[8] = {0};
+  size_t slots_len = manifest->nslots * sizeof(manifest_slot_t);
+  int fd, err;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MANIFEST_MAGIC, sizeof(header.magic));
+  header.nentries = manifest->nentries;
+  header.nslots = manifest->nslots;
+  header.entries_off = sizeof(header);
+  header.slots_off = header.entries_off + manifest->nentries * sizeof(manifest_entry_t);
+  header.strings_off = (header.slots_off + slots_len + 7) & ~7ULL;
+  header.strings_len = manifest->strings_len;
+
+  // Servers that have the old manifest mapped keep it until they unmap it
+  snprintf(tmp, sizeof(tmp), "%s.tmp.%d", path, getpid());
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+  {
+    return -1;
+  }
+
+  if (write_all(fd, &header, sizeof(header)) < 0 ||
+      write_all(fd, manifest->entries, manifest->nentries * sizeof(manifest_entry_t)) < 0 ||
+      write_all(fd, manifest->slots, slots_len) < 0 ||
+      write_all(fd, pad, header.strings_off - header.slots_off - slots_len) < 0 ||
+      write_all(fd, manifest->strings, manifest->strings_len) < 0 || fsync(fd) < 0)
+  {
+    err = errno;
+    close(fd);
+    unlink(tmp);
+    errno = err;
+    return -1;
+  }
+
+  if (close(fd) < 0 || rename(tmp, path) < 0)
+  {
+    err = errno;
+    unlink(tmp);
+    errno = err;
+    return -1;
+  }
+
+  return 0;
+}
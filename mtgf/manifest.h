@@ -0,0 +1,73 @@
+#ifndef __MANIFEST_H__
+#define __MANIFEST_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * A content map compiled into one file that the server maps into memory
+ * instead of parsing: a header, an array of entries, an open-addressing
+ * hash table of entry numbers and a table of NUL-terminated strings.  All
+ * offsets are in bytes from the start of the file.  Several servers mapping
+ * the same manifest share its pages.
+ */
+#define MANIFEST_MAGIC "GFMANIF1"
+
+typedef struct manifest_header_t
+{
+  char magic[8];
+  uint64_t nentries;
+  uint64_t nslots; // a power of two, at least twice nentries
+  uint64_t entries_off, slots_off, strings_off, strings_len;
+} manifest_header_t;
+
+typedef struct manifest_entry_t
+{
+  uint64_t hash; // of the key
+  int64_t size;  // -1 if not known
+  uint64_t key_off, path_off;
+} manifest_entry_t;
+
+/*
+ * Slots hold an entry number plus one, or 0 when empty, and are probed
+ * linearly from the key's hash.
+ */
+typedef uint32_t manifest_slot_t;
+
+typedef struct manifest_t manifest_t;
+
+uint64_t manifest_hash(const char *key);
+
+/*
+ * Maps a compiled manifest.  Returns NULL with errno set to EINVAL if the
+ * file is not a manifest, to EBADMSG if it is a damaged one, or to
+ * whatever else prevented reading it.
+ */
+manifest_t *manifest_open(const char *path);
+
+/*
+ * Compiles a text content map in memory.  With stat_sizes, sizes come from
+ * previous where it has an entry with the same key and path and from
+ * stat otherwise; without, they are left unknown.  Returns NULL with errno
+ * set if the map cannot be read.
+ */
+manifest_t *manifest_build(const char *content_map, const manifest_t *previous, int stat_sizes);
+
+/* Writes a manifest to path, replacing any file there atomically. */
+int manifest_write(const manifest_t *manifest, const char *path);
+
+/* Returns the entry number of key, or -1 if there is none. */
+ssize_t manifest_find(const manifest_t *manifest, const char *key);
+
+size_t manifest_count(const manifest_t *manifest);
+const char *manifest_key(const manifest_t *manifest, size_t index);
+const char *manifest_path(const manifest_t *manifest, size_t index);
+ssize_t manifest_size(const manifest_t *manifest, size_t index);
+
+/* Sizes an incremental build took from previous and looked up itself. */
+void manifest_build_stats(const manifest_t *manifest, size_t *reused, size_t *statted);
+
+void manifest_close(manifest_t *manifest);
+
+#endif
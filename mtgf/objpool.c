@@ -0,0 +1,270 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "objpool.h"
+#include "log.h"
+
+#define OBJPOOL_MAX 8
+
+//
+//  A free object.  The first object of a batch in the depot also links
+//  to the next batch and records how many objects its own chain holds.
+//
+typedef struct obj_t
+{
+  struct obj_t *next;
+  struct obj_t *next_batch;
+  size_t count;
+} obj_t;
+
+typedef struct slab_t
+{
+  struct slab_t *next;
+} slab_t;
+
+struct objpool_t
+{
+  const char *name;
+  size_t size, align;
+  int id;
+  pthread_mutex_t mutex;
+  obj_t *depot;
+  slab_t *slabs;
+  unsigned long nslabs, nreserved, batches_in, batches_out;
+};
+
+typedef struct objpool_cache_t
+{
+  obj_t *head;
+  size_t count;
+} objpool_cache_t;
+
+static pthread_mutex_t pools_mutex = PTHREAD_MUTEX_INITIALIZER;
+static objpool_t *pools[OBJPOOL_MAX];
+static int npools;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t exit_key;
+static __thread objpool_cache_t caches[OBJPOOL_MAX];
+static __thread int registered = 0;
+
+static void depot_push(objpool_t *pool, obj_t *head, size_t count)
+{
+  head->count = count;
+  pthread_mutex_lock(&pool->mutex);
+  head->next_batch = pool->depot;
+  pool->depot = head;
+  pool->batches_in++;
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+// Hands what an exiting thread still holds back to the depots
+static void thread_exit(void *arg)
+{
+  pthread_mutex_lock(&pools_mutex);
+  for (int i = 0; i < npools; i++)
+  {
+    if (pools[i] != NULL && caches[i].head != NULL)
+    {
+      depot_push(pools[i], caches[i].head, caches[i].count);
+      caches[i].head = NULL;
+      caches[i].count = 0;
+    }
+  }
+  pthread_mutex_unlock(&pools_mutex);
+}
+
+static void make_key()
+{
+  pthread_key_create(&exit_key, thread_exit);
+}
+
+objpool_t *objpool_create_aligned(const char *name, size_t size, size_t align)
+{
+  objpool_t *pool = calloc(1, sizeof(objpool_t));
+
+  pthread_once(&key_once, make_key);
+  pool->name = name;
+  pool->align = align < 16 ? 16 : align;
+  pool->size = ((size < sizeof(obj_t) ? sizeof(obj_t) : size) + pool->align - 1) & ~(pool->align - 1);
+  pthread_mutex_init(&pool->mutex, NULL);
+
+  pthread_mutex_lock(&pools_mutex);
+  if (npools == OBJPOOL_MAX)
+  {
+    pthread_mutex_unlock(&pools_mutex);
+    L(ERROR, "objpool: too many pools for %s", name);
+    exit(EXIT_FAILURE);
+  }
+  pool->id = npools;
+  pools[npools++] = pool;
+  pthread_mutex_unlock(&pools_mutex);
+  return pool;
+}
+
+objpool_t *objpool_create(const char *name, size_t size)
+{
+  return objpool_create_aligned(name, size, 16);
+}
+
+// Carves a new slab into a chain of OBJPOOL_BATCH objects
+static obj_t *new_slab(objpool_t *pool)
+{
+  obj_t *head = NULL, *obj;
+  void *slab;
+  char *base;
+
+  // One alignment unit ahead of the objects holds the slab's link
+  if (posix_memalign(&slab, pool->align, pool->align + OBJPOOL_BATCH * pool->size) != 0)
+  {
+    return NULL;
+  }
+  base = (char *)slab + pool->align;
+  for (int i = OBJPOOL_BATCH - 1; i >= 0; i--)
+  {
+    obj = (obj_t *)(base + i * pool->size);
+    obj->next = head;
+    head = obj;
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  ((slab_t *)slab)->next = pool->slabs;
+  pool->slabs = slab;
+  pool->nslabs++;
+  pthread_mutex_unlock(&pool->mutex);
+  return head;
+}
+
+int objpool_reserve(objpool_t *pool, size_t count)
+{
+  obj_t *head;
+
+  for (size_t n = 0; n < count; n += OBJPOOL_BATCH)
+  {
+    if (NULL == (head = new_slab(pool)))
+    {
+      return -1;
+    }
+    head->count = OBJPOOL_BATCH;
+    pthread_mutex_lock(&pool->mutex);
+    head->next_batch = pool->depot;
+    pool->depot = head;
+    pool->nreserved++;
+    pthread_mutex_unlock(&pool->mutex);
+  }
+  return 0;
+}
+
+static int refill(objpool_t *pool, objpool_cache_t *cache)
+{
+  obj_t *obj;
+
+  if (!registered)
+  {
+    pthread_setspecific(exit_key, (void *)1);
+    registered = 1;
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  if (NULL != (obj = pool->depot))
+  {
+    pool->depot = obj->next_batch;
+    pool->batches_out++;
+    pthread_mutex_unlock(&pool->mutex);
+    cache->head = obj;
+    cache->count = obj->count;
+    return 0;
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  if (NULL == (cache->head = new_slab(pool)))
+  {
+    return -1;
+  }
+  cache->count = OBJPOOL_BATCH;
+  return 0;
+}
+
+void *objpool_get(objpool_t *pool)
+{
+  objpool_cache_t *cache = &caches[pool->id];
+  obj_t *obj;
+
+  if (cache->head == NULL && refill(pool, cache) < 0)
+  {
+    return NULL;
+  }
+
+  obj = cache->head;
+  cache->head = obj->next;
+  cache->count--;
+  memset(obj, 0, pool->size);
+  return obj;
+}
+
+void objpool_put(objpool_t *pool, void *ptr)
+{
+  objpool_cache_t *cache = &caches[pool->id];
+  obj_t *obj = ptr, *keep;
+
+  if (!registered)
+  {
+    pthread_setspecific(exit_key, (void *)1);
+    registered = 1;
+  }
+
+  obj->next = cache->head;
+  cache->head = obj;
+  if (++cache->count < 2 * OBJPOOL_BATCH)
+  {
+    return;
+  }
+
+  // Keep the most recently freed batch, which is the likeliest to be cached
+  keep = cache->head;
+  for (int i = 1; i < OBJPOOL_BATCH; i++)
+  {
+    keep = keep->next;
+  }
+  depot_push(pool, keep->next, cache->count - OBJPOOL_BATCH);
+  keep->next = NULL;
+  cache->count = OBJPOOL_BATCH;
+}
+
+void objpool_destroy(objpool_t *pool)
+{
+  slab_t *slab, *next;
+
+  pthread_mutex_lock(&pools_mutex);
+  pools[pool->id] = NULL;
+  pthread_mutex_unlock(&pools_mutex);
+
+  for (slab = pool->slabs; slab != NULL; slab = next)
+  {
+    next = slab->next;
+    free(slab);
+  }
+  pthread_mutex_destroy(&pool->mutex);
+  free(pool);
+}
+
+void objpool_report()
+{
+  for (int i = 0; i < npools; i++)
+  {
+    objpool_t *pool = pools[i];
+
+    if (pool != NULL && pool->nslabs > pool->nreserved)
+    {
+      L(INFO, "objpool %s: %lu heap allocations for %lu objects, %lu batches returned across threads, %lu reused",
+        pool->name, pool->nslabs - pool->nreserved, (pool->nslabs - pool->nreserved) * OBJPOOL_BATCH,
+        pool->batches_in, pool->batches_out);
+    }
+    if (pool != NULL && pool->nreserved > 0)
+    {
+      L(INFO, "objpool %s: %lu objects preallocated, %lu-byte aligned", pool->name, pool->nreserved * OBJPOOL_BATCH,
+        pool->align);
+    }
+  }
+}
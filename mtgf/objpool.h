@@ -0,0 +1,52 @@
+#ifndef __OBJPOOL_H__
+#define __OBJPOOL_H__
+
+#include <stddef.h>
+
+/*
+ * Pools of fixed-size objects for the request path, so that a steady
+ * stream of requests costs no malloc or free.  Each thread keeps its own
+ * free list per pool.  Objects freed on another thread than the one that
+ * took them, as with requests handed from the boss to a worker, go back
+ * to the taking thread in batches through a shared depot: a thread whose
+ * list grows past two batches hands one batch over under the pool's lock,
+ * and a thread that runs dry takes one.  Only when the depot is empty too
+ * is a new slab allocated from the heap, which objpool_report counts.
+ */
+#define OBJPOOL_BATCH 32
+
+typedef struct objpool_t objpool_t;
+
+/* Creates a pool of objects of the given size, named for the report. */
+objpool_t *objpool_create(const char *name, size_t size);
+
+/*
+ * Like objpool_create, but every object starts on a multiple of align, a
+ * power of two, and takes a whole number of such units.  With the cache
+ * line size, objects used by different threads never share a line.
+ */
+objpool_t *objpool_create_aligned(const char *name, size_t size, size_t align);
+
+/*
+ * Allocates at least count objects up front into the shared depot, so
+ * that they need no heap allocation when first taken.  Returns 0, or -1
+ * if the memory cannot be allocated.
+ */
+int objpool_reserve(objpool_t *pool, size_t count);
+
+/* Returns a zeroed object, or NULL if a slab cannot be allocated. */
+void *objpool_get(objpool_t *pool);
+
+/* Returns an object to the pool.  Any thread may return any object. */
+void objpool_put(objpool_t *pool, void *obj);
+
+/*
+ * Frees every slab of the pool.  Only safe once no thread uses it; the
+ * objects cached by threads that are still running go with it.
+ */
+void objpool_destroy(objpool_t *pool);
+
+/* Logs the heap allocations and batch transfers of every pool. */
+void objpool_report();
+
+#endif
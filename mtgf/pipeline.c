@@ -0,0 +1,687 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "gfserver-student.h"
+#include "sched.h"
+#include "storage.h"
+#include "pipeline.h"
+#include "pool.h"
+#include "affinity.h"
+#include "objpool.h"
+#include "wheel.h"
+#include "log.h"
+
+#define PIPELINE_EVENTS 64
+#define PIPELINE_SHAPE_SLOTS 256
+
+extern pthread_mutex_t gfs_mutex;
+extern pthread_cond_t gfs_cond;
+extern sched_t *queue;
+extern storage_t *store;
+extern objpool_t *request_pool;
+
+typedef struct pl_buf_t pl_buf_t;
+
+//
+//  One response moving through the pipeline.  The storage stage owns the
+//  read side and the network stage owns the connection; the fields they
+//  share are guarded by gfs_mutex, and the transfer is freed by whichever
+//  stage lets go of it last.
+//
+typedef struct pl_xfer_t
+{
+  gfcontext_t *ctx;
+  int handle;
+  size_t file_len;
+  int lane;
+  int net;
+
+  // Guarded by gfs_mutex
+  size_t read_off;
+  int inflight; // chunks read but not yet released by the network stage
+  int reading;  // queued for, or being read by, the storage stage
+  int finished; // the network stage is done with the connection
+  struct pl_xfer_t *next_read; // on readq
+
+  // Owned by the network thread
+  int polling;
+  int parked; // waiting out a bandwidth limit on the network thread's wheel
+  pl_buf_t *head, *tail;
+  uint64_t deadline; // while polling, when to give up on the client
+  struct pl_xfer_t *prev_stall, *next_stall;
+  wheel_timer_t timer; // while parked
+} pl_xfer_t;
+
+struct pl_buf_t
+{
+  pl_buf_t *next;
+  pl_xfer_t *xfer;
+  ssize_t len; // -1 reports a read error to the network stage
+  size_t off;
+  char *data;
+};
+
+typedef struct pl_net_t
+{
+  pthread_t thread;
+  int epfd, efd;
+  pthread_mutex_t mutex;
+  pl_buf_t *head, *tail; // chunks handed over by the storage stage
+  pl_xfer_t *stall_head, *stall_tail; // polling transfers, earliest deadline first
+  wheel_t wheel; // parked transfers, in 1 ms ticks
+  unsigned long timeouts;
+  unsigned long parks;
+} pl_net_t;
+
+static pl_buf_t *pool;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+
+// Transfers with chunks to read, guarded by gfs_mutex
+static pl_xfer_t *readq_head, *readq_tail;
+static objpool_t *xfer_pool;
+static pl_net_t *nets;
+static size_t nnets;
+
+static unsigned long pool_waits;
+static unsigned long send_blocks;
+static uint64_t write_timeout; // ns, 0 waits for a stalled client forever
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void xfer_free(pl_xfer_t *xfer)
+{
+  storage_close(store, xfer->handle);
+  objpool_put(xfer_pool, xfer);
+}
+
+// A transfer is on readq at most once, while its reading flag is set
+static void readq_push(pl_xfer_t *xfer)
+{
+  xfer->next_read = NULL;
+  *(readq_tail != NULL ? &readq_tail->next_read : &readq_head) = xfer;
+  readq_tail = xfer;
+}
+
+static pl_xfer_t *readq_pop()
+{
+  pl_xfer_t *xfer = readq_head;
+
+  if (NULL == (readq_head = xfer->next_read))
+  {
+    readq_tail = NULL;
+  }
+  return xfer;
+}
+
+static pl_buf_t *buf_get()
+{
+  pl_buf_t *buf;
+
+  pthread_mutex_lock(&pool_mutex);
+  if (pool == NULL)
+  {
+    pool_waits++;
+  }
+  while (pool == NULL)
+  {
+    pthread_cond_wait(&pool_cond, &pool_mutex);
+  }
+  buf = pool;
+  pool = buf->next;
+  pthread_mutex_unlock(&pool_mutex);
+
+  buf->next = NULL;
+  buf->off = 0;
+  return buf;
+}
+
+static void buf_put(pl_buf_t *buf)
+{
+  pthread_mutex_lock(&pool_mutex);
+  buf->next = pool;
+  pool = buf;
+  pthread_mutex_unlock(&pool_mutex);
+  pthread_cond_signal(&pool_cond);
+}
+
+// A finished large transfer may let a queued one start
+static void finish_lane(int lane)
+{
+  int wake;
+
+  pthread_mutex_lock(&gfs_mutex);
+  wake = sched_finish(queue, lane);
+  pthread_mutex_unlock(&gfs_mutex);
+  if (wake)
+  {
+    pthread_cond_signal(&gfs_cond);
+  }
+}
+
+/* Network stage =========================================================== */
+
+//
+//  Every transfer waiting for its socket to drain gets the same timeout,
+//  so appending keeps the stall list in deadline order.
+//
+static void stall_add(pl_net_t *net, pl_xfer_t *xfer)
+{
+  xfer->deadline = now_ns() + write_timeout;
+  xfer->next_stall = NULL;
+  xfer->prev_stall = net->stall_tail;
+  *(net->stall_tail != NULL ? &net->stall_tail->next_stall : &net->stall_head) = xfer;
+  net->stall_tail = xfer;
+}
+
+static void stall_remove(pl_net_t *net, pl_xfer_t *xfer)
+{
+  *(xfer->prev_stall != NULL ? &xfer->prev_stall->next_stall : &net->stall_head) = xfer->next_stall;
+  *(xfer->next_stall != NULL ? &xfer->next_stall->prev_stall : &net->stall_tail) = xfer->prev_stall;
+}
+
+// Stops polling a transfer's socket
+static void unpoll(pl_net_t *net, pl_xfer_t *xfer)
+{
+  epoll_ctl(net->epfd, EPOLL_CTL_DEL, gfs_getfd(&xfer->ctx), NULL);
+  xfer->polling = 0;
+  if (write_timeout > 0)
+  {
+    stall_remove(net, xfer);
+  }
+}
+
+static void net_push(pl_net_t *net, pl_buf_t *buf)
+{
+  uint64_t one = 1;
+  int was_empty;
+
+  pthread_mutex_lock(&net->mutex);
+  was_empty = net->head == NULL;
+  if (was_empty)
+  {
+    net->head = buf;
+  }
+  else
+  {
+    net->tail->next = buf;
+  }
+  net->tail = buf;
+  pthread_mutex_unlock(&net->mutex);
+
+  if (was_empty && write(net->efd, &one, sizeof(one)) < 0)
+  {
+    L(WARN, "pipeline: eventfd write: %s", strerror(errno));
+  }
+}
+
+// Returns a sent chunk to the pool and lets the storage stage read ahead
+static void chunk_done(pl_xfer_t *xfer, pl_buf_t *buf)
+{
+  int wake = 0, done;
+
+  buf_put(buf);
+
+  pthread_mutex_lock(&gfs_mutex);
+  xfer->inflight--;
+  if (!xfer->finished && !xfer->reading && xfer->read_off < xfer->file_len)
+  {
+    xfer->reading = 1;
+    readq_push(xfer);
+    wake = 1;
+  }
+  done = xfer->finished && !xfer->reading && xfer->inflight == 0;
+  pthread_mutex_unlock(&gfs_mutex);
+
+  if (wake)
+  {
+    pthread_cond_signal(&gfs_cond);
+  }
+  if (done)
+  {
+    xfer_free(xfer);
+  }
+}
+
+// Ends the response, aborting it if it is incomplete
+static void finish(pl_xfer_t *xfer)
+{
+  pl_buf_t *buf = xfer->head, *next;
+  int count = 0, done;
+
+  if (xfer->ctx != NULL)
+  {
+    gfs_abort(&xfer->ctx);
+  }
+  xfer->head = xfer->tail = NULL;
+
+  for (next = buf; next != NULL; next = next->next)
+  {
+    count++;
+  }
+
+  pthread_mutex_lock(&gfs_mutex);
+  xfer->finished = 1;
+  xfer->inflight -= count;
+  done = !xfer->reading && xfer->inflight == 0;
+  pthread_mutex_unlock(&gfs_mutex);
+
+  for (; buf != NULL; buf = next)
+  {
+    next = buf->next;
+    buf_put(buf);
+  }
+
+  finish_lane(xfer->lane);
+  if (done)
+  {
+    xfer_free(xfer);
+  }
+}
+
+//
+//  Sending is never throttled by sleeping here, which would hold up every
+//  other connection on the thread.  A transfer that has used up its
+//  bandwidth instead sits on the wheel until its limit lets it send again.
+//
+static void flush(pl_net_t *net, pl_xfer_t *xfer)
+{
+  struct epoll_event ev;
+  pl_buf_t *buf;
+  uint64_t delay;
+  ssize_t n;
+  int partial;
+
+  while ((buf = xfer->head) != NULL)
+  {
+    if (buf->len < 0 || (n = gfs_trysend(&xfer->ctx, buf->data + buf->off, buf->len - buf->off)) < 0)
+    {
+      finish(xfer);
+      return;
+    }
+
+    // The library closes the connection once the whole body is out
+    buf->off += n;
+    if (xfer->ctx == NULL)
+    {
+      finish(xfer);
+      return;
+    }
+
+    // A sent buffer is retired first, so that a parked transfer resumes
+    // with data to send rather than an empty send
+    if (!(partial = buf->off < buf->len))
+    {
+      xfer->head = buf->next;
+      if (xfer->head == NULL)
+      {
+        xfer->tail = NULL;
+      }
+      chunk_done(xfer, buf);
+    }
+
+    if ((delay = gfs_send_delay(&xfer->ctx)) > 0)
+    {
+      net->parks++;
+      xfer->parked = 1;
+      wheel_add(&net->wheel, &xfer->timer, (delay + 999999) / 1000000, xfer);
+      return;
+    }
+
+    if (partial)
+    {
+      send_blocks++;
+      ev.events = EPOLLOUT;
+      ev.data.ptr = xfer;
+      if (epoll_ctl(net->epfd, EPOLL_CTL_ADD, gfs_getfd(&xfer->ctx), &ev) < 0)
+      {
+        L(WARN, "pipeline: epoll_ctl: %s", strerror(errno));
+        finish(xfer);
+        return;
+      }
+      xfer->polling = 1;
+      if (write_timeout > 0)
+      {
+        stall_add(net, xfer);
+      }
+      return;
+    }
+  }
+}
+
+static void resume(void *data)
+{
+  pl_xfer_t *xfer = data;
+
+  xfer->parked = 0;
+  flush(&nets[xfer->net], xfer);
+}
+
+static void drain_inbox(pl_net_t *net)
+{
+  pl_buf_t *buf, *next;
+  pl_xfer_t *xfer;
+  uint64_t count;
+
+  // Clear the eventfd before taking the list so that no wakeup is lost
+  if (read(net->efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+  {
+    L(WARN, "pipeline: eventfd read: %s", strerror(errno));
+  }
+
+  pthread_mutex_lock(&net->mutex);
+  buf = net->head;
+  net->head = net->tail = NULL;
+  pthread_mutex_unlock(&net->mutex);
+
+  for (; buf != NULL; buf = next)
+  {
+    next = buf->next;
+    buf->next = NULL;
+    xfer = buf->xfer;
+
+    if (xfer->finished)
+    {
+      chunk_done(xfer, buf);
+      continue;
+    }
+
+    if (xfer->head == NULL)
+    {
+      xfer->head = buf;
+    }
+    else
+    {
+      xfer->tail->next = buf;
+    }
+    xfer->tail = buf;
+
+    if (!xfer->polling && !xfer->parked)
+    {
+      flush(net, xfer);
+    }
+  }
+}
+
+// Aborts the transfers whose clients have not taken any data in time
+static int expire_stalls(pl_net_t *net)
+{
+  uint64_t now = now_ns();
+  pl_xfer_t *xfer;
+
+  while ((xfer = net->stall_head) != NULL && xfer->deadline <= now)
+  {
+    L(DEBUG, "pipeline: client took nothing for %lu ms, aborting", (unsigned long)(write_timeout / 1000000));
+    net->timeouts++;
+    unpoll(net, xfer);
+    finish(xfer);
+  }
+
+  // Round up so that the next wait does not end just short of the deadline
+  return xfer == NULL ? -1 : (int)((xfer->deadline - now + 999999) / 1000000);
+}
+
+static void *network_worker(void *arg)
+{
+  pl_net_t *net = arg;
+  struct epoll_event events[PIPELINE_EVENTS];
+  pl_xfer_t *xfer;
+  int n, timeout = -1, stall_timeout = -1, shape_timeout;
+
+  affinity_thread("network", 1);
+  while (1)
+  {
+    if ((n = epoll_wait(net->epfd, events, PIPELINE_EVENTS, timeout)) < 0)
+    {
+      if (errno != EINTR)
+      {
+        L(ERROR, "pipeline: epoll_wait: %s", strerror(errno));
+      }
+      continue;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+      if ((xfer = events[i].data.ptr) == NULL)
+      {
+        drain_inbox(net);
+        continue;
+      }
+
+      unpoll(net, xfer);
+      flush(net, xfer);
+    }
+
+    wheel_expire(&net->wheel, resume);
+    if (write_timeout > 0)
+    {
+      stall_timeout = expire_stalls(net);
+    }
+
+    // Whichever comes first of a stalled client's deadline and a parked transfer's turn
+    shape_timeout = wheel_timeout(&net->wheel);
+    timeout = stall_timeout < 0 || (shape_timeout >= 0 && shape_timeout < stall_timeout) ? shape_timeout
+                                                                                         : stall_timeout;
+  }
+
+  return NULL;
+}
+
+/* Storage stage =========================================================== */
+
+static pl_xfer_t *start(gfs_queue_ctx *req, int lane)
+{
+  pl_xfer_t *xfer;
+  ssize_t file_len;
+  int handle;
+
+  L(DEBUG, "processing request for %s", req->path);
+  if ((file_len = gfs_start_transfer(&req->ctx, req->path, &handle)) <= 0)
+  {
+    finish_lane(lane);
+    return NULL;
+  }
+
+  // The header has gone out, so all that is left is to drop the client
+  if (NULL == (xfer = objpool_get(xfer_pool)))
+  {
+    L(ERROR, "unable to allocate a transfer for %s", req->path);
+    gfs_abort(&req->ctx);
+    storage_close(store, handle);
+    finish_lane(lane);
+    return NULL;
+  }
+  xfer->ctx = req->ctx;
+  xfer->handle = handle;
+  xfer->file_len = file_len;
+  xfer->lane = lane;
+  xfer->net = gfs_getfd(&req->ctx) % nnets;
+  xfer->reading = 1;
+  return xfer;
+}
+
+static void read_chunk(pl_xfer_t *xfer)
+{
+  pl_buf_t *buf;
+  size_t off, want;
+  ssize_t len = 0;
+  int again = 0, done = 0;
+
+  pthread_mutex_lock(&gfs_mutex);
+  off = xfer->read_off;
+  if (!xfer->finished)
+  {
+    pthread_mutex_unlock(&gfs_mutex);
+
+    buf = buf_get();
+    buf->xfer = xfer;
+    want = xfer->file_len - off < PIPELINE_CHUNK ? xfer->file_len - off : PIPELINE_CHUNK;
+    if ((len = storage_read(store, xfer->handle, buf->data, want, off)) <= 0)
+    {
+      L(WARN, "error reading file at offset %zu", off);
+      len = -1;
+    }
+    buf->len = len;
+
+    // Hand the chunk over before queueing the next read, which another
+    // storage thread could otherwise deliver first
+    pthread_mutex_lock(&gfs_mutex);
+    xfer->inflight++;
+    if (len > 0)
+    {
+      xfer->read_off += len;
+    }
+    pthread_mutex_unlock(&gfs_mutex);
+    net_push(&nets[xfer->net], buf);
+
+    pthread_mutex_lock(&gfs_mutex);
+  }
+
+  if (len > 0 && !xfer->finished && xfer->read_off < xfer->file_len &&
+      xfer->inflight < PIPELINE_READAHEAD)
+  {
+    readq_push(xfer);
+    again = 1;
+  }
+  else
+  {
+    xfer->reading = 0;
+    done = xfer->finished && xfer->inflight == 0;
+  }
+  pthread_mutex_unlock(&gfs_mutex);
+
+  if (again)
+  {
+    pthread_cond_signal(&gfs_cond);
+  }
+  if (done)
+  {
+    xfer_free(xfer);
+  }
+}
+
+static void *storage_worker(void *arg)
+{
+  while (1)
+  {
+    gfs_queue_ctx *req = NULL;
+    pl_xfer_t *xfer = NULL;
+    int lane;
+
+    // Reads for transfers already under way come before new requests
+    pthread_mutex_lock(&gfs_mutex);
+    while (readq_head == NULL && !sched_ready(queue))
+    {
+      if (!pool_wait())
+      {
+        pthread_mutex_unlock(&gfs_mutex);
+        return NULL;
+      }
+    }
+    if (readq_head != NULL)
+    {
+      xfer = readq_pop();
+    }
+    else
+    {
+      req = sched_dequeue(queue, &lane);
+      pool_check(sched_size(queue));
+    }
+    pthread_mutex_unlock(&gfs_mutex);
+
+    if (req != NULL)
+    {
+      xfer = start(req, lane);
+      objpool_put(request_pool, req);
+    }
+
+    if (xfer != NULL)
+    {
+      read_chunk(xfer);
+    }
+  }
+
+  return NULL;
+}
+
+void pipeline_init(size_t nstorage, size_t nnetwork, size_t nbuffers, unsigned long timeout_ms)
+{
+  struct epoll_event ev;
+  pl_buf_t *bufs;
+  char *slab;
+
+  bufs = calloc(nbuffers, sizeof(pl_buf_t));
+  slab = affinity_alloc(nbuffers * PIPELINE_CHUNK);
+  for (size_t i = 0; i < nbuffers; i++)
+  {
+    bufs[i].data = slab + i * PIPELINE_CHUNK;
+    bufs[i].next = pool;
+    pool = &bufs[i];
+  }
+
+  xfer_pool = objpool_create("pl_xfer_t", sizeof(pl_xfer_t));
+  write_timeout = timeout_ms * 1000000ULL;
+
+  nnets = nnetwork;
+  nets = calloc(nnets, sizeof(pl_net_t));
+  for (size_t i = 0; i < nnets; i++)
+  {
+    nets[i].epfd = epoll_create1(0);
+    nets[i].efd = eventfd(0, EFD_NONBLOCK);
+    if (nets[i].epfd < 0 || nets[i].efd < 0)
+    {
+      L(ERROR, "pipeline: unable to create epoll or eventfd: %s", strerror(errno));
+      exit(1);
+    }
+    pthread_mutex_init(&nets[i].mutex, NULL);
+    wheel_init(&nets[i].wheel, PIPELINE_SHAPE_SLOTS, 1);
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(nets[i].epfd, EPOLL_CTL_ADD, nets[i].efd, &ev);
+
+    if (pthread_create(&nets[i].thread, NULL, network_worker, &nets[i]) != 0)
+    {
+      L(ERROR, "Can't create network thread %zu", i);
+      exit(1);
+    }
+  }
+
+  pool_start(storage_worker, nstorage);
+
+  L(DEBUG, "pipeline: %zu storage threads, %zu network threads, %zu x %d KB buffers",
+    nstorage, nnetwork, nbuffers, PIPELINE_CHUNK / 1024);
+}
+
+void pipeline_report()
+{
+  unsigned long timeouts = 0, parks = 0;
+
+  if (nnets > 0)
+  {
+    for (size_t i = 0; i < nnets; i++)
+    {
+      timeouts += nets[i].timeouts;
+      parks += nets[i].parks;
+    }
+    L(INFO, "pipeline: storage waited for a buffer %lu times, sends blocked %lu times, %lu stalled clients aborted",
+      pool_waits, send_blocks, timeouts);
+    if (parks > 0)
+    {
+      L(INFO, "pipeline: transfers parked %lu times for bandwidth limits", parks);
+    }
+  }
+}
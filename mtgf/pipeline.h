@@ -0,0 +1,34 @@
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#include <stddef.h>
+
+#define PIPELINE_CHUNK (64 * 1024)
+#define PIPELINE_READAHEAD 4
+
+/*
+ * A two-stage alternative to workers that each read and send a whole file.
+ *
+ * Storage threads take requests from the scheduler, look them up and read
+ * them into buffers from a fixed pool, at most PIPELINE_READAHEAD chunks
+ * ahead of what has been sent.  Network threads drain the buffers to the
+ * sockets with nonblocking sends, each polling its own connections with
+ * epoll, and return them to the pool.  A slow disk therefore only holds up
+ * storage threads, and a slow client only holds up its buffers.  The pool
+ * bounds the data queued between the stages: when it runs out, storage
+ * threads wait until the network stage has caught up.
+ */
+
+/*
+ * Starts nstorage storage threads, as the pool's initial threads, and
+ * nnetwork network threads.  A response whose client takes no data for
+ * timeout_ms while the network stage has some waiting for it is aborted,
+ * freeing its buffers and its share of the large-file threads; 0 waits
+ * for as long as the connection lasts.
+ */
+void pipeline_init(size_t nstorage, size_t nnetwork, size_t nbuffers, unsigned long timeout_ms);
+
+/* Logs how often each stage had to wait for the other. */
+void pipeline_report();
+
+#endif
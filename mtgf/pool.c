@@ -0,0 +1,222 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "pool.h"
+#include "sched.h"
+#include "affinity.h"
+#include "log.h"
+
+extern pthread_mutex_t gfs_mutex;
+extern pthread_cond_t gfs_cond;
+extern sched_t *queue;
+
+// All guarded by gfs_mutex
+static void *(*pool_body)(void *);
+static int pool_min, pool_max_threads, pool_grow_depth;
+static uint64_t pool_grow_wait_ns, pool_idle_ns;
+static int nthreads, nidle, nstarting, peak;
+static uint64_t starved_since; // since when requests have queued with no thread idle
+static unsigned long grown, shrunk;
+static pthread_cond_t monitor_cond = PTHREAD_COND_INITIALIZER; // starvation has begun
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *pool_thread(void *arg)
+{
+  pthread_mutex_lock(&gfs_mutex);
+  nstarting--;
+  pthread_mutex_unlock(&gfs_mutex);
+
+  affinity_thread("worker", 1);
+
+  return pool_body(arg);
+}
+
+static int spawn()
+{
+  pthread_attr_t attr;
+  pthread_t thread;
+  int res;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  res = pthread_create(&thread, &attr, pool_thread, NULL);
+  pthread_attr_destroy(&attr);
+  if (res != 0)
+  {
+    L(WARN, "pool: unable to start a thread: %s", strerror(res));
+    return -1;
+  }
+
+  nthreads++;
+  nstarting++;
+  if (nthreads > peak)
+  {
+    peak = nthreads;
+  }
+  return 0;
+}
+
+void pool_init(int min, int max, int grow_depth, unsigned long grow_wait_ms, unsigned long idle_ms)
+{
+  pool_min = min;
+  pool_max_threads = max > min ? max : min;
+  pool_grow_depth = grow_depth > 0 ? grow_depth : 1;
+  pool_grow_wait_ns = grow_wait_ms * 1000000ULL;
+  pool_idle_ns = idle_ms * 1000000ULL;
+
+  if (pool_max_threads > pool_min)
+  {
+    L(INFO, "pool: %d to %d threads, growing at %d queued or after %lu ms, idle threads exit after %lu ms",
+      pool_min, pool_max_threads, pool_grow_depth, grow_wait_ms, idle_ms);
+  }
+}
+
+//
+//  Requests that queue while every thread is busy only call pool_check as
+//  they arrive.  Once none arrive and no thread finishes, because all are
+//  blocked, this re-evaluates growth every grow_wait until the
+//  starvation ends or the pool is full.
+//
+static void *pool_monitor(void *arg)
+{
+  struct timespec deadline;
+
+  pthread_mutex_lock(&gfs_mutex);
+  while (1)
+  {
+    if (starved_since == 0 || nthreads >= pool_max_threads)
+    {
+      pthread_cond_wait(&monitor_cond, &gfs_mutex);
+      continue;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += pool_grow_wait_ns / 1000000000ULL;
+    deadline.tv_nsec += pool_grow_wait_ns % 1000000000ULL;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&monitor_cond, &gfs_mutex, &deadline);
+    pool_check(sched_size(queue));
+  }
+
+  return NULL;
+}
+
+void pool_start(void *(*body)(void *), int n)
+{
+  pthread_t monitor;
+
+  pool_body = body;
+
+  if (pool_max_threads > pool_min && pool_grow_wait_ns > 0 &&
+      pthread_create(&monitor, NULL, pool_monitor, NULL) == 0)
+  {
+    pthread_detach(monitor);
+  }
+
+  pthread_mutex_lock(&gfs_mutex);
+  for (int i = 0; i < n; i++)
+  {
+    if (spawn() < 0)
+    {
+      L(ERROR, "Can't create thread %d", i);
+      exit(1);
+    }
+  }
+  pthread_mutex_unlock(&gfs_mutex);
+}
+
+int pool_wait()
+{
+  struct timespec deadline;
+  int res;
+
+  nidle++;
+  if (nthreads <= pool_min)
+  {
+    pthread_cond_wait(&gfs_cond, &gfs_mutex);
+    nidle--;
+    return 1;
+  }
+
+  // Condition variables time out against the real-time clock by default
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += pool_idle_ns / 1000000000ULL;
+  deadline.tv_nsec += pool_idle_ns % 1000000000ULL;
+  if (deadline.tv_nsec >= 1000000000L)
+  {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  res = pthread_cond_timedwait(&gfs_cond, &gfs_mutex, &deadline);
+  nidle--;
+  if (res != ETIMEDOUT || nthreads <= pool_min)
+  {
+    return 1;
+  }
+
+  nthreads--;
+  shrunk++;
+  L(DEBUG, "pool: idle thread exiting, %d left", nthreads);
+
+  // The timeout may have swallowed a signal meant for another thread
+  pthread_cond_signal(&gfs_cond);
+  return 0;
+}
+
+void pool_check(int depth)
+{
+  uint64_t now;
+
+  if (depth == 0 || nidle > 0)
+  {
+    starved_since = 0;
+    return;
+  }
+
+  now = now_ns();
+  if (starved_since == 0)
+  {
+    starved_since = now;
+    pthread_cond_signal(&monitor_cond);
+  }
+
+  // One thread at a time, so that a burst does not start max before any runs
+  if (nstarting > 0 || nthreads >= pool_max_threads ||
+      (depth < pool_grow_depth && (pool_grow_wait_ns == 0 || now - starved_since < pool_grow_wait_ns)))
+  {
+    return;
+  }
+
+  if (spawn() == 0)
+  {
+    grown++;
+    L(DEBUG, "pool: grew to %d threads, %d queued for %.3f ms", nthreads, depth, (now - starved_since) / 1e6);
+    starved_since = now;
+  }
+}
+
+void pool_report()
+{
+  // Unlocked: this runs at exit, possibly interrupting a holder of gfs_mutex
+  if (pool_max_threads > pool_min)
+  {
+    L(INFO, "pool: %d threads (%d to %d), peak %d, grew %lu times, shrank %lu times", nthreads, pool_min,
+      pool_max_threads, peak, grown, shrunk);
+  }
+}
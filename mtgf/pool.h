@@ -0,0 +1,38 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+/*
+ * An elastic set of threads taking work from the scheduler, between min
+ * and max of them.  While requests are queued and no thread is idle, a
+ * thread is added once the queue is grow_depth deep or has gone
+ * grow_wait_ms without a thread to spare, one at a time.  A thread left
+ * idle for idle_ms exits while there are more than min.  With min equal
+ * to max this is a fixed pool.
+ *
+ * pool_wait and pool_check must be called with gfs_mutex held, and gfs_cond is the condition threads wait on.
+ */
+
+void pool_init(int min, int max, int grow_depth, unsigned long grow_wait_ms, unsigned long idle_ms);
+
+/* Starts n threads running body, which is also what added threads run. */
+void pool_start(void *(*body)(void *), int n);
+
+/*
+ * Waits on gfs_cond like pthread_cond_wait.  Returns 0 if the calling
+ * thread has been idle long enough to exit, in which case it must return
+ * from body without taking more work, and 1 otherwise.
+ */
+int pool_wait();
+
+/*
+ * Adds a thread if the pool is short of them, given the number of queued
+ * requests.  Called whenever a request is queued or taken, and by a
+ * monitor thread every grow_wait_ms while requests are starved, so that
+ * a pool whose threads are all blocked still grows.
+ */
+void pool_check(int depth);
+
+/* Logs the pool's size and how often it grew and shrank. */
+void pool_report();
+
+#endif
@@ -0,0 +1,577 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "sched.h"
+#include "log.h"
+
+#define SCHED_REPORT_FLOWS 16
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int entry_less(sched_entry_t *a, sched_entry_t *b)
+{
+  return a->size < b->size || (a->size == b->size && a->seq < b->seq);
+}
+
+static void entry_swap(sched_entry_t *a, sched_entry_t *b)
+{
+  sched_entry_t tmp = *a;
+
+  *a = *b;
+  *b = tmp;
+}
+
+static void record_wait(sched_stats_t *stats, uint64_t enqueued_ns)
+{
+  uint64_t wait = now_ns() - enqueued_ns;
+  uint64_t us = wait / 1000;
+  int bucket = 0;
+
+  while (us > 0 && bucket < SCHED_BUCKETS - 1)
+  {
+    us >>= 1;
+    bucket++;
+  }
+
+  stats->count++;
+  stats->total_ns += wait;
+  stats->buckets[bucket]++;
+  if (wait > stats->max_ns)
+  {
+    stats->max_ns = wait;
+  }
+}
+
+static int heap_push(sched_flow_t *flow, sched_entry_t *entry)
+{
+  sched_entry_t *small;
+  int i;
+
+  if (flow->nsmall == flow->small_cap)
+  {
+    if (NULL == (small = realloc(flow->small, sizeof(sched_entry_t) * flow->small_cap * 2)))
+    {
+      return -1;
+    }
+    flow->small = small;
+    flow->small_cap *= 2;
+  }
+
+  // Sift up
+  i = flow->nsmall++;
+  flow->small[i] = *entry;
+  while (i > 0 && entry_less(&flow->small[i], &flow->small[(i - 1) / 2]))
+  {
+    entry_swap(&flow->small[i], &flow->small[(i - 1) / 2]);
+    i = (i - 1) / 2;
+  }
+  return 0;
+}
+
+static void heap_pop(sched_flow_t *flow, sched_entry_t *entry)
+{
+  int i = 0, child;
+
+  *entry = flow->small[0];
+
+  // Sift down
+  flow->small[0] = flow->small[--flow->nsmall];
+  while ((child = 2 * i + 1) < flow->nsmall)
+  {
+    if (child + 1 < flow->nsmall && entry_less(&flow->small[child + 1], &flow->small[child]))
+    {
+      child++;
+    }
+    if (!entry_less(&flow->small[child], &flow->small[i]))
+    {
+      break;
+    }
+    entry_swap(&flow->small[child], &flow->small[i]);
+    i = child;
+  }
+}
+
+static unsigned int hash_key(const char *key)
+{
+  unsigned int hash = 2166136261u;
+
+  while (*key)
+  {
+    hash = (hash ^ (unsigned char)*key++) * 16777619u;
+  }
+
+  return hash;
+}
+
+// Rehashes every flow into nbuckets buckets, keeping the old table if out of memory
+static int resize(sched_t *sched, unsigned int nbuckets)
+{
+  sched_flow_t **buckets, *flow, *next;
+
+  if (NULL == (buckets = calloc(nbuckets, sizeof(sched_flow_t *))))
+  {
+    return -1;
+  }
+
+  for (unsigned int i = 0; i < sched->nbuckets; i++)
+  {
+    for (flow = sched->buckets[i]; flow != NULL; flow = next)
+    {
+      next = flow->next_bucket;
+      flow->next_bucket = buckets[flow->hash & (nbuckets - 1)];
+      buckets[flow->hash & (nbuckets - 1)] = flow;
+    }
+  }
+
+  free(sched->buckets);
+  sched->buckets = buckets;
+  sched->nbuckets = nbuckets;
+  return 0;
+}
+
+static void free_flow(sched_t *sched, sched_flow_t *flow)
+{
+  sched_flow_t **link = &sched->buckets[flow->hash & (sched->nbuckets - 1)];
+
+  while (*link != flow)
+  {
+    link = &(*link)->next_bucket;
+  }
+  *link = flow->next_bucket;
+
+  sched->retired++;
+  sched->retired_served += flow->served;
+  sched->retired_bytes += flow->bytes;
+  free(flow->small);
+  free(flow);
+
+  if (--sched->nflows < (int)sched->nbuckets / 4 && sched->nbuckets > SCHED_MIN_BUCKETS)
+  {
+    resize(sched, sched->nbuckets / 2);
+  }
+}
+
+static void idle_remove(sched_t *sched, sched_flow_t *flow)
+{
+  *(flow->prev_idle != NULL ? &flow->prev_idle->next_idle : &sched->idle_head) = flow->next_idle;
+  *(flow->next_idle != NULL ? &flow->next_idle->prev_idle : &sched->idle_tail) = flow->prev_idle;
+  flow->prev_idle = flow->next_idle = NULL;
+  sched->nidle--;
+}
+
+// Puts a flow with nothing queued on the idle list, freeing the oldest beyond the limit
+static void idle_add(sched_t *sched, sched_flow_t *flow)
+{
+  flow->next_idle = NULL;
+  flow->prev_idle = sched->idle_tail;
+  *(sched->idle_tail != NULL ? &sched->idle_tail->next_idle : &sched->idle_head) = flow;
+  sched->idle_tail = flow;
+
+  if (++sched->nidle > SCHED_IDLE_FLOWS)
+  {
+    flow = sched->idle_head;
+    idle_remove(sched, flow);
+    free_flow(sched, flow);
+  }
+}
+
+static sched_flow_t *find_flow(sched_t *sched, const char *key)
+{
+  unsigned int hash = hash_key(key);
+  sched_flow_t *flow;
+
+  if (sched->nbuckets == 0 && resize(sched, SCHED_MIN_BUCKETS) < 0)
+  {
+    return NULL;
+  }
+
+  for (flow = sched->buckets[hash & (sched->nbuckets - 1)]; flow != NULL; flow = flow->next_bucket)
+  {
+    if (strcmp(flow->key, key) == 0)
+    {
+      return flow;
+    }
+  }
+
+  if (NULL == (flow = calloc(1, sizeof(sched_flow_t))))
+  {
+    return NULL;
+  }
+  strncpy(flow->key, key, SCHED_KEYLEN - 1);
+  flow->hash = hash;
+  flow->small_cap = 4;
+  if (NULL == (flow->small = malloc(sizeof(sched_entry_t) * flow->small_cap)))
+  {
+    free(flow);
+    return NULL;
+  }
+
+  flow->next_bucket = sched->buckets[hash & (sched->nbuckets - 1)];
+  sched->buckets[hash & (sched->nbuckets - 1)] = flow;
+  if ((unsigned int)++sched->nflows > sched->nbuckets)
+  {
+    resize(sched, sched->nbuckets * 2);
+  }
+  idle_add(sched, flow);
+  return flow;
+}
+
+static void flow_key(const struct sockaddr *addr, char *key)
+{
+  const void *src = NULL;
+
+  if (addr != NULL && addr->sa_family == AF_INET)
+  {
+    src = &((const struct sockaddr_in *)addr)->sin_addr;
+  }
+  else if (addr != NULL && addr->sa_family == AF_INET6)
+  {
+    src = &((const struct sockaddr_in6 *)addr)->sin6_addr;
+  }
+
+  if (src == NULL || inet_ntop(addr->sa_family, src, key, SCHED_KEYLEN) == NULL)
+  {
+    strcpy(key, "unknown");
+  }
+}
+
+void sched_init(sched_t *sched, size_t small_limit, int large_max, size_t quantum)
+{
+  memset(sched, 0, sizeof(*sched));
+  sched->small_limit = small_limit;
+  sched->large_max = large_max < 1 ? 1 : large_max;
+  sched->quantum = quantum;
+  sched->nodes = objpool_create("sched_node_t", sizeof(sched_node_t));
+}
+
+int sched_enqueue(sched_t *sched, void *item, ssize_t size, const struct sockaddr *addr)
+{
+  sched_entry_t entry = {item, size < 0 ? 0 : size, sched->seq++, now_ns()};
+  sched_node_t *large;
+  sched_flow_t *flow;
+  char key[SCHED_KEYLEN] = "*";
+
+  if (sched->quantum > 0)
+  {
+    flow_key(addr, key);
+  }
+  if (NULL == (flow = find_flow(sched, key)))
+  {
+    return -1;
+  }
+
+  if ((size_t)entry.size >= sched->small_limit)
+  {
+    if (NULL == (large = objpool_get(sched->nodes)))
+    {
+      return -1;
+    }
+    large->entry = entry;
+    large->next = NULL;
+    *(flow->large_tail != NULL ? &flow->large_tail->next : &flow->large_head) = large;
+    flow->large_tail = large;
+    sched->nlarge++;
+  }
+  else
+  {
+    if (heap_push(flow, &entry) < 0)
+    {
+      return -1;
+    }
+    sched->nsmall++;
+  }
+
+  if (++flow->queued > flow->max_queued)
+  {
+    flow->max_queued = flow->queued;
+  }
+
+  if (!flow->active)
+  {
+    idle_remove(sched, flow);
+    flow->active = 1;
+    flow->deficit = 0;
+    flow->granted = 0;
+    flow->next_active = NULL;
+    if (sched->active_tail == NULL)
+    {
+      sched->active_head = flow;
+    }
+    else
+    {
+      sched->active_tail->next_active = flow;
+    }
+    sched->active_tail = flow;
+    sched->nactive++;
+  }
+  return 0;
+}
+
+int sched_ready(sched_t *sched)
+{
+  return sched->nsmall > 0 || (sched->nlarge > 0 && sched->large_active < sched->large_max);
+}
+
+//
+//  Picks the request a flow would send next and returns its lane, or -1 if
+//  the flow only has large requests and the large lane is full.  Small
+//  files go first, except that one large transfer is always allowed to make
+//  progress so a steady stream of small ones cannot starve it.
+//
+static int flow_candidate(sched_t *sched, sched_flow_t *flow, ssize_t *cost)
+{
+  if (flow->large_head != NULL && sched->large_active < sched->large_max &&
+      (flow->nsmall == 0 || sched->large_active == 0))
+  {
+    *cost = flow->large_head->entry.size;
+    return SCHED_LARGE;
+  }
+
+  if (flow->nsmall > 0)
+  {
+    *cost = flow->small[0].size;
+    return SCHED_SMALL;
+  }
+
+  return -1;
+}
+
+static void rotate(sched_t *sched)
+{
+  sched_flow_t *flow = sched->active_head;
+
+  flow->granted = 0;
+  if (sched->active_tail == flow)
+  {
+    return;
+  }
+
+  sched->active_head = flow->next_active;
+  flow->next_active = NULL;
+  sched->active_tail->next_active = flow;
+  sched->active_tail = flow;
+}
+
+// Takes the candidate request of the flow at the head of the active list
+static void *take(sched_t *sched, int lane)
+{
+  sched_flow_t *flow = sched->active_head;
+  sched_node_t *large;
+  sched_entry_t entry;
+
+  if (lane == SCHED_LARGE)
+  {
+    large = flow->large_head;
+    if (NULL == (flow->large_head = large->next))
+    {
+      flow->large_tail = NULL;
+    }
+    entry = large->entry;
+    objpool_put(sched->nodes, large);
+    sched->nlarge--;
+    sched->large_active++;
+  }
+  else
+  {
+    heap_pop(flow, &entry);
+    sched->nsmall--;
+  }
+
+  record_wait(&sched->stats[lane], entry.enqueued_ns);
+  flow->queued--;
+  flow->served++;
+  flow->bytes += entry.size;
+
+  if (flow->queued == 0)
+  {
+    flow->active = 0;
+    flow->deficit = 0;
+    flow->granted = 0;
+    sched->active_head = flow->next_active;
+    if (sched->active_head == NULL)
+    {
+      sched->active_tail = NULL;
+    }
+    sched->nactive--;
+    idle_add(sched, flow);
+  }
+
+  return entry.item;
+}
+
+void *sched_dequeue(sched_t *sched, int *lane)
+{
+  sched_flow_t *flow;
+  ssize_t cost;
+  int64_t rounds, need;
+
+  while (1)
+  {
+    for (int n = 0; n < sched->nactive; n++)
+    {
+      flow = sched->active_head;
+      if ((*lane = flow_candidate(sched, flow, &cost)) >= 0)
+      {
+        if (sched->quantum == 0)
+        {
+          return take(sched, *lane);
+        }
+
+        if (!flow->granted)
+        {
+          flow->deficit += sched->quantum;
+          flow->granted = 1;
+        }
+
+        if (cost <= flow->deficit)
+        {
+          flow->deficit -= cost;
+          return take(sched, *lane);
+        }
+      }
+      rotate(sched);
+    }
+
+    // No flow has the credit for its next request yet.  Rather than going
+    // round until one does, grant every flow the rounds that would take.
+    rounds = INT64_MAX;
+    for (flow = sched->active_head; flow != NULL; flow = flow->next_active)
+    {
+      if (flow_candidate(sched, flow, &cost) >= 0)
+      {
+        need = (cost - flow->deficit + sched->quantum - 1) / sched->quantum;
+        rounds = need < rounds ? need : rounds;
+      }
+    }
+
+    for (flow = sched->active_head; flow != NULL; flow = flow->next_active)
+    {
+      if (flow_candidate(sched, flow, &cost) >= 0)
+      {
+        flow->deficit += rounds * sched->quantum;
+      }
+    }
+  }
+}
+
+int sched_finish(sched_t *sched, int lane)
+{
+  if (lane != SCHED_LARGE)
+  {
+    return 0;
+  }
+
+  sched->large_active--;
+  return sched->nlarge > 0;
+}
+
+int sched_size(sched_t *sched)
+{
+  return sched->nsmall + sched->nlarge;
+}
+
+static double percentile_ms(sched_stats_t *stats, double p)
+{
+  unsigned long target = stats->count * p / 100, seen = 0;
+
+  // Upper bound of the bucket holding the percentile
+  for (int i = 0; i < SCHED_BUCKETS; i++)
+  {
+    seen += stats->buckets[i];
+    if (seen > target)
+    {
+      return (1ULL << i) / 1000.0;
+    }
+  }
+
+  return stats->max_ns / 1e6;
+}
+
+static int cmp_flow_bytes(const void *a, const void *b)
+{
+  const sched_flow_t *x = *(sched_flow_t *const *)a, *y = *(sched_flow_t *const *)b;
+  return x->bytes < y->bytes ? 1 : x->bytes > y->bytes ? -1 : 0;
+}
+
+void sched_report(sched_t *sched)
+{
+  static const char *names[] = {"small", "large"};
+  sched_flow_t **flows;
+  sched_flow_t *flow;
+  int n = 0;
+
+  for (int i = 0; i < 2; i++)
+  {
+    sched_stats_t *stats = &sched->stats[i];
+
+    if (stats->count == 0)
+    {
+      continue;
+    }
+
+    L(INFO, "%s files: %lu served, queue wait mean %.3f ms, p50 <= %.3f ms, p99 <= %.3f ms, max %.3f ms",
+      names[i], stats->count, stats->total_ns / 1e6 / stats->count,
+      percentile_ms(stats, 50), percentile_ms(stats, 99), stats->max_ns / 1e6);
+  }
+
+  if (sched->quantum == 0 || sched->nflows == 0)
+  {
+    return;
+  }
+
+  if (sched->retired > 0)
+  {
+    L(INFO, "%lu idle clients retired: %lu served, %llu bytes", sched->retired, sched->retired_served,
+      (unsigned long long)sched->retired_bytes);
+  }
+
+  if (NULL == (flows = malloc(sizeof(sched_flow_t *) * sched->nflows)))
+  {
+    return;
+  }
+  for (unsigned int i = 0; i < sched->nbuckets; i++)
+  {
+    for (flow = sched->buckets[i]; flow != NULL; flow = flow->next_bucket)
+    {
+      flows[n++] = flow;
+    }
+  }
+  qsort(flows, n, sizeof(sched_flow_t *), cmp_flow_bytes);
+
+  for (int i = 0; i < n && i < SCHED_REPORT_FLOWS; i++)
+  {
+    L(INFO, "client %s: %lu served, %llu bytes, %d queued (max %d)", flows[i]->key,
+      flows[i]->served, (unsigned long long)flows[i]->bytes, flows[i]->queued, flows[i]->max_queued);
+  }
+  if (n > SCHED_REPORT_FLOWS)
+  {
+    L(INFO, "... and %d more clients", n - SCHED_REPORT_FLOWS);
+  }
+
+  free(flows);
+}
+
+void sched_destroy(sched_t *sched)
+{
+  sched_flow_t *flow, *next;
+
+  for (unsigned int i = 0; i < sched->nbuckets; i++)
+  {
+    for (flow = sched->buckets[i]; flow != NULL; flow = next)
+    {
+      next = flow->next_bucket;
+      free(flow->small);
+      free(flow);
+    }
+  }
+  free(sched->buckets);
+  objpool_destroy(sched->nodes);
+}
@@ -0,0 +1,139 @@
+#ifndef __SCHED_H__
+#define __SCHED_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "objpool.h"
+
+#define SCHED_SMALL 0
+#define SCHED_LARGE 1
+
+#define SCHED_BUCKETS 32
+#define SCHED_MIN_BUCKETS 64
+#define SCHED_IDLE_FLOWS 1024
+#define SCHED_KEYLEN INET6_ADDRSTRLEN
+
+/*
+ * Queue wait times for one size class, in a histogram of power-of-two
+ * microsecond buckets.
+ */
+typedef struct sched_stats_t
+{
+  unsigned long count;
+  uint64_t total_ns, max_ns;
+  unsigned long buckets[SCHED_BUCKETS];
+} sched_stats_t;
+
+typedef struct sched_entry_t
+{
+  void *item;
+  ssize_t size;
+  unsigned long seq;
+  uint64_t enqueued_ns;
+} sched_entry_t;
+
+/* A request in a flow's FIFO lane, from the scheduler's object pool. */
+typedef struct sched_node_t
+{
+  sched_entry_t entry;
+  struct sched_node_t *next;
+} sched_node_t;
+
+/*
+ * The queued requests of one client address.  A flow is on the active
+ * list while it has requests queued.  After that it waits on the idle
+ * list, keeping its statistics for a returning client, until it is one of
+ * more than SCHED_IDLE_FLOWS idle flows and the oldest is freed.
+ */
+typedef struct sched_flow_t
+{
+  char key[SCHED_KEYLEN];
+  sched_entry_t *small; // min-heap on (size, seq)
+  int nsmall, small_cap;
+  sched_node_t *large_head, *large_tail;
+  int64_t deficit;
+  int granted;
+  int active;
+  int queued, max_queued;
+  unsigned long served;
+  uint64_t bytes;
+  unsigned int hash;
+  struct sched_flow_t *next_active;
+  struct sched_flow_t *prev_idle, *next_idle;
+  struct sched_flow_t *next_bucket;
+} sched_flow_t;
+
+/*
+ * The boss/worker queue.  Requests are grouped into one flow per client
+ * address and workers take from the flows in deficit round robin order:
+ * each visit grants a flow quantum bytes of credit and a request is served
+ * once its flow has credit for the size of its file, so every client gets
+ * an equal share of the bytes served no matter how many connections it
+ * opens.
+ *
+ * Within a flow, requests for files smaller than small_limit are served
+ * shortest job first; larger ones queue FIFO and at most large_max of them
+ * are served at a time across all flows, so a few huge transfers cannot
+ * occupy every worker.  Like steque, the scheduler does no locking of its
+ * own.
+ */
+typedef struct sched_t
+{
+  sched_flow_t **buckets; // sized to the number of flows, a power of two
+  unsigned int nbuckets;
+  sched_flow_t *active_head, *active_tail;
+  sched_flow_t *idle_head, *idle_tail; // least recently active first
+  int nactive, nidle, nflows;
+  unsigned long retired, retired_served; // flows freed and what they were served
+  uint64_t retired_bytes;
+  int nsmall, nlarge;
+  int large_active, large_max;
+  size_t small_limit;
+  size_t quantum;
+  unsigned long seq;
+  sched_stats_t stats[2];
+  objpool_t *nodes;
+} sched_t;
+
+/*
+ * Initializes the scheduler.  A small_limit of 0 sends every request to
+ * the FIFO lane, which with large_max equal to the number of workers is
+ * plain FIFO scheduling within a flow.  A quantum of 0 puts every request
+ * in a single flow, turning fair queuing off.
+ */
+void sched_init(sched_t *sched, size_t small_limit, int large_max, size_t quantum);
+
+/*
+ * Queues an item for a file of the given size (-1 if unknown) on behalf
+ * of the client at addr.  Returns 0, or -1 if out of memory.
+ */
+int sched_enqueue(sched_t *sched, void *item, ssize_t size, const struct sockaddr *addr);
+
+/* Returns 1 if a worker can take an item now, 0 otherwise. */
+int sched_ready(sched_t *sched);
+
+/*
+ * Removes the next item to serve and stores its class in lane.  Must only
+ * be called when sched_ready is true.  Every item taken must be given back
+ * to sched_finish once it has been served.
+ */
+void *sched_dequeue(sched_t *sched, int *lane);
+
+/*
+ * Marks an item of the given class as served.  Returns 1 if this may have
+ * made another item ready.
+ */
+int sched_finish(sched_t *sched, int lane);
+
+/* Returns the number of queued items. */
+int sched_size(sched_t *sched);
+
+/* Logs the queue wait times of each class and the busiest clients. */
+void sched_report(sched_t *sched);
+
+void sched_destroy(sched_t *sched);
+
+#endif
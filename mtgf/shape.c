@@ -0,0 +1,419 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "shape.h"
+#include "log.h"
+
+#define SHAPE_CLIENT_BUCKETS 256
+#define SHAPE_MIN_BURST (64 * 1024)
+
+#ifndef SO_MAX_PACING_RATE
+#define SO_MAX_PACING_RATE 47
+#endif
+
+typedef struct shape_client_t
+{
+  char key[INET6_ADDRSTRLEN];
+  shape_bucket_t bucket;
+  int conns; // connections holding this client
+  unsigned int hash;
+  struct shape_client_t *next;
+  struct shape_client_t *prev_idle, *next_idle;
+} shape_client_t;
+
+static shape_limits_t limits;
+static unsigned int generation = 1;
+static int pacing = 0;
+
+static pthread_mutex_t shape_mutex = PTHREAD_MUTEX_INITIALIZER;
+static shape_client_t *clients[SHAPE_CLIENT_BUCKETS];
+static shape_client_t *idle_head, *idle_tail; // no connections, in the order they closed
+static shape_bucket_t global_bucket;
+
+static unsigned long throttled;
+static uint64_t throttled_ns;
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double burst_of(uint64_t rate)
+{
+  return rate / 10 > SHAPE_MIN_BURST ? rate / 10 : SHAPE_MIN_BURST;
+}
+
+// Takes n tokens and returns how long the caller must wait, in ns
+static uint64_t take(shape_bucket_t *bucket, uint64_t rate, size_t n, uint64_t now)
+{
+  double burst = burst_of(rate);
+
+  if (bucket->last_ns == 0)
+  {
+    bucket->tokens = burst;
+  }
+  else
+  {
+    bucket->tokens += (now - bucket->last_ns) * (double)rate / 1e9;
+  }
+
+  if (bucket->tokens > burst)
+  {
+    bucket->tokens = burst;
+  }
+  bucket->last_ns = now;
+  bucket->tokens -= n;
+
+  return bucket->tokens < 0 ? -bucket->tokens * 1e9 / rate : 0;
+}
+
+static uint64_t parse_rate(const char *text)
+{
+  char *end;
+  double rate = strtod(text, &end);
+
+  if (end == text || rate < 0)
+  {
+    return UINT64_MAX;
+  }
+
+  switch (*end)
+  {
+  case 'k':
+  case 'K':
+    rate *= 1024;
+    break;
+  case 'm':
+  case 'M':
+    rate *= 1024 * 1024;
+    break;
+  case 'g':
+  case 'G':
+    rate *= 1024 * 1024 * 1024;
+    break;
+  case '\0':
+    break;
+  default:
+    return UINT64_MAX;
+  }
+
+  return rate;
+}
+
+int shape_load(const char *path)
+{
+  shape_limits_t new_limits = {0, 0, 0};
+  char *line = NULL;
+  size_t cap = 0;
+  char name[32], value[64];
+  uint64_t rate;
+  int lineno = 0, res = 0;
+  FILE *file;
+
+  if (NULL == (file = fopen(path, "r")))
+  {
+    L(ERROR, "unable to open bandwidth limits %s: %s", path, strerror(errno));
+    return -1;
+  }
+
+  while (getline(&line, &cap, file) != -1)
+  {
+    lineno++;
+    if (sscanf(line, "%31s %63s", name, value) < 1 || name[0] == '#')
+    {
+      continue;
+    }
+
+    if ((rate = parse_rate(value)) == UINT64_MAX)
+    {
+      L(ERROR, "%s:%d: bad rate", path, lineno);
+      res = -1;
+    }
+    else if (strcasecmp(name, "connection") == 0)
+    {
+      new_limits.connection = rate;
+    }
+    else if (strcasecmp(name, "client") == 0)
+    {
+      new_limits.client = rate;
+    }
+    else if (strcasecmp(name, "global") == 0)
+    {
+      new_limits.global = rate;
+    }
+    else
+    {
+      L(ERROR, "%s:%d: unknown limit %s", path, lineno, name);
+      res = -1;
+    }
+  }
+
+  free(line);
+  fclose(file);
+
+  if (res == 0)
+  {
+    shape_set_limits(&new_limits);
+  }
+  return res;
+}
+
+void shape_set_limits(const shape_limits_t *new_limits)
+{
+  __atomic_store_n(&limits.connection, new_limits->connection, __ATOMIC_RELAXED);
+  __atomic_store_n(&limits.client, new_limits->client, __ATOMIC_RELAXED);
+  __atomic_store_n(&limits.global, new_limits->global, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+
+  L(INFO, "bandwidth limits (bytes/s, 0 = unlimited): connection %llu, client %llu, global %llu",
+    (unsigned long long)new_limits->connection, (unsigned long long)new_limits->client,
+    (unsigned long long)new_limits->global);
+}
+
+void shape_set_pacing(int on)
+{
+  pacing = on;
+}
+
+static void apply_pacing(shape_conn_t *conn, int sock_fd)
+{
+  unsigned int current = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+  uint64_t rate = __atomic_load_n(&limits.connection, __ATOMIC_RELAXED);
+  unsigned long value = rate > 0 ? rate : ~0UL;
+
+  if (conn->generation == current)
+  {
+    return;
+  }
+
+  conn->generation = current;
+  if (setsockopt(sock_fd, SOL_SOCKET, SO_MAX_PACING_RATE, &value, sizeof(value)) < 0)
+  {
+    L(WARN, "SO_MAX_PACING_RATE: %s", strerror(errno));
+  }
+}
+
+void shape_conn_init(shape_conn_t *conn, int sock_fd)
+{
+  memset(conn, 0, sizeof(*conn));
+  if (pacing)
+  {
+    apply_pacing(conn, sock_fd);
+  }
+}
+
+static void idle_remove(shape_client_t *client)
+{
+  *(client->prev_idle != NULL ? &client->prev_idle->next_idle : &idle_head) = client->next_idle;
+  *(client->next_idle != NULL ? &client->next_idle->prev_idle : &idle_tail) = client->prev_idle;
+  client->prev_idle = client->next_idle = NULL;
+}
+
+static shape_client_t *find_client(const struct sockaddr *peer)
+{
+  char key[INET6_ADDRSTRLEN] = "unknown";
+  const void *src = NULL;
+  unsigned int hash = 2166136261u;
+  shape_client_t *client;
+
+  if (peer != NULL && peer->sa_family == AF_INET)
+  {
+    src = &((const struct sockaddr_in *)peer)->sin_addr;
+  }
+  else if (peer != NULL && peer->sa_family == AF_INET6)
+  {
+    src = &((const struct sockaddr_in6 *)peer)->sin6_addr;
+  }
+  if (src != NULL)
+  {
+    inet_ntop(peer->sa_family, src, key, sizeof(key));
+  }
+
+  for (char *c = key; *c; c++)
+  {
+    hash = (hash ^ (unsigned char)*c) * 16777619u;
+  }
+  hash %= SHAPE_CLIENT_BUCKETS;
+
+  for (client = clients[hash]; client != NULL; client = client->next)
+  {
+    if (strcmp(client->key, key) == 0)
+    {
+      if (client->conns == 0)
+      {
+        idle_remove(client);
+      }
+      return client;
+    }
+  }
+
+  if (NULL == (client = calloc(1, sizeof(shape_client_t))))
+  {
+    return NULL;
+  }
+  strcpy(client->key, key);
+  client->hash = hash;
+  client->next = clients[hash];
+  clients[hash] = client;
+  return client;
+}
+
+// Whether a bucket left alone since its last send would be full by now
+static int refilled(shape_bucket_t *bucket, uint64_t rate, uint64_t now)
+{
+  return rate == 0 || bucket->tokens + (now - bucket->last_ns) * (double)rate / 1e9 >= burst_of(rate);
+}
+
+//
+//  Frees idle clients from the oldest on, for as long as their buckets
+//  have refilled; forgetting one then makes no difference to its limit.
+//
+static void evict_idle(uint64_t now)
+{
+  uint64_t rate = __atomic_load_n(&limits.client, __ATOMIC_RELAXED);
+  shape_client_t *client, **link;
+
+  while ((client = idle_head) != NULL && refilled(&client->bucket, rate, now))
+  {
+    idle_remove(client);
+    for (link = &clients[client->hash]; *link != client; link = &(*link)->next)
+      ;
+    *link = client->next;
+    free(client);
+  }
+}
+
+void shape_conn_close(shape_conn_t *conn)
+{
+  shape_client_t *client = conn->client;
+
+  if (client == NULL)
+  {
+    return;
+  }
+  conn->client = NULL;
+
+  pthread_mutex_lock(&shape_mutex);
+  if (--client->conns == 0)
+  {
+    client->next_idle = NULL;
+    client->prev_idle = idle_tail;
+    *(idle_tail != NULL ? &idle_tail->next_idle : &idle_head) = client;
+    idle_tail = client;
+  }
+  evict_idle(now_ns());
+  pthread_mutex_unlock(&shape_mutex);
+}
+
+// Takes len bytes from every bucket that applies and returns the longest wait, in ns
+static uint64_t charge(shape_conn_t *conn, int sock_fd, const struct sockaddr *peer, size_t len, uint64_t now)
+{
+  uint64_t connection = __atomic_load_n(&limits.connection, __ATOMIC_RELAXED);
+  uint64_t client = __atomic_load_n(&limits.client, __ATOMIC_RELAXED);
+  uint64_t global = __atomic_load_n(&limits.global, __ATOMIC_RELAXED);
+  uint64_t wait = 0, w;
+
+  if (pacing)
+  {
+    apply_pacing(conn, sock_fd);
+  }
+  else if (connection > 0)
+  {
+    wait = take(&conn->bucket, connection, len, now);
+  }
+
+  if (client > 0 || global > 0)
+  {
+    pthread_mutex_lock(&shape_mutex);
+    if (client > 0 && conn->client == NULL && NULL != (conn->client = find_client(peer)))
+    {
+      conn->client->conns++;
+    }
+    if (client > 0 && conn->client != NULL && (w = take(&conn->client->bucket, client, len, now)) > wait)
+    {
+      wait = w;
+    }
+    if (global > 0 && (w = take(&global_bucket, global, len, now)) > wait)
+    {
+      wait = w;
+    }
+    pthread_mutex_unlock(&shape_mutex);
+  }
+
+  if (wait > 0)
+  {
+    __atomic_add_fetch(&throttled, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&throttled_ns, wait, __ATOMIC_RELAXED);
+    L(TRACE, "throttling send of %zu bytes for %llu ns", len, (unsigned long long)wait);
+  }
+  return wait;
+}
+
+void shape_throttle(shape_conn_t *conn, int sock_fd, const struct sockaddr *peer, size_t len)
+{
+  uint64_t wait = charge(conn, sock_fd, peer, len, now_ns());
+  struct timespec ts;
+
+  if (wait > 0)
+  {
+    ts.tv_sec = wait / 1000000000ULL;
+    ts.tv_nsec = wait % 1000000000ULL;
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+      ;
+  }
+}
+
+void shape_charge(shape_conn_t *conn, int sock_fd, const struct sockaddr *peer, size_t len)
+{
+  uint64_t now = now_ns(), wait = charge(conn, sock_fd, peer, len, now);
+
+  if (wait > 0)
+  {
+    conn->resume_ns = now + wait;
+  }
+}
+
+uint64_t shape_delay(shape_conn_t *conn)
+{
+  uint64_t now;
+
+  if (conn->resume_ns == 0 || (now = now_ns()) >= conn->resume_ns)
+  {
+    return 0;
+  }
+  return conn->resume_ns - now;
+}
+
+void shape_report()
+{
+  if (throttled > 0)
+  {
+    L(INFO, "bandwidth shaping: %lu sends throttled for %.3f s in total", throttled, throttled_ns / 1e9);
+  }
+}
+
+void shape_destroy()
+{
+  shape_client_t *client, *next;
+
+  for (int i = 0; i < SHAPE_CLIENT_BUCKETS; i++)
+  {
+    for (client = clients[i]; client != NULL; client = next)
+    {
+      next = client->next;
+      free(client);
+    }
+    clients[i] = NULL;
+  }
+  idle_head = idle_tail = NULL;
+}
@@ -0,0 +1,86 @@
+#ifndef __SHAPE_H__
+#define __SHAPE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/*
+ * Token buckets.  A bucket holds up to 100ms worth of its rate (at least
+ * 64 KiB) and may go into debt; a sender then waits until the debt is
+ * repaid, so a large send is simply followed by a proportionally long
+ * pause.
+ */
+typedef struct shape_bucket_t
+{
+  double tokens;
+  uint64_t last_ns;
+} shape_bucket_t;
+
+/* Egress limits in bytes per second; 0 means unlimited. */
+typedef struct shape_limits_t
+{
+  uint64_t connection;
+  uint64_t client;
+  uint64_t global;
+} shape_limits_t;
+
+/* Shaping state of one connection. */
+typedef struct shape_conn_t
+{
+  shape_bucket_t bucket;
+  unsigned int generation;
+  struct shape_client_t *client; // held from the first send under a client limit
+  uint64_t resume_ns; // when the debt charged by shape_charge is repaid
+} shape_conn_t;
+
+/*
+ * Reads limits from a file of "connection", "client" or "global" followed
+ * by a rate in bytes per second, with an optional k, m or g suffix
+ * (powers of 1024).  Missing entries are unlimited.  The new limits apply
+ * to connections already open.  Returns -1, keeping the current limits,
+ * if the file cannot be read or parsed.
+ */
+int shape_load(const char *path);
+
+void shape_set_limits(const shape_limits_t *limits);
+
+/*
+ * With pacing on, the per-connection limit is enforced by the kernel
+ * through SO_MAX_PACING_RATE rather than by sleeping in gfs_send.  The
+ * client and global limits are always enforced in userspace.
+ */
+void shape_set_pacing(int pacing);
+
+/* Prepares the shaping state of a newly accepted connection. */
+void shape_conn_init(shape_conn_t *conn, int sock_fd);
+
+/*
+ * Releases the connection's hold on its client's bucket.  A client with
+ * no connections left is forgotten once its bucket has refilled.
+ */
+void shape_conn_close(shape_conn_t *conn);
+
+/*
+ * Charges len bytes about to be sent on sock_fd against the connection,
+ * the client at peer and the global limit, sleeping for as long as the
+ * most constrained of them requires.
+ */
+void shape_throttle(shape_conn_t *conn, int sock_fd, const struct sockaddr *peer, size_t len);
+
+/*
+ * Like shape_throttle, but returns at once for senders that must not
+ * sleep.  The caller must not send on the connection again before
+ * shape_delay has fallen to 0.
+ */
+void shape_charge(shape_conn_t *conn, int sock_fd, const struct sockaddr *peer, size_t len);
+
+/* Returns how many ns remain before the connection may send again. */
+uint64_t shape_delay(shape_conn_t *conn);
+
+/* Logs the time senders have spent throttled. */
+void shape_report();
+
+void shape_destroy();
+
+#endif
@@ -0,0 +1,849 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "storage.h"
+#include "content.h"
+#include "manifest.h"
+#include "bloom.h"
+#include "log.h"
+
+#define MAX_KEYLEN 512
+
+static unsigned long opens, misses, reads;
+static uint64_t open_ns, read_ns, read_bytes;
+static unsigned long filter_checks, filter_rejects, filter_passed_misses;
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int storage_open(storage_t *store, const char *key, size_t *size)
+{
+  uint64_t start = now_ns();
+  int handle = store->ops->open(store, key, size);
+
+  __atomic_add_fetch(&opens, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&open_ns, now_ns() - start, __ATOMIC_RELAXED);
+  if (handle < 0)
+  {
+    __atomic_add_fetch(&misses, 1, __ATOMIC_RELAXED);
+    // Only a miss that a filter let through says anything about the filter
+    if (errno == ENOENT && __atomic_load_n(&store->filtered, __ATOMIC_RELAXED))
+    {
+      __atomic_add_fetch(&filter_passed_misses, 1, __ATOMIC_RELAXED);
+    }
+  }
+  return handle;
+}
+
+ssize_t storage_stat(storage_t *store, const char *key)
+{
+  return store->ops->stat(store, key);
+}
+
+ssize_t storage_read(storage_t *store, int handle, void *buf, size_t len, off_t off)
+{
+  uint64_t start = now_ns();
+  ssize_t n = store->ops->read(store, handle, buf, len, off);
+
+  __atomic_add_fetch(&reads, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&read_ns, now_ns() - start, __ATOMIC_RELAXED);
+  if (n > 0)
+  {
+    __atomic_add_fetch(&read_bytes, n, __ATOMIC_RELAXED);
+  }
+  return n;
+}
+
+int storage_may_exist(storage_t *store, const char *key)
+{
+  int res;
+
+  if (store->ops->exists == NULL || (res = store->ops->exists(store, key)) < 0)
+  {
+    return 1;
+  }
+
+  if (!store->filtered)
+  {
+    __atomic_store_n(&store->filtered, 1, __ATOMIC_RELAXED);
+  }
+  __atomic_add_fetch(&filter_checks, 1, __ATOMIC_RELAXED);
+  if (res == 0)
+  {
+    __atomic_add_fetch(&filter_rejects, 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+  return 1;
+}
+
+void storage_close(storage_t *store, int handle)
+{
+  store->ops->close(store, handle);
+}
+
+void storage_destroy(storage_t *store)
+{
+  store->ops->destroy(store);
+  free(store);
+}
+
+void storage_report(storage_t *store)
+{
+  if (filter_checks > 0)
+  {
+    L(INFO, "lookup filter: %lu requests checked, %lu answered not found up front (%.1f%%), %lu misses got past it",
+      filter_checks, filter_rejects, 100.0 * filter_rejects / filter_checks, filter_passed_misses);
+  }
+  if (opens == 0)
+  {
+    return;
+  }
+
+  L(INFO, "storage (%s): %lu opens (%lu failed), mean %.3f ms; %lu reads of %llu bytes, mean %.3f ms",
+    store->ops->name, opens, misses, open_ns / 1e6 / opens, reads, (unsigned long long)read_bytes,
+    reads > 0 ? read_ns / 1e6 / reads : 0.0);
+  if (store->ops->report != NULL)
+  {
+    store->ops->report(store);
+  }
+}
+
+storage_t *storage_new(const storage_ops_t *ops, void *state)
+{
+  storage_t *store = malloc(sizeof(storage_t));
+
+  store->ops = ops;
+  store->state = state;
+  store->filtered = 0;
+  return store;
+}
+
+/* Local files ============================================================= */
+
+static int local_open(storage_t *store, const char *key, size_t *size)
+{
+  struct stat st;
+  int fd;
+
+  if ((fd = content_get(key)) < 0)
+  {
+    errno = ENOENT;
+    return -1;
+  }
+
+  if (fstat(fd, &st) < 0)
+  {
+    L(WARN, "fstat failed for %s: %s", key, strerror(errno));
+    return -1;
+  }
+
+  *size = st.st_size;
+  return fd;
+}
+
+static ssize_t local_stat(storage_t *store, const char *key)
+{
+  return content_size(key);
+}
+
+static ssize_t local_read(storage_t *store, int fd, void *buf, size_t len, off_t off)
+{
+  return pread(fd, buf, len, off);
+}
+
+// The content library keeps its descriptors open for the server's lifetime
+static void local_close(storage_t *store, int fd)
+{
+}
+
+static void local_destroy(storage_t *store)
+{
+  content_destroy();
+}
+
+static int local_exists(storage_t *store, const char *key)
+{
+  return content_may_exist(key);
+}
+
+static const storage_ops_t local_ops = {"local", local_open, local_stat, local_read, local_close, local_destroy, NULL,
+                                        local_exists};
+
+storage_t *storage_local(const char *content_map)
+{
+  content_init(content_map);
+  return storage_new(&local_ops, NULL);
+}
+
+// Reads the next "key path" line of a content map, skipping malformed ones
+static int read_map_line(FILE *filelist, char *line, size_t size, char **key, char **path)
+{
+  char *ptr;
+
+  while (fgets(line, size, filelist))
+  {
+    line[strcspn(line, "\r\n")] = '\0';
+    ptr = line;
+    *key = strsep(&ptr, " \t");
+    *path = strsep(&ptr, " \t");
+    if (*key != NULL && *path != NULL)
+    {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* In memory =============================================================== */
+
+typedef struct memory_item_t
+{
+  char *key;
+  char *data;
+  size_t size;
+} memory_item_t;
+
+typedef struct memory_state_t
+{
+  memory_item_t *items;
+  int nitems;
+  bloom_t *filter;
+} memory_state_t;
+
+static int memory_cmp(const void *a, const void *b)
+{
+  return strcmp(((const memory_item_t *)a)->key, ((const memory_item_t *)b)->key);
+}
+
+static int memory_find(memory_state_t *state, const char *key)
+{
+  memory_item_t probe = {(char *)key, NULL, 0};
+  memory_item_t *item = bsearch(&probe, state->items, state->nitems, sizeof(memory_item_t), memory_cmp);
+
+  return item == NULL ? -1 : item - state->items;
+}
+
+static int memory_open(storage_t *store, const char *key, size_t *size)
+{
+  memory_state_t *state = store->state;
+  int index;
+
+  if ((index = memory_find(state, key)) < 0)
+  {
+    errno = ENOENT;
+    return -1;
+  }
+
+  *size = state->items[index].size;
+  return index;
+}
+
+static ssize_t memory_stat(storage_t *store, const char *key)
+{
+  memory_state_t *state = store->state;
+  int index = memory_find(state, key);
+
+  return index < 0 ? -1 : (ssize_t)state->items[index].size;
+}
+
+static ssize_t memory_read(storage_t *store, int index, void *buf, size_t len, off_t off)
+{
+  memory_item_t *item = &((memory_state_t *)store->state)->items[index];
+
+  if ((size_t)off >= item->size)
+  {
+    return 0;
+  }
+  if (len > item->size - off)
+  {
+    len = item->size - off;
+  }
+
+  memcpy(buf, item->data + off, len);
+  return len;
+}
+
+static void memory_close(storage_t *store, int index)
+{
+}
+
+static void memory_destroy(storage_t *store)
+{
+  memory_state_t *state = store->state;
+
+  for (int i = 0; i < state->nitems; i++)
+  {
+    free(state->items[i].key);
+    free(state->items[i].data);
+  }
+  free(state->items);
+  if (state->filter != NULL)
+  {
+    bloom_destroy(state->filter);
+  }
+  free(state);
+}
+
+static int memory_exists(storage_t *store, const char *key)
+{
+  bloom_t *filter = ((memory_state_t *)store->state)->filter;
+
+  return filter == NULL ? -1 : bloom_may_contain(filter, key);
+}
+
+static const storage_ops_t memory_ops = {"memory", memory_open, memory_stat, memory_read, memory_close, memory_destroy, NULL,
+                                         memory_exists};
+
+static char *read_file(const char *path, size_t *size)
+{
+  struct stat st;
+  char *data;
+  FILE *file;
+
+  if (NULL == (file = fopen(path, "r")) || fstat(fileno(file), &st) < 0)
+  {
+    return NULL;
+  }
+
+  data = malloc(st.st_size > 0 ? st.st_size : 1);
+  if (fread(data, 1, st.st_size, file) != (size_t)st.st_size)
+  {
+    free(data);
+    data = NULL;
+  }
+
+  *size = st.st_size;
+  fclose(file);
+  return data;
+}
+
+storage_t *storage_memory(const char *content_map)
+{
+  memory_state_t *state = calloc(1, sizeof(memory_state_t));
+  char line[MAX_KEYLEN], *key, *path;
+  int capacity = 16;
+  size_t total = 0;
+  FILE *filelist;
+
+  if (NULL == (filelist = fopen(content_map, "r")))
+  {
+    fprintf(stderr, "Unable to open file %s.\n", content_map);
+    exit(EXIT_FAILURE);
+  }
+
+  state->items = malloc(capacity * sizeof(memory_item_t));
+  while (read_map_line(filelist, line, sizeof(line), &key, &path))
+  {
+    if (state->nitems == capacity)
+    {
+      capacity *= 2;
+      state->items = realloc(state->items, capacity * sizeof(memory_item_t));
+    }
+
+    memory_item_t *item = &state->items[state->nitems++];
+    if (NULL == (item->data = read_file(path, &item->size)))
+    {
+      fprintf(stderr, "Unable to read file %s.\n", path);
+      exit(EXIT_FAILURE);
+    }
+    item->key = strdup(key);
+    total += item->size;
+  }
+  fclose(filelist);
+
+  qsort(state->items, state->nitems, sizeof(memory_item_t), memory_cmp);
+  if (NULL == (state->filter = bloom_create(state->nitems)))
+  {
+    L(WARN, "storage: unable to allocate lookup filter, running without it");
+  }
+  for (int i = 0; state->filter != NULL && i < state->nitems; i++)
+  {
+    bloom_add(state->filter, state->items[i].key);
+  }
+  L(INFO, "storage: loaded %d files, %zu bytes, into memory", state->nitems, total);
+  return storage_new(&memory_ops, state);
+}
+
+/* Lazily opened files ===================================================== */
+
+#define LAZY_SHARDS 16
+
+//
+//  An open file.  Entries sit on their shard's LRU list, most recently
+//  used first, whether or not they are in use; only those with no
+//  references are ever closed.
+//
+typedef struct lazy_fd_t
+{
+  int fd;
+  int refs;
+  int index;
+  struct lazy_fd_t *prev, *next;
+} lazy_fd_t;
+
+typedef struct lazy_shard_t
+{
+  pthread_mutex_t mutex;
+  lazy_fd_t *head, *tail;
+  int nopen, capacity;
+  unsigned long hits, fills, evictions;
+} __attribute__((aligned(64))) lazy_shard_t;
+
+//
+//  The index is a manifest, either mapped from a compiled file or built
+//  from a text map without sizes.  What is learned at run time goes in
+//  arrays alongside it, allocated zeroed so that untouched entries cost no
+//  memory.
+//
+typedef struct lazy_state_t
+{
+  manifest_t *manifest;
+  lazy_fd_t **open;  // by entry, guarded by the shard's mutex
+  size_t *sizes;     // by entry, size plus one once learned
+  lazy_shard_t shards[LAZY_SHARDS];
+} lazy_state_t;
+
+static int lazy_find(lazy_state_t *state, const char *key)
+{
+  return manifest_find(state->manifest, key);
+}
+
+static ssize_t lazy_size(lazy_state_t *state, int index)
+{
+  size_t learned = __atomic_load_n(&state->sizes[index], __ATOMIC_RELAXED);
+
+  return learned > 0 ? (ssize_t)learned - 1 : manifest_size(state->manifest, index);
+}
+
+static void lazy_learn_size(lazy_state_t *state, int index, size_t size)
+{
+  __atomic_store_n(&state->sizes[index], size + 1, __ATOMIC_RELAXED);
+}
+
+static void lru_unlink(lazy_shard_t *shard, lazy_fd_t *entry)
+{
+  *(entry->prev != NULL ? &entry->prev->next : &shard->head) = entry->next;
+  *(entry->next != NULL ? &entry->next->prev : &shard->tail) = entry->prev;
+}
+
+static void lru_push(lazy_shard_t *shard, lazy_fd_t *entry)
+{
+  entry->prev = NULL;
+  entry->next = shard->head;
+  *(shard->head != NULL ? &shard->head->prev : &shard->tail) = entry;
+  shard->head = entry;
+}
+
+// Closes the least recently used idle files until at most limit are open
+static void lazy_evict(lazy_state_t *state, lazy_shard_t *shard, int limit)
+{
+  lazy_fd_t *entry = shard->tail, *prev;
+
+  while (shard->nopen > limit && entry != NULL)
+  {
+    prev = entry->prev;
+    if (entry->refs == 0)
+    {
+      lru_unlink(shard, entry);
+      state->open[entry->index] = NULL;
+      close(entry->fd);
+      free(entry);
+      shard->nopen--;
+      shard->evictions++;
+    }
+    entry = prev;
+  }
+}
+
+static int lazy_open_fd(lazy_state_t *state, lazy_shard_t *shard, const char *path)
+{
+  int fd;
+
+  // Out of descriptors: make room in this shard and try once more
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 && (errno == EMFILE || errno == ENFILE))
+  {
+    pthread_mutex_lock(&shard->mutex);
+    lazy_evict(state, shard, shard->nopen - 1);
+    pthread_mutex_unlock(&shard->mutex);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+  }
+
+  return fd;
+}
+
+static int lazy_open(storage_t *store, const char *key, size_t *size)
+{
+  lazy_state_t *state = store->state;
+  lazy_shard_t *shard;
+  lazy_fd_t *entry;
+  const char *path;
+  struct stat st;
+  int index, fd, err;
+
+  if ((index = lazy_find(state, key)) < 0)
+  {
+    errno = ENOENT;
+    return -1;
+  }
+  path = manifest_path(state->manifest, index);
+  shard = &state->shards[index % LAZY_SHARDS];
+
+  pthread_mutex_lock(&shard->mutex);
+  if (NULL != (entry = state->open[index]))
+  {
+    shard->hits++;
+    lru_unlink(shard, entry);
+  }
+  else
+  {
+    // Open outside the lock so that a slow disk does not hold up the shard
+    pthread_mutex_unlock(&shard->mutex);
+    if ((fd = lazy_open_fd(state, shard, path)) < 0 || fstat(fd, &st) < 0)
+    {
+      err = errno;
+      L(WARN, "unable to open %s for %s: %s", path, key, strerror(err));
+      if (fd >= 0)
+      {
+        close(fd);
+      }
+      errno = err;
+      return -1;
+    }
+    lazy_learn_size(state, index, st.st_size);
+
+    pthread_mutex_lock(&shard->mutex);
+    if (NULL != (entry = state->open[index]))
+    {
+      // Another thread opened it meanwhile
+      close(fd);
+      shard->hits++;
+      lru_unlink(shard, entry);
+    }
+    else
+    {
+      entry = malloc(sizeof(lazy_fd_t));
+      entry->fd = fd;
+      entry->refs = 0;
+      entry->index = index;
+      state->open[index] = entry;
+      shard->nopen++;
+      shard->fills++;
+      lazy_evict(state, shard, shard->capacity);
+    }
+  }
+
+  entry->refs++;
+  lru_push(shard, entry);
+  *size = lazy_size(state, index);
+  pthread_mutex_unlock(&shard->mutex);
+  return index;
+}
+
+//
+//  Only sizes already in memory, from the index or learned when the fd
+//  cache opened the file; a size missing from both stays unknown until
+//  the first transfer of the file opens it.
+//
+static ssize_t lazy_stat(storage_t *store, const char *key)
+{
+  lazy_state_t *state = store->state;
+  int index;
+
+  if ((index = lazy_find(state, key)) < 0)
+  {
+    return -1;
+  }
+  return lazy_size(state, index);
+}
+
+// The caller's reference keeps the entry, and its descriptor, in place
+static ssize_t lazy_read(storage_t *store, int index, void *buf, size_t len, off_t off)
+{
+  return pread(((lazy_state_t *)store->state)->open[index]->fd, buf, len, off);
+}
+
+static void lazy_close(storage_t *store, int index)
+{
+  lazy_state_t *state = store->state;
+  lazy_shard_t *shard = &state->shards[index % LAZY_SHARDS];
+
+  pthread_mutex_lock(&shard->mutex);
+  if (--state->open[index]->refs == 0 && shard->nopen > shard->capacity)
+  {
+    lazy_evict(state, shard, shard->capacity);
+  }
+  pthread_mutex_unlock(&shard->mutex);
+}
+
+static void lazy_destroy(storage_t *store)
+{
+  lazy_state_t *state = store->state;
+
+  for (int i = 0; i < LAZY_SHARDS; i++)
+  {
+    lazy_evict(state, &state->shards[i], 0);
+    pthread_mutex_destroy(&state->shards[i].mutex);
+  }
+  manifest_close(state->manifest);
+  free(state->open);
+  free(state->sizes);
+  free(state);
+}
+
+static void lazy_report(storage_t *store)
+{
+  lazy_state_t *state = store->state;
+  unsigned long hits = 0, fills = 0, evictions = 0;
+  int nopen = 0;
+
+  for (int i = 0; i < LAZY_SHARDS; i++)
+  {
+    pthread_mutex_lock(&state->shards[i].mutex);
+    hits += state->shards[i].hits;
+    fills += state->shards[i].fills;
+    evictions += state->shards[i].evictions;
+    nopen += state->shards[i].nopen;
+    pthread_mutex_unlock(&state->shards[i].mutex);
+  }
+
+  L(INFO, "fd cache: %lu hits, %lu opens, %lu evictions, %d files open", hits, fills, evictions, nopen);
+}
+
+// The manifest's index is already a single hash probe, so it answers exactly
+static int lazy_exists(storage_t *store, const char *key)
+{
+  return lazy_find(store->state, key) >= 0;
+}
+
+static const storage_ops_t lazy_ops = {"lazy", lazy_open, lazy_stat, lazy_read, lazy_close, lazy_destroy, lazy_report,
+                                       lazy_exists};
+
+storage_t *storage_lazy(const char *content_map, int max_open)
+{
+  lazy_state_t *state = calloc(1, sizeof(lazy_state_t));
+  size_t count;
+
+  // A compiled manifest is mapped as it is; a text map is indexed on the spot
+  if (NULL == (state->manifest = manifest_open(content_map)) &&
+      (errno != EINVAL || NULL == (state->manifest = manifest_build(content_map, NULL, 0))))
+  {
+    fprintf(stderr, "Unable to open file %s: %s.\n", content_map, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  count = manifest_count(state->manifest);
+  state->open = calloc(count > 0 ? count : 1, sizeof(lazy_fd_t *));
+  state->sizes = calloc(count > 0 ? count : 1, sizeof(size_t));
+
+  for (int i = 0; i < LAZY_SHARDS; i++)
+  {
+    pthread_mutex_init(&state->shards[i].mutex, NULL);
+    state->shards[i].capacity = max_open / LAZY_SHARDS > 0 ? max_open / LAZY_SHARDS : 1;
+  }
+
+  L(INFO, "storage: indexed %zu files, opening at most %d at a time", count, state->shards[0].capacity * LAZY_SHARDS);
+  return storage_new(&lazy_ops, state);
+}
+
+/* Latency injection ======================================================= */
+
+enum
+{
+  DIST_NONE,
+  DIST_CONST,
+  DIST_UNIFORM,
+  DIST_EXP,
+  DIST_PARETO
+};
+
+typedef struct dist_t
+{
+  int kind;
+  double a, b;
+} dist_t;
+
+typedef struct latency_state_t
+{
+  storage_t *inner;
+  dist_t open, read;
+} latency_state_t;
+
+static __thread unsigned short seed[3];
+static __thread int seeded = 0;
+
+static double uniform01()
+{
+  if (!seeded)
+  {
+    uint64_t x = now_ns() ^ (uint64_t)(uintptr_t)&seeded;
+
+    seed[0] = x;
+    seed[1] = x >> 16;
+    seed[2] = x >> 32;
+    seeded = 1;
+  }
+
+  return erand48(seed);
+}
+
+static void delay(const dist_t *dist)
+{
+  double us = 0;
+
+  switch (dist->kind)
+  {
+  case DIST_CONST:
+    us = dist->a;
+    break;
+  case DIST_UNIFORM:
+    us = dist->a + (dist->b - dist->a) * uniform01();
+    break;
+  case DIST_EXP:
+    us = -dist->a * log(1 - uniform01());
+    break;
+  case DIST_PARETO:
+    us = dist->a / pow(1 - uniform01(), 1 / dist->b);
+    break;
+  }
+
+  if (us >= 1)
+  {
+    usleep(us);
+  }
+}
+
+static int parse_dist(const char *text, dist_t *dist)
+{
+  char name[16];
+  int n = sscanf(text, "%15[a-z]:%lf:%lf", name, &dist->a, &dist->b);
+
+  if (n >= 2 && strcmp(name, "const") == 0)
+  {
+    dist->kind = DIST_CONST;
+  }
+  else if (n == 3 && strcmp(name, "uniform") == 0 && dist->b >= dist->a)
+  {
+    dist->kind = DIST_UNIFORM;
+  }
+  else if (n >= 2 && strcmp(name, "exp") == 0)
+  {
+    dist->kind = DIST_EXP;
+  }
+  else if (n == 3 && strcmp(name, "pareto") == 0 && dist->b > 0)
+  {
+    dist->kind = DIST_PARETO;
+  }
+  else
+  {
+    return -1;
+  }
+
+  return dist->a >= 0 ? 0 : -1;
+}
+
+static int latency_open(storage_t *store, const char *key, size_t *size)
+{
+  latency_state_t *state = store->state;
+
+  delay(&state->open);
+  return state->inner->ops->open(state->inner, key, size);
+}
+
+static ssize_t latency_stat(storage_t *store, const char *key)
+{
+  latency_state_t *state = store->state;
+
+  return state->inner->ops->stat(state->inner, key);
+}
+
+static ssize_t latency_read(storage_t *store, int handle, void *buf, size_t len, off_t off)
+{
+  latency_state_t *state = store->state;
+
+  delay(&state->read);
+  return state->inner->ops->read(state->inner, handle, buf, len, off);
+}
+
+static void latency_close(storage_t *store, int handle)
+{
+  latency_state_t *state = store->state;
+
+  state->inner->ops->close(state->inner, handle);
+}
+
+static void latency_destroy(storage_t *store)
+{
+  latency_state_t *state = store->state;
+
+  storage_destroy(state->inner);
+  free(state);
+}
+
+static void latency_report(storage_t *store)
+{
+  latency_state_t *state = store->state;
+
+  if (state->inner->ops->report != NULL)
+  {
+    state->inner->ops->report(state->inner);
+  }
+}
+
+// Answered without a delay: only opens and reads are slowed down
+static int latency_exists(storage_t *store, const char *key)
+{
+  latency_state_t *state = store->state;
+
+  return state->inner->ops->exists == NULL ? -1 : state->inner->ops->exists(state->inner, key);
+}
+
+static const storage_ops_t latency_ops = {"latency", latency_open, latency_stat, latency_read, latency_close, latency_destroy,
+                                          latency_report, latency_exists};
+
+storage_t *storage_latency(storage_t *inner, const char *spec)
+{
+  latency_state_t *state = calloc(1, sizeof(latency_state_t));
+  char *copy = strdup(spec), *ptr = copy, *item;
+  int res = 0;
+
+  state->inner = inner;
+  while (res == 0 && (item = strsep(&ptr, ",")) != NULL)
+  {
+    if (strncmp(item, "open=", 5) == 0)
+    {
+      res = parse_dist(item + 5, &state->open);
+    }
+    else if (strncmp(item, "read=", 5) == 0)
+    {
+      res = parse_dist(item + 5, &state->read);
+    }
+    else
+    {
+      res = -1;
+    }
+  }
+  free(copy);
+
+  if (res < 0)
+  {
+    free(state);
+    return NULL;
+  }
+
+  return storage_new(&latency_ops, state);
+}
@@ -0,0 +1,120 @@
+#ifndef __STORAGE_H__
+#define __STORAGE_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Where the server gets the files it sends.  A backend maps keys to
+ * objects; an object is opened by key, read at offsets and closed, all
+ * through an int handle that is only meaningful to the backend.  Every
+ * operation may be called from several threads at once.
+ */
+typedef struct storage_t storage_t;
+
+typedef struct storage_ops_t
+{
+  const char *name;
+
+  /*
+   * Opens the object stored under key and sets *size to its length.
+   * Returns a handle, or -1 with errno set to ENOENT if there is no such
+   * object and to anything else if it could not be fetched.
+   */
+  int (*open)(storage_t *store, const char *key, size_t *size);
+
+  /*
+   * Returns the length of the object stored under key if the backend
+   * already knows it, and -1 otherwise.  Called on the boss thread under
+   * the queue lock, so it must not do any I/O.
+   */
+  ssize_t (*stat)(storage_t *store, const char *key);
+
+  /* Reads up to len bytes at offset off, as pread does. */
+  ssize_t (*read)(storage_t *store, int handle, void *buf, size_t len, off_t off);
+
+  void (*close)(storage_t *store, int handle);
+
+  void (*destroy)(storage_t *store);
+
+  /* Logs statistics of the backend's own, if it keeps any.  May be NULL. */
+  void (*report)(storage_t *store);
+
+  /*
+   * Returns 0 if there is certainly no object under key, 1 if there may
+   * be and -1 if the backend has no filter to tell.  Called by the boss
+   * thread for every request, so it must not block.  May be NULL if the
+   * backend never keeps a filter.
+   */
+  int (*exists)(storage_t *store, const char *key);
+} storage_ops_t;
+
+struct storage_t
+{
+  const storage_ops_t *ops;
+  void *state;
+  int filtered; // exists has given storage_may_exist an answer
+};
+
+/* Wraps a backend's operations and state for the functions below. */
+storage_t *storage_new(const storage_ops_t *ops, void *state);
+
+int storage_open(storage_t *store, const char *key, size_t *size);
+ssize_t storage_stat(storage_t *store, const char *key);
+ssize_t storage_read(storage_t *store, int handle, void *buf, size_t len, off_t off);
+void storage_close(storage_t *store, int handle);
+
+/*
+ * Returns 0 if the backend knows there is no object under key, counting
+ * how often it does for storage_report.
+ */
+int storage_may_exist(storage_t *store, const char *key);
+void storage_destroy(storage_t *store);
+
+/* The files named in a content map, opened once by the content library. */
+storage_t *storage_local(const char *content_map);
+
+/*
+ * The files named in a content map, or in a manifest compiled from one by
+ * gfmanifest, opened on first use instead of at startup.  At most about
+ * max_open of them are kept open, in an LRU cache split into shards by
+ * key; a file is only closed once no transfer is reading it.
+ */
+storage_t *storage_lazy(const char *content_map, int max_open);
+
+/*
+ * Every regular file under dir, each served under its path relative to dir
+ * with a leading '/'.  Keys are resolved with openat2 so that no key can
+ * reach outside dir; up to about max_open resolutions, including misses,
+ * are cached and rechecked against the file system after a second.
+ */
+storage_t *storage_root(const char *dir, int max_open);
+
+/* The files named in a content map, read into memory up front. */
+storage_t *storage_memory(const char *content_map);
+
+/*
+ * Wraps another backend, sleeping before each open and each read for a
+ * delay drawn from a distribution.  The spec is a comma-separated list of
+ * "open=" or "read=" followed by one of
+ *
+ *   const:US          always US microseconds
+ *   uniform:LO:HI     uniformly between LO and HI microseconds
+ *   exp:MEAN          exponentially distributed with the given mean
+ *   pareto:MIN:ALPHA  Pareto distributed from MIN, with shape ALPHA
+ *
+ * Returns NULL if the spec cannot be parsed.
+ */
+storage_t *storage_latency(storage_t *inner, const char *spec);
+
+/*
+ * Fetches each object from an upstream GETFILE server at host:port when it
+ * is opened, buffering it in an anonymous file until it is closed.
+ * Returns NULL if the address cannot be parsed.
+ */
+storage_t *storage_upstream(const char *address);
+
+/* Logs how many objects were opened and how long opens and reads took. */
+void storage_report(storage_t *store);
+
+#endif
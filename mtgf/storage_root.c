@@ -0,0 +1,473 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+#include "storage.h"
+#include "log.h"
+
+//
+//  Kept apart from storage.c for the Linux-only openat2 interface.
+//
+
+#define ROOT_SHARDS 16
+#define ROOT_REVALIDATE_NS 1000000000ULL
+
+//
+//  A resolved key: an open file, or a cached miss when fd is -1.  Entries
+//  come from a fixed pool, so handles are pool indices.  An entry in the
+//  table is on its shard's LRU list; one that was replaced while still in
+//  use is detached instead and returns to the free list at its last close.
+//
+typedef struct root_entry_t
+{
+  char *key;
+  uint64_t hash;
+  int fd;
+  int refs;
+  int detached;
+  size_t size;
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  uint64_t checked_ns;
+  struct root_entry_t *prev, *next;
+  struct root_entry_t *chain; // hash bucket, or free list
+} root_entry_t;
+
+typedef struct root_shard_t
+{
+  pthread_mutex_t mutex;
+  root_entry_t **buckets;
+  size_t mask;
+  root_entry_t *head, *tail;
+  root_entry_t *free;
+  unsigned long hits, misses, revalidations, invalidations, evictions, overflows;
+} __attribute__((aligned(64))) root_shard_t;
+
+typedef struct root_state_t
+{
+  int root_fd;
+  root_entry_t *entries;
+  int nentries;
+  int per_shard;
+  root_shard_t shards[ROOT_SHARDS];
+} root_state_t;
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t key_hash(const char *key)
+{
+  uint64_t hash = 14695981039346656037ULL;
+
+  while (*key != '\0')
+  {
+    hash ^= (unsigned char)*key++;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+//
+//  Opens a key relative to the root.  RESOLVE_BENEATH refuses ".."
+//  components, absolute symlinks and anything else that would leave the
+//  tree; such keys, like those that are not regular files, do not exist.
+//
+static int resolve(root_state_t *state, const char *key, struct stat *st)
+{
+  struct open_how how = {0};
+  int fd;
+
+  if (key[0] != '/')
+  {
+    errno = ENOENT;
+    return -1;
+  }
+
+  how.flags = O_RDONLY | O_CLOEXEC;
+  how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+  if ((fd = syscall(SYS_openat2, state->root_fd, key[1] != '\0' ? key + 1 : ".", &how, sizeof(how))) < 0)
+  {
+    if (errno == EXDEV || errno == ELOOP || errno == ENOTDIR || errno == EISDIR)
+    {
+      errno = ENOENT;
+    }
+    return -1;
+  }
+
+  if (fstat(fd, st) < 0 || !S_ISREG(st->st_mode))
+  {
+    close(fd);
+    errno = ENOENT;
+    return -1;
+  }
+  return fd;
+}
+
+static root_entry_t *lookup(root_shard_t *shard, const char *key, uint64_t hash)
+{
+  root_entry_t *entry;
+
+  for (entry = shard->buckets[hash & shard->mask]; entry != NULL; entry = entry->chain)
+  {
+    if (entry->hash == hash && strcmp(entry->key, key) == 0)
+    {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static void lru_unlink(root_shard_t *shard, root_entry_t *entry)
+{
+  *(entry->prev != NULL ? &entry->prev->next : &shard->head) = entry->next;
+  *(entry->next != NULL ? &entry->next->prev : &shard->tail) = entry->prev;
+}
+
+static void lru_push(root_shard_t *shard, root_entry_t *entry)
+{
+  entry->prev = NULL;
+  entry->next = shard->head;
+  *(shard->head != NULL ? &shard->head->prev : &shard->tail) = entry;
+  shard->head = entry;
+}
+
+// Takes an entry out of the table and off the LRU list
+static void unhash(root_shard_t *shard, root_entry_t *entry)
+{
+  root_entry_t **link = &shard->buckets[entry->hash & shard->mask];
+
+  while (*link != entry)
+  {
+    link = &(*link)->chain;
+  }
+  *link = entry->chain;
+  lru_unlink(shard, entry);
+}
+
+static void release(root_shard_t *shard, root_entry_t *entry)
+{
+  if (entry->fd >= 0)
+  {
+    close(entry->fd);
+  }
+  free(entry->key);
+  entry->key = NULL;
+  entry->detached = 0;
+  entry->chain = shard->free;
+  shard->free = entry;
+}
+
+// Returns an unused entry, evicting the least recently used idle one if need be
+static root_entry_t *take_entry(root_shard_t *shard)
+{
+  root_entry_t *entry;
+
+  if (NULL != (entry = shard->free))
+  {
+    shard->free = entry->chain;
+    return entry;
+  }
+
+  for (entry = shard->tail; entry != NULL && entry->refs > 0; entry = entry->prev)
+    ;
+  if (entry == NULL)
+  {
+    return NULL;
+  }
+
+  unhash(shard, entry);
+  release(shard, entry);
+  shard->evictions++;
+  shard->free = entry->chain;
+  return entry;
+}
+
+static void fill(root_entry_t *entry, int fd, const struct stat *st, uint64_t now)
+{
+  entry->fd = fd;
+  entry->size = fd >= 0 ? st->st_size : 0;
+  entry->dev = fd >= 0 ? st->st_dev : 0;
+  entry->ino = fd >= 0 ? st->st_ino : 0;
+  if (fd >= 0)
+  {
+    entry->mtime = st->st_mtim;
+  }
+  entry->checked_ns = now;
+}
+
+static int same_file(const root_entry_t *entry, const struct stat *st)
+{
+  return entry->fd >= 0 && entry->dev == st->st_dev && entry->ino == st->st_ino &&
+         entry->size == (size_t)st->st_size && entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+         entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+//
+//  Finds or resolves key and, with ref, takes a reference to it.  Entries
+//  are trusted for ROOT_REVALIDATE_NS and then checked against a fresh
+//  resolution, which replaces them if the file has changed.  Returns a
+//  handle, or -1 with errno set.  Handles at or above nentries are
+//  descriptors that found no room in the cache, offset by nentries.
+//
+static int root_lookup(root_state_t *state, const char *key, int ref, size_t *size)
+{
+  uint64_t hash = key_hash(key), now = now_ns();
+  root_shard_t *shard = &state->shards[hash % ROOT_SHARDS];
+  root_entry_t *entry;
+  struct stat st;
+  int fd, err;
+
+  pthread_mutex_lock(&shard->mutex);
+  if (NULL != (entry = lookup(shard, key, hash)) && now - entry->checked_ns < ROOT_REVALIDATE_NS)
+  {
+    shard->hits++;
+    lru_unlink(shard, entry);
+    lru_push(shard, entry);
+    goto found;
+  }
+  pthread_mutex_unlock(&shard->mutex);
+
+  // Resolve outside the lock so that a slow lookup does not hold up the shard
+  fd = resolve(state, key, &st);
+  err = errno;
+  if (fd < 0 && err != ENOENT)
+  {
+    L(WARN, "unable to open %s: %s", key, strerror(err));
+    errno = err;
+    return -1;
+  }
+
+  pthread_mutex_lock(&shard->mutex);
+  if (NULL != (entry = lookup(shard, key, hash)))
+  {
+    if (fd >= 0 ? same_file(entry, &st) : entry->fd < 0)
+    {
+      shard->revalidations++;
+      if (fd >= 0)
+      {
+        close(fd);
+      }
+      entry->checked_ns = now;
+      lru_unlink(shard, entry);
+      lru_push(shard, entry);
+      goto found;
+    }
+
+    shard->invalidations++;
+    unhash(shard, entry);
+    if (entry->refs > 0)
+    {
+      entry->detached = 1;
+    }
+    else
+    {
+      release(shard, entry);
+    }
+  }
+  shard->misses++;
+
+  if (NULL == (entry = take_entry(shard)))
+  {
+    // Every entry is in use: serve this one without caching it
+    shard->overflows++;
+    pthread_mutex_unlock(&shard->mutex);
+    if (fd < 0)
+    {
+      errno = ENOENT;
+      return -1;
+    }
+    *size = st.st_size;
+    if (!ref)
+    {
+      close(fd);
+      return 0;
+    }
+    return state->nentries + fd;
+  }
+
+  entry->key = strdup(key);
+  entry->hash = hash;
+  entry->refs = 0;
+  fill(entry, fd, &st, now);
+  entry->chain = shard->buckets[hash & shard->mask];
+  shard->buckets[hash & shard->mask] = entry;
+  lru_push(shard, entry);
+
+found:
+  if (entry->fd < 0)
+  {
+    pthread_mutex_unlock(&shard->mutex);
+    errno = ENOENT;
+    return -1;
+  }
+  if (ref)
+  {
+    entry->refs++;
+  }
+  *size = entry->size;
+  pthread_mutex_unlock(&shard->mutex);
+  return entry - state->entries;
+}
+
+static int root_open(storage_t *store, const char *key, size_t *size)
+{
+  return root_lookup(store->state, key, 1, size);
+}
+
+// Only what the cache holds, however old; resolving is left to the worker that opens it
+static ssize_t root_stat(storage_t *store, const char *key)
+{
+  root_state_t *state = store->state;
+  uint64_t hash = key_hash(key);
+  root_shard_t *shard = &state->shards[hash % ROOT_SHARDS];
+  root_entry_t *entry;
+  ssize_t size = -1;
+
+  pthread_mutex_lock(&shard->mutex);
+  if (NULL != (entry = lookup(shard, key, hash)) && entry->fd >= 0)
+  {
+    size = entry->size;
+  }
+  pthread_mutex_unlock(&shard->mutex);
+  return size;
+}
+
+static ssize_t root_read(storage_t *store, int handle, void *buf, size_t len, off_t off)
+{
+  root_state_t *state = store->state;
+
+  return pread(handle >= state->nentries ? handle - state->nentries : state->entries[handle].fd, buf, len, off);
+}
+
+static void root_close(storage_t *store, int handle)
+{
+  root_state_t *state = store->state;
+  root_entry_t *entry;
+  root_shard_t *shard;
+
+  if (handle >= state->nentries)
+  {
+    close(handle - state->nentries);
+    return;
+  }
+
+  entry = &state->entries[handle];
+  shard = &state->shards[handle / state->per_shard];
+  pthread_mutex_lock(&shard->mutex);
+  if (--entry->refs == 0 && entry->detached)
+  {
+    release(shard, entry);
+  }
+  pthread_mutex_unlock(&shard->mutex);
+}
+
+static void root_destroy(storage_t *store)
+{
+  root_state_t *state = store->state;
+
+  for (int i = 0; i < state->nentries; i++)
+  {
+    if (state->entries[i].key != NULL && state->entries[i].fd >= 0)
+    {
+      close(state->entries[i].fd);
+    }
+    free(state->entries[i].key);
+  }
+  for (int i = 0; i < ROOT_SHARDS; i++)
+  {
+    free(state->shards[i].buckets);
+    pthread_mutex_destroy(&state->shards[i].mutex);
+  }
+  close(state->root_fd);
+  free(state->entries);
+  free(state);
+}
+
+static void root_report(storage_t *store)
+{
+  root_state_t *state = store->state;
+  unsigned long hits = 0, misses = 0, revalidations = 0, invalidations = 0, evictions = 0, overflows = 0;
+
+  for (int i = 0; i < ROOT_SHARDS; i++)
+  {
+    root_shard_t *shard = &state->shards[i];
+
+    pthread_mutex_lock(&shard->mutex);
+    hits += shard->hits;
+    misses += shard->misses;
+    revalidations += shard->revalidations;
+    invalidations += shard->invalidations;
+    evictions += shard->evictions;
+    overflows += shard->overflows;
+    pthread_mutex_unlock(&shard->mutex);
+  }
+
+  L(INFO, "path cache: %lu hits, %lu misses, %lu revalidated, %lu invalidated, %lu evictions, %lu uncached",
+    hits, misses, revalidations, invalidations, evictions, overflows);
+}
+
+static const storage_ops_t root_ops = {"root", root_open, root_stat, root_read, root_close, root_destroy, root_report};
+
+storage_t *storage_root(const char *dir, int max_open)
+{
+  root_state_t *state = calloc(1, sizeof(root_state_t));
+  struct open_how how = {0};
+  size_t nbuckets;
+  int fd;
+
+  if ((state->root_fd = open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0)
+  {
+    fprintf(stderr, "Unable to open directory %s: %s.\n", dir, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  how.flags = O_PATH | O_CLOEXEC;
+  how.resolve = RESOLVE_BENEATH;
+  if ((fd = syscall(SYS_openat2, state->root_fd, ".", &how, sizeof(how))) < 0)
+  {
+    fprintf(stderr, "Serving a directory needs openat2 (Linux 5.6 or later): %s.\n", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+
+  state->per_shard = max_open / ROOT_SHARDS > 0 ? max_open / ROOT_SHARDS : 1;
+  state->nentries = state->per_shard * ROOT_SHARDS;
+  state->entries = calloc(state->nentries, sizeof(root_entry_t));
+  for (nbuckets = 16; nbuckets < 2 * (size_t)state->per_shard; nbuckets *= 2)
+    ;
+
+  for (int i = 0; i < ROOT_SHARDS; i++)
+  {
+    root_shard_t *shard = &state->shards[i];
+
+    pthread_mutex_init(&shard->mutex, NULL);
+    shard->buckets = calloc(nbuckets, sizeof(root_entry_t *));
+    shard->mask = nbuckets - 1;
+    for (int j = state->per_shard - 1; j >= 0; j--)
+    {
+      root_entry_t *entry = &state->entries[i * state->per_shard + j];
+
+      entry->chain = shard->free;
+      shard->free = entry;
+    }
+  }
+
+  L(INFO, "storage: serving %s, caching up to %d paths", dir, state->nentries);
+  return storage_new(&root_ops, state);
+}
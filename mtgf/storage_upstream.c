@@ -0,0 +1,141 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "gfclient-student.h"
+#include "storage.h"
+#include "log.h"
+
+//
+//  Kept apart from storage.c because gfclient.h and gfserver.h define the
+//  same status names and cannot share a translation unit.
+//
+
+typedef struct upstream_state_t
+{
+  char *host;
+  unsigned short port;
+} upstream_state_t;
+
+typedef struct upstream_fetch_t
+{
+  int fd;
+  int failed;
+} upstream_fetch_t;
+
+static void upstream_write(void *data, size_t len, void *arg)
+{
+  upstream_fetch_t *fetch = arg;
+  ssize_t n;
+
+  while (!fetch->failed && len > 0)
+  {
+    if ((n = write(fetch->fd, data, len)) < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      L(WARN, "upstream: buffering failed: %s", strerror(errno));
+      fetch->failed = 1;
+      break;
+    }
+    data = (char *)data + n;
+    len -= n;
+  }
+}
+
+static int upstream_open(storage_t *store, const char *key, size_t *size)
+{
+  upstream_state_t *state = store->state;
+  upstream_fetch_t fetch = {-1, 0};
+  gfcrequest_t *gfr;
+  gfstatus_t status;
+  int res;
+
+  if ((fetch.fd = memfd_create("gfserver-upstream", MFD_CLOEXEC)) < 0)
+  {
+    L(WARN, "upstream: memfd_create: %s", strerror(errno));
+    return -1;
+  }
+
+  if (NULL == (gfr = gfc_create()))
+  {
+    L(WARN, "upstream: unable to allocate a request for %s", key);
+    close(fetch.fd);
+    errno = ENOMEM;
+    return -1;
+  }
+  gfc_set_server(&gfr, state->host);
+  gfc_set_port(&gfr, state->port);
+  gfc_set_path(&gfr, key);
+  gfc_set_writefunc(&gfr, upstream_write);
+  gfc_set_writearg(&gfr, &fetch);
+
+  res = gfc_perform(&gfr);
+  status = gfc_get_status(&gfr);
+  *size = gfc_get_bytesreceived(&gfr);
+  gfc_cleanup(&gfr);
+
+  if (res < 0 || status != GF_OK || fetch.failed)
+  {
+    L(DEBUG, "upstream: %s: %s", key, gfc_strstatus(status));
+    close(fetch.fd);
+    errno = (res == 0 && status == GF_FILE_NOT_FOUND) ? ENOENT : EIO;
+    return -1;
+  }
+
+  return fetch.fd;
+}
+
+// Sizes are only known once an object has been fetched
+static ssize_t upstream_stat(storage_t *store, const char *key)
+{
+  return -1;
+}
+
+static ssize_t upstream_read(storage_t *store, int fd, void *buf, size_t len, off_t off)
+{
+  return pread(fd, buf, len, off);
+}
+
+static void upstream_close(storage_t *store, int fd)
+{
+  close(fd);
+}
+
+static void upstream_destroy(storage_t *store)
+{
+  upstream_state_t *state = store->state;
+
+  free(state->host);
+  free(state);
+}
+
+static const storage_ops_t upstream_ops = {"upstream", upstream_open, upstream_stat, upstream_read, upstream_close, upstream_destroy,
+                                           NULL};
+
+storage_t *storage_upstream(const char *address)
+{
+  upstream_state_t *state;
+  const char *colon = strrchr(address, ':');
+  char *end;
+  long port;
+
+  if (colon == NULL || colon == address || (port = strtol(colon + 1, &end, 10)) <= 0 ||
+      port > 65535 || *end != '\0')
+  {
+    return NULL;
+  }
+
+  state = malloc(sizeof(upstream_state_t));
+  state->host = strndup(address, colon - address);
+  state->port = port;
+  gfc_global_init();
+
+  L(INFO, "storage: fetching from upstream server %s:%u", state->host, state->port);
+  return storage_new(&upstream_ops, state);
+}
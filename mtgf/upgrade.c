@@ -0,0 +1,245 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+
+#include "gfserver-student.h"
+#include "upgrade.h"
+#include "log.h"
+
+// The new process finds the Unix socket at this descriptor, named in the environment
+#define UPGRADE_ENV "GFSERVER_UPGRADE_FD"
+#define UPGRADE_FD 3
+
+extern char **environ;
+
+static char **upgrade_argv;
+static gfserver_t *upgrade_gfs;
+static int handoff_fd = -1;
+
+static int send_fd(int sock, int fd)
+{
+  char byte = 0, control[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = {&byte, 1};
+  struct msghdr msg = {0};
+  struct cmsghdr *cmsg;
+
+  memset(control, 0, sizeof(control));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+static int recv_fd(int sock)
+{
+  char byte, control[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = {&byte, 1};
+  struct msghdr msg = {0};
+  struct cmsghdr *cmsg;
+  int fd;
+
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1 || NULL == (cmsg = CMSG_FIRSTHDR(&msg)) ||
+      cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+  {
+    return -1;
+  }
+
+  memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  return fd;
+}
+
+int upgrade_inherit()
+{
+  char *value = getenv(UPGRADE_ENV);
+  int fd;
+
+  if (value == NULL)
+  {
+    return -1;
+  }
+
+  handoff_fd = atoi(value);
+  unsetenv(UPGRADE_ENV);
+  fcntl(handoff_fd, F_SETFD, FD_CLOEXEC);
+
+  if ((fd = recv_fd(handoff_fd)) < 0)
+  {
+    L(ERROR, "upgrade: no listening socket from the old process: %s", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  L(INFO, "upgrade: took over the listening socket from process %d", getppid());
+  return fd;
+}
+
+void upgrade_ready()
+{
+  char byte = 0;
+
+  if (handoff_fd < 0)
+  {
+    return;
+  }
+
+  if (write(handoff_fd, &byte, 1) != 1)
+  {
+    L(WARN, "upgrade: unable to notify the old process: %s", strerror(errno));
+  }
+  close(handoff_fd);
+  handoff_fd = -1;
+}
+
+// Copies the environment, less any stale handoff variable, and adds var
+static char **make_env(char *var)
+{
+  size_t n = 0, len = strlen(UPGRADE_ENV);
+  char **env;
+
+  while (environ[n] != NULL)
+  {
+    n++;
+  }
+
+  env = malloc((n + 2) * sizeof(char *));
+  n = 0;
+  for (char **e = environ; *e != NULL; e++)
+  {
+    if (strncmp(*e, UPGRADE_ENV, len) != 0 || (*e)[len] != '=')
+    {
+      env[n++] = *e;
+    }
+  }
+  env[n++] = var;
+  env[n] = NULL;
+  return env;
+}
+
+//
+//  Runs the command line again with one end of a socket pair as UPGRADE_FD,
+//  sends it the listening socket and waits for it to report that it has
+//  taken over.  Returns 0 once it has and -1 if it failed first.
+//
+static int spawn(int listen_fd)
+{
+  char var[32], byte;
+  char **env;
+  sigset_t none;
+  pid_t pid;
+  int sv[2];
+  ssize_t n;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+  {
+    L(ERROR, "upgrade: socketpair: %s", strerror(errno));
+    return -1;
+  }
+
+  // Only async-signal-safe calls are allowed between fork and exec
+  snprintf(var, sizeof(var), "%s=%d", UPGRADE_ENV, UPGRADE_FD);
+  env = make_env(var);
+  sigemptyset(&none);
+
+  if ((pid = fork()) == 0)
+  {
+    if (sv[1] == UPGRADE_FD)
+    {
+      fcntl(UPGRADE_FD, F_SETFD, 0);
+    }
+    else
+    {
+      dup2(sv[1], UPGRADE_FD);
+    }
+    close_range(UPGRADE_FD + 1, ~0U, 0);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    execvpe(upgrade_argv[0], upgrade_argv, env);
+    _exit(127);
+  }
+  free(env);
+  close(sv[1]);
+
+  if (pid < 0)
+  {
+    L(ERROR, "upgrade: fork: %s", strerror(errno));
+    close(sv[0]);
+    return -1;
+  }
+
+  if (send_fd(sv[0], listen_fd) < 0)
+  {
+    L(ERROR, "upgrade: unable to send the listening socket: %s", strerror(errno));
+  }
+
+  while ((n = read(sv[0], &byte, 1)) < 0 && errno == EINTR)
+    ;
+  close(sv[0]);
+
+  if (n != 1)
+  {
+    L(ERROR, "upgrade: new process %d exited before taking over, still serving", pid);
+    waitpid(pid, NULL, 0);
+    return -1;
+  }
+
+  L(INFO, "upgrade: process %d has taken over, draining", pid);
+  return 0;
+}
+
+static void *upgrade_worker(void *arg)
+{
+  sigset_t set;
+  int signo, fd;
+
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR2);
+  while (sigwait(&set, &signo) == 0)
+  {
+    if ((fd = gfserver_get_listenfd(&upgrade_gfs)) < 0)
+    {
+      L(WARN, "upgrade: not listening yet");
+      continue;
+    }
+
+    L(INFO, "SIGUSR2: starting %s", upgrade_argv[0]);
+    if (spawn(fd) == 0)
+    {
+      gfserver_stop(&upgrade_gfs);
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+void upgrade_init(char **argv, gfserver_t *gfs)
+{
+  pthread_t thread;
+
+  upgrade_argv = argv;
+  upgrade_gfs = gfs;
+  if (pthread_create(&thread, NULL, upgrade_worker, NULL) != 0)
+  {
+    L(ERROR, "Can't create upgrade thread");
+    exit(EXIT_FAILURE);
+  }
+  pthread_detach(thread);
+}
@@ -0,0 +1,32 @@
+#ifndef __UPGRADE_H__
+#define __UPGRADE_H__
+
+#include "gfserver.h"
+
+/*
+ * Zero-downtime restarts.  On SIGUSR2 the server runs its own command line
+ * again, which picks up a new build installed at the same path, and hands
+ * the new process its listening socket over a Unix socket with SCM_RIGHTS.
+ * Connections keep queueing on the socket throughout.  Once the new
+ * process is ready to accept it says so, and the old one stops accepting,
+ * finishes the responses it has started and exits.  If the new process
+ * fails before then, the old one carries on serving.
+ */
+
+/*
+ * Returns the listening socket handed over by the process this one is
+ * replacing, or -1 if it was started normally.
+ */
+int upgrade_inherit();
+
+/* Tells the process being replaced, if any, that this one has taken over. */
+void upgrade_ready();
+
+/*
+ * Starts the thread that waits for SIGUSR2, which must already be blocked
+ * in every thread, and calls gfserver_stop on gfs once a new process has
+ * taken over.  argv is the command line to run.
+ */
+void upgrade_init(char **argv, gfserver_t *gfs);
+
+#endif
@@ -0,0 +1,131 @@
+#include <stdlib.h>
+#include <time.h>
+
+#include "wheel.h"
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t current_tick(wheel_t *wheel)
+{
+  return (now_ns() - wheel->start_ns) / (wheel->tick_ms * 1000000ULL);
+}
+
+void wheel_init(wheel_t *wheel, unsigned nslots, unsigned long tick_ms)
+{
+  unsigned n = 1;
+
+  while (n < nslots)
+  {
+    n <<= 1;
+  }
+  wheel->slots = calloc(n, sizeof(wheel_timer_t *));
+  wheel->nslots = n;
+  wheel->tick_ms = tick_ms > 0 ? tick_ms : 1;
+  wheel->start_ns = now_ns();
+  wheel->now = 0;
+  wheel->count = 0;
+}
+
+void wheel_add(wheel_t *wheel, wheel_timer_t *timer, unsigned long timeout_ms, void *data)
+{
+  wheel_timer_t **slot;
+
+  // At least one tick ahead, so that it cannot land in a slot already passed
+  timer->tick = current_tick(wheel) + (timeout_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+  if (timer->tick <= wheel->now)
+  {
+    timer->tick = wheel->now + 1;
+  }
+  timer->data = data;
+
+  slot = &wheel->slots[timer->tick & (wheel->nslots - 1)];
+  timer->prev = NULL;
+  timer->next = *slot;
+  if (*slot != NULL)
+  {
+    (*slot)->prev = timer;
+  }
+  *slot = timer;
+  wheel->count++;
+}
+
+void wheel_cancel(wheel_t *wheel, wheel_timer_t *timer)
+{
+  if (timer->prev != NULL)
+  {
+    timer->prev->next = timer->next;
+  }
+  else
+  {
+    wheel->slots[timer->tick & (wheel->nslots - 1)] = timer->next;
+  }
+  if (timer->next != NULL)
+  {
+    timer->next->prev = timer->prev;
+  }
+  timer->prev = timer->next = NULL;
+  wheel->count--;
+}
+
+int wheel_expire(wheel_t *wheel, void (*expired)(void *data))
+{
+  uint64_t tick = current_tick(wheel);
+  wheel_timer_t *timer, *next;
+  int n = 0;
+
+  // After a long pause one revolution visits every slot once
+  if (tick - wheel->now > wheel->nslots)
+  {
+    wheel->now = tick - wheel->nslots;
+  }
+
+  while (wheel->now < tick)
+  {
+    wheel->now++;
+    for (timer = wheel->slots[wheel->now & (wheel->nslots - 1)]; timer != NULL; timer = next)
+    {
+      next = timer->next;
+      if (timer->tick <= tick)
+      {
+        wheel_cancel(wheel, timer);
+        expired(timer->data);
+        n++;
+      }
+    }
+  }
+  return n;
+}
+
+int wheel_timeout(wheel_t *wheel)
+{
+  uint64_t tick, elapsed;
+
+  if (wheel->count == 0)
+  {
+    return -1;
+  }
+
+  // The first slot ahead that holds anything, though it may be for a later revolution
+  for (tick = wheel->now + 1; tick <= wheel->now + wheel->nslots; tick++)
+  {
+    if (wheel->slots[tick & (wheel->nslots - 1)] != NULL)
+    {
+      break;
+    }
+  }
+
+  elapsed = (now_ns() - wheel->start_ns) / 1000000ULL;
+  return tick * wheel->tick_ms <= elapsed ? 0 : (int)(tick * wheel->tick_ms - elapsed);
+}
+
+void wheel_destroy(wheel_t *wheel)
+{
+  free(wheel->slots);
+  wheel->slots = NULL;
+}
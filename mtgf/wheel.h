@@ -0,0 +1,59 @@
+#ifndef __WHEEL_H__
+#define __WHEEL_H__
+
+#include <stdint.h>
+
+/*
+ * A hashed timer wheel for deadlines that are many and mostly cancelled,
+ * such as one per connection still sending its request.  Time advances in
+ * ticks of a fixed number of milliseconds; a timer sits in the slot of the
+ * tick it expires on, so adding and cancelling are O(1) and expiring only
+ * looks at the slots of the ticks that have passed.  Deadlines further off
+ * than the wheel turns in one revolution simply stay in their slot until
+ * their revolution comes round.  Not thread-safe: one thread owns a wheel.
+ */
+
+typedef struct wheel_timer_t
+{
+  struct wheel_timer_t *prev, *next;
+  uint64_t tick; // the tick it expires on
+  void *data;
+} wheel_timer_t;
+
+typedef struct wheel_t
+{
+  wheel_timer_t **slots;
+  unsigned nslots; // a power of two
+  unsigned long tick_ms;
+  uint64_t start_ns; // tick 0
+  uint64_t now; // the last tick expired
+  unsigned long count;
+} wheel_t;
+
+/* Sets up a wheel of nslots slots, rounded up to a power of two. */
+void wheel_init(wheel_t *wheel, unsigned nslots, unsigned long tick_ms);
+
+/*
+ * Arms timer to expire after timeout_ms, rounded up to whole ticks.  data
+ * is handed back by wheel_expire.  The timer must not already be armed.
+ */
+void wheel_add(wheel_t *wheel, wheel_timer_t *timer, unsigned long timeout_ms, void *data);
+
+/* Disarms an armed timer. */
+void wheel_cancel(wheel_t *wheel, wheel_timer_t *timer);
+
+/*
+ * Disarms every timer whose deadline has passed and calls expired with its
+ * data, which may free the timer.  Returns how many expired.
+ */
+int wheel_expire(wheel_t *wheel, void (*expired)(void *data));
+
+/*
+ * Returns how many milliseconds may pass before wheel_expire has work, for
+ * use as a poll timeout, or -1 when no timer is armed.
+ */
+int wheel_timeout(wheel_t *wheel);
+
+void wheel_destroy(wheel_t *wheel);
+
+#endif
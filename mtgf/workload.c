@@ -1,22 +1,80 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <math.h>
 #include <pthread.h>
 
 #include "workload.h"
 
-static char *gWorkloadPathArray[100];
-static unsigned short int gUniqueWorkloadPaths = 0;
+/*
+ * Paths live back to back in a single arena and are addressed by offset,
+ * so loading millions of them costs a handful of reallocs rather than one
+ * malloc per path.
+ */
+static char *gPathArena = NULL;
+static size_t gArenaLen = 0, gArenaCap = 0;
+static size_t *gPathOffsets = NULL;
+static double *gTimestamps = NULL;
+static size_t gUniqueWorkloadPaths = 0, gPathCap = 0;
+static int gHasTimestamps = 0;
 
-static pthread_mutex_t counter_mutex;
-static int counter = 0;
+static pthread_mutex_t counter_mutex = PTHREAD_MUTEX_INITIALIZER;
 static int mode = WORKLOAD_SEQ;
+static size_t counter = 0;
+static unsigned short xsubi[3] = {0x330e, 0xabcd, 0x1234};
 
-int workload_init(char *workload_path) {
-  int i = 0;
-  char temp_buf[256];
+static double zipf_skew = 0.99;
+static double *zipf_cdf = NULL;
+static double hot_fraction = 0.2;
+static double hot_probability = 0.8;
+
+static char *path_at(size_t index){
+  return gPathArena + gPathOffsets[index];
+}
+
+static int add_path(const char *path, double timestamp){
+  size_t len = strlen(path) + 1;
+
+  if(gArenaLen + len > gArenaCap){
+    size_t cap = gArenaCap ? gArenaCap : 4096;
+    char *arena;
+    while(cap < gArenaLen + len)
+      cap *= 2;
+    if(NULL == (arena = realloc(gPathArena, cap)))
+      return -1;
+    gPathArena = arena;
+    gArenaCap = cap;
+  }
+
+  if(gUniqueWorkloadPaths == gPathCap){
+    size_t cap = gPathCap ? 2 * gPathCap : 128;
+    size_t *offsets = realloc(gPathOffsets, cap * sizeof(size_t));
+    double *timestamps;
+    if(NULL == offsets)
+      return -1;
+    gPathOffsets = offsets;
+    if(NULL == (timestamps = realloc(gTimestamps, cap * sizeof(double))))
+      return -1;
+    gTimestamps = timestamps;
+    gPathCap = cap;
+  }
+
+  memcpy(gPathArena + gArenaLen, path, len);
+  gPathOffsets[gUniqueWorkloadPaths] = gArenaLen;
+  gTimestamps[gUniqueWorkloadPaths] = timestamp;
+  gArenaLen += len;
+  gUniqueWorkloadPaths++;
+
+  return 0;
+}
 
+int workload_init(char *workload_path) {
   FILE *file_handle;
+  char *line = NULL, *first, *second, *end, *save;
+  size_t line_cap = 0;
+  double timestamp, last = 0;
+  int all_timestamps = 1;
 
   file_handle = fopen(workload_path, "r");
   if (file_handle == NULL) {
@@ -24,30 +82,217 @@ int workload_init(char *workload_path) {
     return EXIT_FAILURE;
   }
 
-  while (fscanf(file_handle, "%s", temp_buf) != EOF)
-    gWorkloadPathArray[i++] = strdup(temp_buf);
+  while (getline(&line, &line_cap, file_handle) != -1) {
+    if (NULL == (first = strtok_r(line, " \t\r\n", &save)))
+      continue;
+    second = strtok_r(NULL, " \t\r\n", &save);
 
-  gUniqueWorkloadPaths = i;
+    timestamp = 0;
+    if (second != NULL) {
+      timestamp = strtod(first, &end);
+      if (*end != '\0') {
+        fprintf(stderr, "invalid timestamp %s in workload file %s\n", first, workload_path);
+        free(line);
+        fclose(file_handle);
+        return EXIT_FAILURE;
+      }
+      /* a trace is replayed in file order, so time must not run backwards */
+      if (timestamp < last) {
+        fprintf(stderr, "timestamp %s goes backwards in workload file %s\n", first, workload_path);
+        free(line);
+        fclose(file_handle);
+        return EXIT_FAILURE;
+      }
+      last = timestamp;
+      first = second;
+    } else {
+      all_timestamps = 0;
+    }
 
-  pthread_mutex_init(&counter_mutex, NULL);
+    if (add_path(first, timestamp) < 0) {
+      fprintf(stderr, "out of memory loading workload file %s\n", workload_path);
+      free(line);
+      fclose(file_handle);
+      return EXIT_FAILURE;
+    }
+  }
 
+  free(line);
   fclose(file_handle);
 
+  if (gUniqueWorkloadPaths == 0) {
+    fprintf(stderr, "workload file %s is empty\n", workload_path);
+    return EXIT_FAILURE;
+  }
+
+  gHasTimestamps = all_timestamps;
+
   return EXIT_SUCCESS;
 }
 
-unsigned short int workload_num_unique_paths(){
+int workload_parse_mode(const char *name){
+  static const char *names[] = {"seq", "rnd", "zipf", "hotspot", "trace"};
+  int i;
+
+  for(i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    if(strcasecmp(name, names[i]) == 0)
+      return i;
+
+  return -1;
+}
+
+/*
+ * Cumulative distribution over ranks 1..n with P(k) proportional to
+ * 1/k^skew.  Sampling is a binary search, so any skew > 0 works and the
+ * cost per path is O(log n) after an O(n) setup.
+ */
+static int build_zipf(){
+  double sum = 0;
+  size_t i;
+
+  free(zipf_cdf);
+  if(NULL == (zipf_cdf = malloc(gUniqueWorkloadPaths * sizeof(double))))
+    return -1;
+
+  for(i = 0; i < gUniqueWorkloadPaths; i++){
+    sum += 1.0 / pow((double)(i + 1), zipf_skew);
+    zipf_cdf[i] = sum;
+  }
+  for(i = 0; i < gUniqueWorkloadPaths; i++)
+    zipf_cdf[i] /= sum;
+
+  return 0;
+}
+
+int workload_set_mode(int new_mode){
+  switch(new_mode){
+  case WORKLOAD_SEQ:
+  case WORKLOAD_RND:
+  case WORKLOAD_HOTSPOT:
+    break;
+  case WORKLOAD_ZIPF:
+    if(build_zipf() < 0)
+      return -1;
+    break;
+  case WORKLOAD_TRACE:
+    if(!gHasTimestamps)
+      return -1;
+    break;
+  default:
+    return -1;
+  }
+
+  pthread_mutex_lock(&counter_mutex);
+  mode = new_mode;
+  counter = 0;
+  pthread_mutex_unlock(&counter_mutex);
+
+  return 0;
+}
+
+int workload_set_skew(double skew){
+  if(skew <= 0)
+    return -1;
+
+  zipf_skew = skew;
+  if(mode == WORKLOAD_ZIPF)
+    return build_zipf();
+
+  return 0;
+}
+
+int workload_set_hotspot(double fraction, double probability){
+  if(fraction <= 0 || fraction > 1 || probability < 0 || probability > 1)
+    return -1;
+
+  hot_fraction = fraction;
+  hot_probability = probability;
+  return 0;
+}
+
+size_t workload_num_unique_paths(){
   return gUniqueWorkloadPaths;
 }
 
-char* workload_get_path(){
-  int entry;
+static size_t uniform(size_t lo, size_t hi){
+  size_t index = lo + (size_t)(erand48(xsubi) * (hi - lo));
+  return index < hi ? index : hi - 1;
+}
+
+static size_t zipf_index(){
+  double u = erand48(xsubi);
+  size_t lo = 0, hi = gUniqueWorkloadPaths - 1, mid;
 
-  if(mode == WORKLOAD_RND)
-    return gWorkloadPathArray[(int)(1.0 * gUniqueWorkloadPaths * rand()/(RAND_MAX+1.0))];
+  while(lo < hi){
+    mid = lo + (hi - lo) / 2;
+    if(zipf_cdf[mid] < u)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static size_t hotspot_index(){
+  size_t hot = (size_t)ceil(hot_fraction * gUniqueWorkloadPaths);
+
+  if(hot >= gUniqueWorkloadPaths || erand48(xsubi) < hot_probability)
+    return uniform(0, hot);
+  return uniform(hot, gUniqueWorkloadPaths);
+}
+
+char* workload_get_entry(double *timestamp){
+  size_t entry, loop;
+  double span;
+
+  if(timestamp != NULL)
+    *timestamp = 0;
 
-  entry = __sync_fetch_and_add(&counter, 1);
+  switch(mode){
+  case WORKLOAD_RND:
+  case WORKLOAD_ZIPF:
+  case WORKLOAD_HOTSPOT:
+    pthread_mutex_lock(&counter_mutex);
+    if(mode == WORKLOAD_RND)
+      entry = uniform(0, gUniqueWorkloadPaths);
+    else if(mode == WORKLOAD_ZIPF)
+      entry = zipf_index();
+    else
+      entry = hotspot_index();
+    pthread_mutex_unlock(&counter_mutex);
+    return path_at(entry);
 
-  return gWorkloadPathArray[entry % gUniqueWorkloadPaths];
+  case WORKLOAD_TRACE:
+    entry = __sync_fetch_and_add(&counter, 1);
+    loop = entry / gUniqueWorkloadPaths;
+    entry %= gUniqueWorkloadPaths;
+    if(timestamp != NULL){
+      /* one average gap separates the end of a pass from the next one */
+      span = gTimestamps[gUniqueWorkloadPaths - 1] - gTimestamps[0];
+      span += gUniqueWorkloadPaths > 1 ? span / (gUniqueWorkloadPaths - 1) : 0;
+      *timestamp = gTimestamps[entry] - gTimestamps[0] + loop * span;
+    }
+    return path_at(entry);
 
-}
\ No newline at end of file
+  default:
+    entry = __sync_fetch_and_add(&counter, 1);
+    return path_at(entry % gUniqueWorkloadPaths);
+  }
+}
+
+char* workload_get_path(){
+  return workload_get_entry(NULL);
+}
+
+void workload_destroy(void) {
+  free(gPathArena);
+  free(gPathOffsets);
+  free(gTimestamps);
+  free(zipf_cdf);
+  gPathArena = NULL;
+  gPathOffsets = NULL;
+  gTimestamps = NULL;
+  zipf_cdf = NULL;
+  gArenaLen = gArenaCap = 0;
+  gUniqueWorkloadPaths = gPathCap = 0;
+}
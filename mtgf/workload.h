@@ -1,12 +1,20 @@
 #ifndef __WORKLOAD_H__
 #define __WORKLOAD_H__
 
+#include <stddef.h>
+
 #define WORKLOAD_SEQ 0
 #define WORKLOAD_RND 1
+#define WORKLOAD_ZIPF 2
+#define WORKLOAD_HOTSPOT 3
+#define WORKLOAD_TRACE 4
 
-/* 
+/*
  * Opens the file associated with the input argument
- * and reads in a list of paths to request. 
+ * and reads in a list of paths to request.  Each line holds a path,
+ * or a timestamp (seconds) followed by a path for a trace that can be
+ * replayed with WORKLOAD_TRACE; timestamps must not decrease from one line
+ * to the next.  There is no limit on the number of lines.
  */
 int workload_init(char *workload_path);
 
@@ -14,13 +22,36 @@ int workload_init(char *workload_path);
  * Sets the mode.  If WORKLOAD_SEQ, then workload getpath will
  * return the paths in sequence.  If WORKLOAD_RND, then
  * the paths will be chosen uniformly at random with replacement.
+ * WORKLOAD_ZIPF and WORKLOAD_HOTSPOT choose with replacement from a skewed
+ * distribution in which popularity follows the order of the file, the
+ * first path being the most popular.  WORKLOAD_TRACE replays the file in
+ * order along with its timestamps and requires every line to have one.
+ * Returns -1 if the mode is unknown or not possible for the loaded file.
  */
 int workload_set_mode(int mode);
 
+/*
+ * Parses "seq", "rnd", "zipf", "hotspot" or "trace".  Returns -1 if the
+ * name is not recognised.
+ */
+int workload_parse_mode(const char *name);
+
+/*
+ * Sets the Zipf exponent used by WORKLOAD_ZIPF (Default: 0.99).  Larger
+ * values concentrate more of the requests on the most popular paths.
+ */
+int workload_set_skew(double skew);
+
+/*
+ * Configures WORKLOAD_HOTSPOT so that the first hot_fraction of the paths
+ * receive hot_probability of the requests (Default: 0.2 and 0.8).
+ */
+int workload_set_hotspot(double hot_fraction, double hot_probability);
+
 /*
  * Returns the number of unique paths in the workload
  */
-unsigned short int workload_num_unique_paths();
+size_t workload_num_unique_paths();
 
 /*
  * Returns a path from the workload.  Whether this is
@@ -29,4 +60,17 @@ unsigned short int workload_num_unique_paths();
  */
 char* workload_get_path();
 
-#endif
\ No newline at end of file
+/*
+ * Like workload_get_path, but also returns the time in seconds, relative
+ * to the start of the workload, at which the path should be requested.
+ * Outside of WORKLOAD_TRACE the timestamp is always 0.  Traces wrap around
+ * with their timestamps shifted forward by the length of the trace.
+ */
+char* workload_get_entry(double *timestamp);
+
+/*
+ * Cleans up the workload package.
+ */
+void workload_destroy(void);
+
+#endif